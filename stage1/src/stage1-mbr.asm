@@ -9,6 +9,11 @@
 
 jmp 0x0000:start ; Far jump to start.
 
+;; Where stage2 is loaded. Some BIOSes cannot read across a 64K physical
+;; boundary, so stage2 starts at one, and can be up to 64K in size.
+;; Keep in sync with stage2's start.asm.
+STAGE2_LOAD_SEGMENT equ 0x2000
+
 ;; Disk address packet structure.
 struct_dap:
 	db 0x10 ; DAP length.
@@ -16,8 +21,8 @@ struct_dap:
 	db 0 ; Blocks to read, to be filled in by the installer (max 127).
 	db 0
 
-	dw 0x7e00 ; Destination offset.
-	dw 0x0000 ; Destination segment.
+	dw 0x0000              ; Destination offset.
+	dw STAGE2_LOAD_SEGMENT ; Destination segment.
 
 	dq 0 ; The stage2 LBA, to be filled in by the installer.
 
@@ -134,10 +139,12 @@ start:
 
 .magic_check:
 	mov si, s_stage2_magic
-	mov di, 0x7e00
+	mov ax, STAGE2_LOAD_SEGMENT
+	mov es, ax
+	xor di, di
 .magic_loop:
 	lodsb
-	mov bl, [di]
+	mov bl, [es:di]
 	inc di
 	cmp al, bl
 	jne .magic_error
@@ -148,7 +155,7 @@ start:
 	mov al, [u8_boot_device]
 	xor ah, ah
 	lea dx, [u64_loader_fs_id]
-	jmp 0x0000:(0x7e00 + s_stage2_magic_end - s_stage2_magic)
+	jmp STAGE2_LOAD_SEGMENT:(s_stage2_magic_end - s_stage2_magic)
 
 	.magic_error:
 		call putbr
@@ -20,7 +20,12 @@ typedef struct {
 	uint16_t com2IoPort;
 	uint16_t com3IoPort;
 
-	uint8_t _stuff[0x6d]; ///< @todo Describe other BDA fields.
+	uint8_t _stuff1[0x64]; ///< @todo Describe other BDA fields.
+
+	volatile uint32_t timerTicks; ///< PIT ticks since midnight (~18.2 Hz), updated by IRQ 0.
+	uint8_t  timerRollover;
+
+	uint8_t _stuff2[0x04]; ///< .
 
 	uint8_t hdCount; ///< Amount of installed hard disks.
 
@@ -111,12 +111,13 @@ int parseBootPathString(BootFilePath *bootFile, char *str) {
 		uint32_t partNo = atoi(str);
 		str   += numLen + 1;
 
-		if (diskNo >= diskCount || partNo >= disks[diskNo].partitionCount) {
+		Disk *disk = getDisk(diskNo);
+		if (!disk || partNo >= disk->partitionCount) {
 			printf("error: Boot file path disk/partition number out of range\n");
 			return 1;
 		}
 		bootFile->path      = str;
-		bootFile->partition = &disks[diskNo].partitions[partNo];
+		bootFile->partition = &disk->partitions[partNo];
 
 		printf("Selected boot file path: hd%u:%u, <%s>\n", diskNo, partNo, str);
 
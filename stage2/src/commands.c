@@ -12,6 +12,9 @@
 #include "boot.h"
 #include "memmap.h"
 #include "vbe.h"
+#include "bda.h"
+#include "disk/cache.h"
+#include "disk/trace.h"
 
 #define CMD_INCLUDE(name, helpText) { \
 		#name, \
@@ -32,13 +35,40 @@ Command commands[] = {
 \nClears the screen.\
 \n"
 	),
+	{
+		"disk-bench",
+ "usage: disk-bench PATH [BLOCKS]\
+\nReads a file, BLOCKS (default and at most 127, or 16 on disks with 4K\
+\nblocks) blocks per transfer, and prints the amount of disk transfers and\
+\ntime taken.\
+\n",
+		CMD_FUNCTION(disk_bench)
+	},
+	{
+		"disk-driver",
+ "usage: disk-driver DISK_NO bios\
+\nStops using a native driver for the given disk, reads go through the\
+\nBIOS from then on. Not possible for disks on controllers that a native\
+\ndriver has reset, or for md and LVM disks.\
+\n",
+		CMD_FUNCTION(disk_driver)
+	},
 	{
 		"disk-info",
  "usage: disk-info [DISK_NO]\
-\nPrints information about the given disk number.\
+\nPrints information about the given disk number, or block cache statistics.\
 \n",
 		CMD_FUNCTION(disk_info)
 	},
+	{
+		"disk-trace",
+ "usage: disk-trace [csv | bin]\
+\nPrints the most recent int13h calls. With `csv' or `bin', the trace is\
+\nwritten to the first serial port instead, as CSV or as a binary dump\
+\n(see stage2/src/disk/trace.h).\
+\n",
+		CMD_FUNCTION(disk_trace)
+	},
 	CMD_INCLUDE(
 		halt,
  "usage: halt\
@@ -64,6 +94,14 @@ Command commands[] = {
 \nTurns off interrupts and halts the processor.\
 \n"
 	),
+	{
+		"io-stats",
+ "usage: io-stats\
+\nPrints read statistics for every scanned disk and each of its partitions\
+\nthat was read from.\
+\n",
+		CMD_FUNCTION(io_stats)
+	},
 	{
 		"mem-info",
  "usage: mem-info\
@@ -137,6 +175,93 @@ CMD_DEF(cls) {
 	return 0;
 }
 
+CMD_DEF(disk_bench) {
+	if (!interactive)
+		return 1;
+
+	if (argc < 2 || argc > 3) {
+		printf("usage: disk-bench PATH [BLOCKS]\n");
+		return 1;
+	}
+
+	BootFilePath path;
+	if (parseBootPathString(&path, argv[1]))
+		return 1;
+
+	Partition *part = path.partition;
+	if (!part->fsDriver) {
+		printf("Partition has no FS driver\n");
+		return 1;
+	}
+
+	// The data is read into the bounce buffer, and thrown away.
+	uint32_t limit     = MIN(DISK_MAX_TRANSFER_BLOCKS, DISK_BOUNCE_BUFFER_SIZE / part->disk->blockSize);
+	uint32_t maxBlocks = argc == 3 ? (uint32_t)atoi(argv[2]) : limit;
+	if (!maxBlocks || maxBlocks > limit) {
+		printf("Block count must be within 1-%u\n", limit);
+		return 1;
+	}
+
+	FileInfo fileInfo;
+	memset(&fileInfo, 0, sizeof(FileInfo));
+
+	if (part->fsDriver->getFile(part, &fileInfo, path.path) != FS_SUCCESS
+			|| fileInfo.type != FILE_TYPE_REGULAR) {
+		printf("File not found\n");
+		return 1;
+	}
+
+	uint32_t startTicks     = bda->timerTicks;
+	uint32_t startTransfers = diskTransferCount;
+	uint32_t bytesRead      = 0;
+
+	while (bytesRead < fileInfo.size) {
+		// 32-bit arithmetic, there is no libgcc for 64-bit division.
+		uint32_t blocksLeft = ((uint32_t)fileInfo.size - bytesRead + part->disk->blockSize - 1) / part->disk->blockSize;
+		int ret = part->fsDriver->readFileBlocks(
+			&fileInfo,
+			DISK_BOUNCE_BUFFER_ADDR,
+			MIN(blocksLeft, maxBlocks)
+		);
+		if (ret <= 0) {
+			printf("Read error at offset %u\n", bytesRead);
+			return 1;
+		}
+		bytesRead += ret * part->disk->blockSize;
+	}
+
+	printf(
+		"Read %'uK in %u disk transfers, %u ms\n",
+		(uint32_t)fileInfo.size / 1024,
+		diskTransferCount - startTransfers,
+		(bda->timerTicks - startTicks) * 55
+	);
+
+	return 0;
+}
+
+CMD_DEF(disk_driver) {
+	if (argc != 3 || !streq(argv[2], "bios")) {
+		printf("usage: disk-driver DISK_NO bios\n");
+		return 1;
+	}
+
+	Disk *disk = getDisk(atoi(argv[1]));
+	if (!disk) {
+		printf("Disk number out of range\n");
+		return 1;
+	}
+
+	if (disk->virtual || disk->biosLost) {
+		printf("Disk hd%u cannot be read through the BIOS\n", disk->diskNo);
+		return 1;
+	}
+
+	diskDropDriver(disk);
+
+	return 0;
+}
+
 static void printDiskInfo(Disk *disk) {
 	if (!disk->available) {
 		printf("Disk hd%u is unavailable.\n", disk->diskNo);
@@ -153,7 +278,7 @@ static void printDiskInfo(Disk *disk) {
 			putch('-');
 		putch('\n');
 
-		for (uint32_t i=0; i<MIN(disk->partitionCount, DISK_MAX_PARTITIONS_PER_DISK); i++) {
+		for (uint32_t i=0; i<disk->partitionCount; i++) {
 			Partition *part = &disk->partitions[i];
 
 			printf("hd%u:%u %#04x.%08x - %#04x.%08x %02xh %c %'9uM %8s %12s\n",
@@ -164,7 +289,7 @@ static void printDiskInfo(Disk *disk) {
 				part->type, part->active ? '*' : ' ',
 				part->blockCount >> 32
 					? 0
-					: (uint32_t)part->blockCount / 1024 * 512 / 1024,
+					: (uint32_t)part->blockCount / 1024 * disk->blockSize / 1024,
 				part->fsDriver ? part->fsDriver->name : "",
 				part->fsLabel
 			);
@@ -174,6 +299,27 @@ static void printDiskInfo(Disk *disk) {
 		printf("No partitions were found on disk hd%u\n\n", disk->diskNo);
 	}
 
+	if (disk->virtual)
+		printf("Disk hd%u is a virtual disk, read through the %s driver\n", disk->diskNo, disk->driver->name);
+	else if (disk->driver)
+		printf("Disk hd%u is read through the native %s driver\n", disk->diskNo, disk->driver->name);
+	else
+		printf(
+			"Disk hd%u is read through the BIOS, %u blocks per transfer%s\n",
+			disk->diskNo, disk->biosMaxTransferBlocks,
+			disk->biosFlatAddressing ? ", flat addressing" : ""
+		);
+
+	if (disk->path.valid)
+		printf(
+			"Disk hd%u is at %s %08x.%08x, %s %08x.%08x\n",
+			disk->diskNo,
+			disk->path.busType,
+			(uint32_t)(disk->path.interfacePath >> 32), (uint32_t)disk->path.interfacePath,
+			disk->path.interfaceType,
+			(uint32_t)(disk->path.devicePath >> 32), (uint32_t)disk->path.devicePath
+		);
+
 	if (disk->blockCount >> 32) {
 		printf(
 			"Disk hd%u has more than %'uM blocks of %'u bytes,\ntotalling more than %'u GiB.\n",
@@ -197,6 +343,15 @@ CMD_DEF(disk_info) {
 		return 1;
 
 	if (argc == 1) {
+		if (diskCacheStats.blocks)
+			printf(
+				"Block cache: %u blocks, %u hits, %u misses, %u evictions\n",
+				diskCacheStats.blocks,
+				diskCacheStats.hits,
+				diskCacheStats.misses,
+				diskCacheStats.evictions
+			);
+
 		if (diskCount == 1) {
 			// Re-run for the single detected disk.
 			char argn[] = "0";
@@ -207,9 +362,9 @@ CMD_DEF(disk_info) {
 		}
 		return 0;
 	} else if (argc == 2) {
-		uint32_t diskNo = atoi(argv[1]);
-		if (diskNo < diskCount) {
-			printDiskInfo(&disks[diskNo]);
+		Disk *disk = getDisk(atoi(argv[1]));
+		if (disk) {
+			printDiskInfo(disk);
 			return 0;
 		} else {
 			printf("Disk number out of range\n");
@@ -221,6 +376,81 @@ CMD_DEF(disk_info) {
 	}
 }
 
+CMD_DEF(disk_trace) {
+	if (!interactive)
+		return 1;
+
+	bool csv    = argc == 2 && streq(argv[1], "csv");
+	bool binary = argc == 2 && streq(argv[1], "bin");
+
+	if (argc > 2 || (argc == 2 && !csv && !binary)) {
+		printf("usage: disk-trace [csv | bin]\n");
+		return 1;
+	}
+
+	uint32_t firstSeq = diskTraceTotal > CONFIG_DISK_TRACE_ENTRIES
+		? diskTraceTotal - CONFIG_DISK_TRACE_ENTRIES
+		: 0;
+
+	if (!diskTraceGet(firstSeq)) {
+		printf("The trace is empty\n");
+		return 0;
+	}
+
+	if ((csv || binary) && !consoleRedirectSerial(true)) {
+		printf("No serial port available\n");
+		return 1;
+	}
+
+	if (binary) {
+		DiskTraceHeader header;
+		memcpy(header.magic, DISK_TRACE_MAGIC, sizeof(header.magic));
+		header.version    = DISK_TRACE_VERSION;
+		header.entrySize  = sizeof(DiskTraceEntry);
+		header.entryCount = diskTraceTotal - firstSeq;
+		header.firstSeq   = firstSeq;
+
+		serialWrite((uint32_t)&header, sizeof(header));
+	} else if (csv) {
+		printf("seq,disk,function,result,lba,blocks,dest,cycles\n");
+	} else {
+		int ret = printf("%8s %4s %3s %3s %18s %6s %10s %10s\n",
+		                 "Seq", "Disk", "AH", "Res", "LBA", "Blocks", "Dest", "Cycles");
+		for (int i=0; i<ret-1; i++)
+			putch('-');
+		putch('\n');
+	}
+
+	for (uint32_t seq=firstSeq; seq<diskTraceTotal; seq++) {
+		DiskTraceEntry *entry = diskTraceGet(seq);
+
+		if (binary) {
+			serialWrite((uint32_t)entry, sizeof(DiskTraceEntry));
+		} else {
+			printf(
+				csv
+					? "%u,%02x,%02x,%02x,0x%08x%08x,%u,0x%08x,%u\n"
+					: "%8u  %02xh %02xh %02xh 0x%08x%08x %6u 0x%08x %10u\n",
+				seq,
+				entry->biosId,
+				entry->function,
+				entry->result,
+				(uint32_t)(entry->lba >> 32), (uint32_t)entry->lba,
+				entry->blockCount,
+				entry->dest,
+				entry->cycles
+			);
+		}
+	}
+
+	if (csv || binary) {
+		consoleRedirectSerial(false);
+		printf("Wrote %u trace entries to the serial port\n", diskTraceTotal - firstSeq);
+	}
+
+	return 0;
+}
+
 CMD_DEF(halt) {
 	if (!interactive)
 		return 1;
@@ -275,23 +505,97 @@ CMD_DEF(hang) {
 	hang();
 }
 
+/**
+ * \brief Print one line of I/O statistics.
+ *
+ * \param disk
+ * \param part NULL for the disk's own counters
+ * \param cyclesPerTick TSC ticks per PIT tick, 0 if unknown
+ */
+static void printIoStats(Disk *disk, Partition *part, uint32_t cyclesPerTick) {
+	IoStats *stats = part ? &part->stats : &disk->stats;
+
+	// No 64-bit division available, scale down by 1K before converting to ms.
+	uint32_t cycles = stats->cycles >> 10;
+	uint32_t scale  = cyclesPerTick >> 10;
+	uint32_t ms     = scale
+		? cycles / scale * 55 + cycles % scale * 55 / scale
+		: 0;
+
+	int length = part
+		? printf("hd%u:%u", disk->diskNo, part->partitionNo)
+		: printf("hd%u", disk->diskNo);
+	while (length++ < 8)
+		putch(' ');
+
+	printf(
+		" %'8u %'11u %'10uK %6u %7u %'8u\n",
+		stats->calls,
+		(uint32_t)stats->blocks,
+		(uint32_t)(stats->bytes >> 10),
+		stats->errors,
+		stats->largestBlocks,
+		ms
+	);
+}
+
+CMD_DEF(io_stats) {
+	if (!interactive)
+		return 1;
+
+	// Calibrate the TSC against one PIT tick (~55ms).
+	uint32_t tick = bda->timerTicks;
+	while (bda->timerTicks == tick)
+		halt();
+	uint64_t startTsc = rdtsc();
+	tick = bda->timerTicks;
+	while (bda->timerTicks == tick)
+		halt();
+	uint32_t cyclesPerTick = rdtsc() - startTsc;
+
+	int ret = printf(
+		"Device   %8s %11s %11s %6s %7s %8s\n",
+		"Calls", "Blocks", "Bytes", "Errors", "Largest", "ms"
+	);
+	for (int i=0; i<ret-1; i++)
+		putch('-');
+	putch('\n');
+
+	for (uint32_t i=0; i<diskCount; i++) {
+		Disk *disk = &disks[i];
+		if (!disk->scanned)
+			continue;
+
+		printIoStats(disk, NULL, cyclesPerTick);
+
+		for (uint32_t j=0; j<disk->partitionCount; j++) {
+			if (disk->partitions[j].stats.calls)
+				printIoStats(disk, &disk->partitions[j], cyclesPerTick);
+		}
+	}
+
+	printf("\n%u int13h transfers in total\n", diskTransferCount);
+	if (!cyclesPerTick)
+		printf("Times are unavailable, this CPU has no TSC\n");
+
+	return 0;
+}
+
 CMD_DEF(mem_info) {
 	if (!interactive)
 		return 1;
 
-	for (uint32_t i=0; i<MEMMAP_MAX_REGIONS; i++) {
-		if (!memMap.regions[i].length)
-			// Indicates the end of our memory map.
-			break;
+	for (uint32_t i=0; i<memMap.regionCount; i++) {
+		MemMapRegion *region = &memMap.regions[i];
 
 		printf(
 			"starting at %#08x.%08x, %s%'12uK = %s\n",
-			(uint32_t)(memMap.regions[i].start >> 32),
-			(uint32_t) memMap.regions[i].start,
-			memMap.regions[i].length >> 32 ? ">" : "",
-			memMap.regions[i].length >> 32 ? 0xffffffff : (uint32_t)memMap.regions[i].length / 1024,
+			(uint32_t)(region->start >> 32),
+			(uint32_t) region->start,
+			region->length >> 32 ? ">" : "",
+			region->length >> 32 ? 0xffffffff : (uint32_t)region->length / 1024,
 
-			  memMap.regions[i].type == MEMORY_REGION_TYPE_FREE
+			  region->type == MEMORY_REGION_TYPE_FREE
 			? "free"
 			: "reserved"
 		);
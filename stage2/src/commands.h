@@ -38,11 +38,15 @@ extern Command commands[];
 
 CMD_DECL(boot);
 CMD_DECL(cls);
+CMD_DECL(disk_bench);
+CMD_DECL(disk_driver);
 CMD_DECL(disk_info);
+CMD_DECL(disk_trace);
 CMD_DECL(halt);
 CMD_DECL(hello);
 CMD_DECL(help);
 CMD_DECL(hang);
+CMD_DECL(io_stats);
 CMD_DECL(mem_info);
 CMD_DECL(set);
 CMD_DECL(unset);
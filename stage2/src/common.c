@@ -69,11 +69,62 @@ void printStackState() {
 	printf("debug: Stack is at %#08x\n", sp);
 }
 
+uint64_t rdtsc() {
+	static bool checked   = false;
+	static bool available = false;
+
+	if (!checked) {
+		checked = true;
+
+		// CPUID exists if the ID flag in EFLAGS can be toggled.
+		uint32_t flags;
+		uint32_t toggled;
+		asm volatile (
+			"pushfl\n"
+			"popl %0\n"
+			"movl %0, %1\n"
+			"xorl $0x200000, %1\n"
+			"pushl %1\n"
+			"popfl\n"
+			"pushfl\n"
+			"popl %1\n"
+			"pushl %0\n"
+			"popfl\n"
+			: "=&r" (flags),
+			  "=&r" (toggled)
+			:
+			: "cc"
+		);
+
+		if ((flags ^ toggled) & 0x200000) {
+			uint32_t eax = 1, ebx, ecx, edx;
+			asm volatile (
+				"cpuid"
+				: "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			);
+			available = !!(edx & 0x10);
+		}
+	}
+
+	if (!available)
+		return 0;
+
+	uint32_t low;
+	uint32_t high;
+	asm volatile (
+		"rdtsc"
+		: "=a" (low),
+		  "=d" (high)
+	);
+
+	return (uint64_t)high << 32 | low;
+}
+
 void *memset(void *mem, uint8_t c, size_t length) {
 	if (length)
 		asm volatile (
-			".mloop1: stosb\n"
-			"loop .mloop1\n"
+			".mloop1: addr32 stosb\n"
+			"addr32 loop .mloop1\n"
 			:
 			: "a" (c),
 			  "c" (length),
@@ -87,8 +138,8 @@ void *memset(void *mem, uint8_t c, size_t length) {
 void *memcpy(void *dest, const void *source, size_t length) {
 	if (length)
 		asm volatile (
-			".mloop2: movsb\n"
-			"loop .mloop2\n"
+			".mloop2: addr32 movsb\n"
+			"addr32 loop .mloop2\n"
 			:
 			: "c" (length),
 			  "D" (dest),
@@ -104,9 +155,9 @@ bool memeq(const void *source1, const void *source2, size_t length) {
 
 	if (length) {
 		asm volatile (
-			".mloop3: cmpsb\n"
+			".mloop3: addr32 cmpsb\n"
 			"jne .unequal\n"
-			"loop .mloop3\n"
+			"addr32 loop .mloop3\n"
 			"jmp .equal\n"
 			".unequal:\n"
 			"xor %0, %0\n"
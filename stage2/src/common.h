@@ -16,6 +16,7 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define CLAMP(n, min, max) (MIN(MAX((n), (min)), (max)))
 #define ELEMS(a) (sizeof(a) / sizeof((a)[0]))
+#define offsetof(type, member) __builtin_offsetof(type, member)
 
 #include "types.h"
 #include "panic.h"
@@ -48,6 +49,13 @@ void msleep(uint32_t millis);
  */
 void printStackState();
 
+/**
+ * \brief Read the CPU's time-stamp counter.
+ *
+ * \return the TSC, or 0 if the CPU does not have one (pre-Pentium)
+ */
+uint64_t rdtsc();
+
 /**
  * \brief Set length bytes starting at mem to c.
  *
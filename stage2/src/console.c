@@ -6,6 +6,7 @@
  * \license   MIT. See LICENSE for the full license text.
  */
 #include "console.h"
+#include "bda.h"
 #include <stdarg.h>
 
 uint8_t consolePage      = 0;
@@ -13,10 +14,8 @@ uint8_t consoleWidth     = 80;
 uint8_t consoleHeight    = 25;
 uint8_t consoleAttribute = 0x00;
 
-#if CONFIG_CONSOLE_SERIAL_IO
-#include "bda.h"
-
 static bool serialDeviceInitialized = false;
+static bool serialRedirected        = false;
 
 static void initCom0() {
 	asm volatile (
@@ -33,23 +32,38 @@ static inline bool isSerialIoAvailable() {
 	return bda->com0IoPort != 0;
 }
 
-#endif /* CONFIG_CONSOLE_SERIAL_IO */
+static void serialPutch(char ch) {
+	if (!serialDeviceInitialized)
+		initCom0();
+
+	asm volatile (
+		"int $0x14"
+		:
+		: "a" (0x01 << 8 | (uint8_t)ch),
+		  "d" (0)
+		: "cc"
+	);
+}
+
+bool consoleRedirectSerial(bool enable) {
+	if (enable && !isSerialIoAvailable())
+		return false;
+
+	serialRedirected = enable;
+	return true;
+}
+
+void serialWrite(uint32_t data, size_t length) {
+	for (const uint8_t *p = (const uint8_t*)data; length--; p++)
+		serialPutch(*p);
+}
 
 static void doPutch(char ch) {
-#if CONFIG_CONSOLE_SERIAL_IO
-	if (isSerialIoAvailable()) {
-		if (!serialDeviceInitialized)
-			initCom0();
+	if (serialRedirected || (CONFIG_CONSOLE_SERIAL_IO && isSerialIoAvailable())) {
+		serialPutch(ch);
+		return;
+	}
 
-		asm volatile (
-			"int $0x14"
-			:
-			: "a" (0x01 << 8 | ch),
-			  "d" (0)
-			: "cc"
-		);
-	} else {
-#endif /* CONFIG_CONSOLE_SERIAL_IO */
 	asm volatile (
 		"int $0x10"
 		:
@@ -61,9 +75,6 @@ static void doPutch(char ch) {
 		  ))
 		: "cc"
 	);
-#if CONFIG_CONSOLE_SERIAL_IO
-	}
-#endif /* CONFIG_CONSOLE_SERIAL_IO */
 }
 
 void putch(char ch) {
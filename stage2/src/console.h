@@ -30,6 +30,28 @@ typedef struct {
 	uint8_t scanCode;
 } Key;
 
+/**
+ * \brief Send console output to the first serial port, instead of the screen.
+ *
+ * Useful for dumping data for offline analysis, regardless of
+ * CONFIG_CONSOLE_SERIAL_IO.
+ *
+ * \param enable
+ *
+ * \return false if redirection was requested but there is no serial port
+ */
+bool consoleRedirectSerial(bool enable);
+
+/**
+ * \brief Write raw bytes to the first serial port.
+ *
+ * Unlike putch(), this does not translate newlines.
+ *
+ * \param data any address below 4G
+ * \param length
+ */
+void serialWrite(uint32_t data, size_t length);
+
 /**
  * \brief Prints a single character.
  *
@@ -0,0 +1,82 @@
+/**
+ * \file
+ * \brief     CRC-32 checksums.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "crc32.h"
+#include "heap.h"
+
+#define CRC32_POLYNOMIAL 0xedb88320 ///< Reflected.
+
+/**
+ * \brief Slice-by-8 tables, 8K in the loader heap.
+ *
+ * tables[0] is the classic bytewise table, tables[k] advances a byte through
+ * k more zero bytes.
+ */
+static uint32_t (*tables)[256] = NULL;
+
+/**
+ * \brief Generate the lookup tables.
+ *
+ * \return zero on success, non-zero if the heap is exhausted
+ */
+static int crc32Init() {
+	tables = heapAlloc(8 * sizeof(*tables));
+	if (!tables)
+		return -1;
+
+	for (uint32_t i=0; i<256; i++) {
+		uint32_t crc = i;
+		for (uint32_t j=0; j<8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+		tables[0][i] = crc;
+	}
+
+	for (uint32_t i=0; i<256; i++) {
+		for (uint32_t k=1; k<8; k++)
+			tables[k][i] = (tables[k-1][i] >> 8) ^ tables[0][tables[k-1][i] & 0xff];
+	}
+
+	return 0;
+}
+
+uint32_t crc32(uint32_t crc, uint32_t data, uint32_t length) {
+	const uint8_t *p = (const uint8_t*)data;
+
+	crc = ~crc;
+
+	if (!tables && crc32Init()) {
+		// Slow, but correct.
+		while (length--) {
+			crc ^= *p++;
+			for (uint32_t j=0; j<8; j++)
+				crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+		}
+		return ~crc;
+	}
+
+	for (; length && (uint32_t)p & 3; length--)
+		crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xff];
+
+	for (; length >= 8; length -= 8, p += 8) {
+		uint32_t one = ((const uint32_t*)p)[0] ^ crc;
+		uint32_t two = ((const uint32_t*)p)[1];
+
+		crc = tables[7][ one        & 0xff]
+		    ^ tables[6][(one >>  8) & 0xff]
+		    ^ tables[5][(one >> 16) & 0xff]
+		    ^ tables[4][ one >> 24        ]
+		    ^ tables[3][ two        & 0xff]
+		    ^ tables[2][(two >>  8) & 0xff]
+		    ^ tables[1][(two >> 16) & 0xff]
+		    ^ tables[0][ two >> 24        ];
+	}
+
+	while (length--)
+		crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
@@ -0,0 +1,27 @@
+/**
+ * \file
+ * \brief     CRC-32 checksums.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include "common.h"
+
+/**
+ * \brief Calculate a CRC-32 (IEEE 802.3, as used by GPT and zlib).
+ *
+ * Uses slice-by-8 lookup tables, which are generated in the loader heap on
+ * first use.
+ *
+ * \param crc the CRC of the preceding data, or 0 to start a new checksum
+ * \param data any address below 4G
+ * \param length
+ *
+ * \return the updated CRC
+ */
+uint32_t crc32(uint32_t crc, uint32_t data, uint32_t length);
+
+#endif /* _CRC32_H */
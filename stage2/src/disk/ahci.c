@@ -0,0 +1,456 @@
+/**
+ * \file
+ * \brief     Native AHCI SATA disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "ahci.h"
+
+#if CONFIG_DISK_AHCI
+
+#include "pci.h"
+#include "bda.h"
+#include "heap.h"
+#include "far.h"
+
+#define AHCI_MAX_PORTS 8
+
+/// Commands queued per read call.
+#define AHCI_MAX_QUEUED        4
+/// PRD entries per command table.
+#define AHCI_PRDT_ENTRIES      2
+/// Bytes per PRD entry, the maximum the HBA allows.
+#define AHCI_PRD_MAX_BYTES     (4 * 1024 * 1024)
+/// Sectors per command, fills the PRD table.
+#define AHCI_MAX_COMMAND_BLOCKS (AHCI_PRDT_ENTRIES * AHCI_PRD_MAX_BYTES / 512)
+
+/// Command timeout in PIT ticks (~5 seconds).
+#define AHCI_TIMEOUT_TICKS 91
+
+// HBA registers (dword indices).
+#define AHCI_HBA_CAP 0
+#define AHCI_HBA_GHC 1
+#define AHCI_HBA_PI  3
+
+#define AHCI_CAP_SNCQ (1U << 30)
+#define AHCI_GHC_AE   (1U << 31)
+
+// Port registers (dword indices).
+#define AHCI_PX_CLB  0
+#define AHCI_PX_CLBU 1
+#define AHCI_PX_FB   2
+#define AHCI_PX_FBU  3
+#define AHCI_PX_IS   4
+#define AHCI_PX_IE   5
+#define AHCI_PX_CMD  6
+#define AHCI_PX_TFD  8
+#define AHCI_PX_SIG  9
+#define AHCI_PX_SSTS 10
+#define AHCI_PX_SERR 12
+#define AHCI_PX_SACT 13
+#define AHCI_PX_CI   14
+
+#define AHCI_PX_CMD_ST  (1U <<  0)
+#define AHCI_PX_CMD_FRE (1U <<  4)
+#define AHCI_PX_CMD_FR  (1U << 14)
+#define AHCI_PX_CMD_CR  (1U << 15)
+
+#define AHCI_PX_IS_ERRORS 0x7d800010 ///< TFES, HBFS, HBDS, IFS, INFS, OFS, UFS.
+
+#define AHCI_SIG_ATA 0x00000101
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_IDENTIFY          0xec
+
+/**
+ * \brief Command list entry.
+ */
+typedef struct {
+	uint16_t flags;    ///< CFL in bits 0-4, W in bit 6.
+	uint16_t prdtLength;
+	uint32_t prdByteCount;
+	uint32_t tableAddr;
+	uint32_t tableAddrHigh;
+	uint32_t _reserved[4];
+} __attribute__((packed)) AhciCommandHeader;
+
+/**
+ * \brief Physical Region Descriptor.
+ */
+typedef struct {
+	uint32_t address;
+	uint32_t addressHigh;
+	uint32_t _reserved;
+	uint32_t byteCount; ///< Minus one.
+} __attribute__((packed)) AhciPrd;
+
+/**
+ * \brief Command table, with a register host-to-device FIS.
+ */
+typedef struct {
+	uint8_t  fisType; ///< 27h.
+	uint8_t  fisFlags; ///< Bit 7 set for commands.
+	uint8_t  command;
+	uint8_t  featuresLow;
+	uint8_t  lba[3];
+	uint8_t  device;
+	uint8_t  lbaHigh[3];
+	uint8_t  featuresHigh;
+	uint16_t count;
+	uint8_t  _reserved1[50];
+	uint8_t  atapiCommand[16];
+	uint8_t  _reserved2[48];
+	AhciPrd  prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) AhciCommandTable;
+
+typedef struct {
+	uint32_t pciAddress;     ///< The HBA.
+	uint8_t  portNo;
+	volatile uint32_t *regs; ///< Port registers.
+	AhciCommandHeader *commandList;
+	AhciCommandTable  *commandTables; ///< One for each queued command.
+	uint8_t           *fisArea;
+	uint64_t sectorCount;
+	uint8_t  queueDepth; ///< Commands in flight per read, 1 without NCQ.
+	bool     ncq;
+	bool     owned;   ///< Whether our command list is installed.
+	bool     claimed;
+	uint32_t biosClb;
+	uint32_t biosFb;
+	uint32_t biosCmd;
+	uint32_t biosIe;
+} AhciPort;
+
+static AhciPort ports[AHCI_MAX_PORTS];
+static uint32_t portCount = 0;
+static bool     probed    = false;
+
+/**
+ * \brief Wait until the given register bits are all clear.
+ *
+ * \return zero on success, non-zero on timeout or port error
+ */
+static int ahciWaitClear(AhciPort *port, uint32_t reg, uint32_t bits) {
+	uint32_t start = bda->timerTicks;
+
+	while (port->regs[reg] & bits) {
+		if (port->regs[AHCI_PX_IS] & AHCI_PX_IS_ERRORS)
+			return -1;
+		if (bda->timerTicks - start >= AHCI_TIMEOUT_TICKS)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Stop a port's command engine and FIS receiver.
+ */
+static int ahciStopPort(AhciPort *port) {
+	port->regs[AHCI_PX_CMD] &= ~AHCI_PX_CMD_ST;
+	if (ahciWaitClear(port, AHCI_PX_CMD, AHCI_PX_CMD_CR))
+		return -1;
+	port->regs[AHCI_PX_CMD] &= ~AHCI_PX_CMD_FRE;
+	return ahciWaitClear(port, AHCI_PX_CMD, AHCI_PX_CMD_FR);
+}
+
+/**
+ * \brief Install our command list on a port, saving the BIOS's.
+ */
+static int ahciTakePort(AhciPort *port) {
+	if (port->owned)
+		return 0;
+
+	port->biosClb = port->regs[AHCI_PX_CLB];
+	port->biosFb  = port->regs[AHCI_PX_FB];
+	port->biosCmd = port->regs[AHCI_PX_CMD];
+	port->biosIe  = port->regs[AHCI_PX_IE];
+
+	if (ahciStopPort(port))
+		return -1;
+
+	port->regs[AHCI_PX_IE]   = 0; // We poll.
+	port->regs[AHCI_PX_CLB]  = (uint32_t)port->commandList;
+	port->regs[AHCI_PX_CLBU] = 0;
+	port->regs[AHCI_PX_FB]   = (uint32_t)port->fisArea;
+	port->regs[AHCI_PX_FBU]  = 0;
+	port->regs[AHCI_PX_SERR] = 0xffffffff;
+	port->regs[AHCI_PX_IS]   = 0xffffffff;
+	port->regs[AHCI_PX_CMD] |= AHCI_PX_CMD_FRE;
+	port->regs[AHCI_PX_CMD] |= AHCI_PX_CMD_ST;
+
+	port->owned = true;
+	return 0;
+}
+
+/**
+ * \brief Reinstall the BIOS's command list on a port.
+ */
+static void ahciReturnPort(AhciPort *port) {
+	if (!port->owned)
+		return;
+
+	ahciStopPort(port);
+
+	port->regs[AHCI_PX_CLB]  = port->biosClb;
+	port->regs[AHCI_PX_FB]   = port->biosFb;
+	port->regs[AHCI_PX_SERR] = 0xffffffff;
+	port->regs[AHCI_PX_IS]   = 0xffffffff;
+	port->regs[AHCI_PX_IE]   = port->biosIe;
+	port->regs[AHCI_PX_CMD] |= port->biosCmd & AHCI_PX_CMD_FRE;
+	port->regs[AHCI_PX_CMD] |= port->biosCmd & AHCI_PX_CMD_ST;
+
+	port->owned = false;
+}
+
+/**
+ * \brief Fill command slot `slot` for a read into a contiguous destination.
+ */
+static void ahciSetupCommand(
+		AhciPort *port,
+		uint32_t slot,
+		uint8_t  command,
+		uint32_t dest,
+		uint64_t lba,
+		uint32_t count
+	) {
+	AhciCommandTable  *table  = &port->commandTables[slot];
+	AhciCommandHeader *header = &port->commandList[slot];
+
+	farzero((uint32_t)table, sizeof(AhciCommandTable));
+
+	uint32_t bytes = count * 512;
+	uint16_t prds  = 0;
+	for (; bytes; prds++) {
+		uint32_t chunk = MIN(bytes, AHCI_PRD_MAX_BYTES);
+		table->prdt[prds].address   = dest;
+		table->prdt[prds].byteCount = chunk - 1;
+		dest  += chunk;
+		bytes -= chunk;
+	}
+
+	table->fisType  = 0x27;
+	table->fisFlags = 0x80;
+	table->command  = command;
+	table->device   = 0x40; // LBA mode.
+	table->lba[0]     = lba;
+	table->lba[1]     = lba >>  8;
+	table->lba[2]     = lba >> 16;
+	table->lbaHigh[0] = lba >> 24;
+	table->lbaHigh[1] = lba >> 32;
+	table->lbaHigh[2] = lba >> 40;
+
+	if (command == ATA_CMD_READ_FPDMA_QUEUED) {
+		// The sector count moves to the features field, the tag takes its place.
+		table->featuresLow  = count;
+		table->featuresHigh = count >> 8;
+		table->count        = slot << 3;
+	} else {
+		table->count = count;
+	}
+
+	header->flags        = 5; // FIS length in dwords, device-to-host.
+	header->prdtLength   = prds;
+	header->prdByteCount = 0;
+	header->tableAddr    = (uint32_t)table;
+	header->tableAddrHigh = 0;
+}
+
+/**
+ * \brief Issue the prepared commands in `slots` and wait for them to finish.
+ */
+static int ahciRun(AhciPort *port, uint32_t slots, bool queued) {
+	asm volatile ("" ::: "memory"); // Command tables must be in memory before they are issued.
+	port->regs[AHCI_PX_IS] = 0xffffffff;
+
+	if (queued)
+		port->regs[AHCI_PX_SACT] = slots;
+	port->regs[AHCI_PX_CI] = slots;
+
+	if (ahciWaitClear(port, queued ? AHCI_PX_SACT : AHCI_PX_CI, slots))
+		return -1;
+
+	return port->regs[AHCI_PX_TFD] & 0x01 ? -1 : 0;
+}
+
+/**
+ * \brief Identify the device on a port.
+ *
+ * \return whether a usable ATA disk was found
+ */
+static bool ahciIdentify(AhciPort *port, bool hbaNcq) {
+	uint16_t *id = heapAlloc(512);
+	if (!id || ahciTakePort(port))
+		return false;
+
+	ahciSetupCommand(port, 0, ATA_CMD_IDENTIFY, (uint32_t)id, 0, 1);
+	int ret = ahciRun(port, 1, false);
+
+	ahciReturnPort(port);
+
+	if (ret)
+		return false;
+
+	if (!(id[83] & (1 << 10)))
+		return false; // No LBA48, not worth the trouble for a boot disk.
+
+	port->sectorCount = (uint64_t)id[103] << 48 | (uint64_t)id[102] << 32 | (uint32_t)id[101] << 16 | id[100];
+	port->ncq         = hbaNcq && (id[76] & (1 << 8));
+	port->queueDepth  = port->ncq ? MIN((id[75] & 0x1f) + 1, AHCI_MAX_QUEUED) : 1;
+
+	return true;
+}
+
+/**
+ * \brief Find AHCI controllers and the disks attached to them.
+ */
+static void ahciProbe() {
+	uint32_t addr = PCI_ADDRESS_NONE;
+
+	while (pciNextFunction(&addr) && portCount < AHCI_MAX_PORTS) {
+		if ((pciRead(addr, PCI_REG_CLASS) >> 8) != 0x010601)
+			continue; // Not an AHCI controller.
+
+		volatile uint32_t *hba = (uint32_t*)pciGetBar(addr, 5);
+		if (!hba)
+			continue;
+
+		pciEnable(addr, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+		hba[AHCI_HBA_GHC] |= AHCI_GHC_AE;
+
+		uint32_t implemented = hba[AHCI_HBA_PI];
+		bool     hbaNcq      = !!(hba[AHCI_HBA_CAP] & AHCI_CAP_SNCQ);
+
+		for (uint32_t i=0; i<32 && portCount < AHCI_MAX_PORTS; i++) {
+			if (!(implemented & (1U << i)))
+				continue;
+
+			AhciPort *port = &ports[portCount];
+			memset(port, 0, sizeof(AhciPort));
+			port->pciAddress = addr;
+			port->portNo     = i;
+			port->regs       = hba + (0x100 + i * 0x80) / 4;
+
+			if ((port->regs[AHCI_PX_SSTS] & 0x0f) != 3 || port->regs[AHCI_PX_SIG] != AHCI_SIG_ATA)
+				continue; // No ATA device attached.
+
+			// Command list needs 1K alignment, the FIS area 256 and command tables 128.
+			uint32_t mem = (uint32_t)heapAlloc(
+				0x400 + 32 * sizeof(AhciCommandHeader) + 0x100
+				+ AHCI_MAX_QUEUED * sizeof(AhciCommandTable) + 0x80
+			);
+			if (!mem)
+				return;
+
+			mem = (mem + 0x3ff) & ~0x3ff;
+			port->commandList   = (AhciCommandHeader*)mem;
+			port->fisArea       = (uint8_t*)(mem + 32 * sizeof(AhciCommandHeader));
+			port->commandTables = (AhciCommandTable*)(((uint32_t)port->fisArea + 0x100 + 0x7f) & ~0x7f);
+
+			if (ahciIdentify(port, hbaNcq))
+				portCount++;
+		}
+	}
+}
+
+static int ahciRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	AhciPort *port = disk->driverData;
+
+	if (lba + blockCount > port->sectorCount || ahciTakePort(port))
+		return -1;
+
+	// Queue as many commands as the device takes, then wait for all of them.
+	while (blockCount) {
+		uint32_t slots = 0;
+		for (uint32_t slot=0; slot<port->queueDepth && blockCount; slot++) {
+			uint32_t count = MIN(blockCount, AHCI_MAX_COMMAND_BLOCKS);
+
+			ahciSetupCommand(
+				port, slot,
+				port->ncq ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_READ_DMA_EXT,
+				dest, lba, count
+			);
+			slots |= 1U << slot;
+
+			dest       += count * 512;
+			lba        += count;
+			blockCount -= count;
+		}
+		if (ahciRun(port, slots, port->ncq))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void ahciRelease(Disk *disk) {
+	AhciPort *port = disk->driverData;
+	ahciReturnPort(port);
+	port->claimed = false;
+}
+
+/**
+ * \brief Check whether a port could hold a disk, according to its EDD device path.
+ *
+ * \return false if the BIOS places the disk elsewhere, true if it does not
+ *         tell, or if the port matches
+ */
+static bool ahciMatchesPath(AhciPort *port, Disk *disk) {
+	if (disk->pciAddress != PCI_ADDRESS_NONE && disk->pciAddress != port->pciAddress)
+		return false;
+
+	if (disk->path.valid && streq(disk->path.interfaceType, "SATA"))
+		return (uint8_t)disk->path.devicePath == port->portNo;
+
+	return true;
+}
+
+static bool ahciClaim(Disk *disk) {
+	if (!probed) {
+		ahciProbe();
+		probed = true;
+	}
+
+	if (disk->blockSize != 512)
+		return false;
+
+	for (uint32_t i=0; i<portCount; i++) {
+		AhciPort *port = &ports[i];
+		if (
+			   port->claimed
+			|| port->sectorCount != disk->blockCount
+			|| !ahciMatchesPath(port, disk)
+		)
+			continue;
+
+		disk->driver     = &ahciDiskDriver;
+		disk->driverData = port;
+
+		bool match = diskCheckDriver(disk);
+
+		// Give the port back until we actually need it, the BIOS may still use it.
+		ahciReturnPort(port);
+
+		if (match) {
+			port->claimed = true;
+			return true;
+		}
+	}
+
+	disk->driver     = NULL;
+	disk->driverData = NULL;
+
+	return false;
+}
+
+const DiskDriver ahciDiskDriver = {
+	"ahci",
+	ahciClaim,
+	ahciRead,
+	ahciRelease,
+	AHCI_MAX_QUEUED * AHCI_MAX_COMMAND_BLOCKS,
+	false,
+};
+
+#endif /* CONFIG_DISK_AHCI */
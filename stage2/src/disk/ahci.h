@@ -0,0 +1,25 @@
+/**
+ * \file
+ * \brief     Native AHCI SATA disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Takes over AHCI ports from the BIOS for the disks it claims, and restores
+ * the BIOS's command list when handing a port back. Large reads are split
+ * over several NCQ commands that are queued at once, each with a PRD table
+ * that points straight into the destination.
+ */
+#ifndef _DISK_AHCI_H
+#define _DISK_AHCI_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_AHCI
+#define CONFIG_DISK_AHCI 0
+#endif /* CONFIG_DISK_AHCI */
+
+extern const DiskDriver ahciDiskDriver;
+
+#endif /* _DISK_AHCI_H */
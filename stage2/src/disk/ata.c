@@ -0,0 +1,443 @@
+/**
+ * \file
+ * \brief     Native ATA/IDE disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "ata.h"
+
+#if CONFIG_DISK_ATA
+
+#include "ioport.h"
+#include "pci.h"
+#include "bda.h"
+
+#define ATA_MAX_DEVICES 8
+#define ATA_PRD_ENTRIES 4
+
+/// Sectors per command. Keeps a DMA transfer within ATA_PRD_ENTRIES.
+#define ATA_MAX_TRANSFER_BLOCKS 256
+
+/// Command timeout in PIT ticks (~2 seconds).
+#define ATA_TIMEOUT_TICKS 36
+
+// Command block register offsets.
+#define ATA_REG_DATA     0
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA_LOW  3
+#define ATA_REG_LBA_MID  4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DEVICE   6
+#define ATA_REG_STATUS   7 ///< Command when written.
+
+#define ATA_STATUS_ERR  0x01
+#define ATA_STATUS_DRQ  0x08
+#define ATA_STATUS_BSY  0x80
+
+#define ATA_CONTROL_NIEN 0x02
+
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_READ_SECTORS_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_READ_MULTIPLE     0xc4
+#define ATA_CMD_SET_MULTIPLE      0xc6
+#define ATA_CMD_READ_DMA          0xc8
+#define ATA_CMD_IDENTIFY          0xec
+
+// Bus master register offsets.
+#define ATA_BM_COMMAND 0
+#define ATA_BM_STATUS  2
+#define ATA_BM_PRDT    4
+
+#define ATA_BM_COMMAND_START 0x01
+#define ATA_BM_COMMAND_READ  0x08 ///< Transfer towards memory.
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERROR  0x02
+#define ATA_BM_STATUS_IRQ    0x04
+
+typedef struct {
+	uint32_t pciAddress; ///< The IDE controller, PCI_ADDRESS_NONE for legacy ISA ports.
+	uint8_t  channel;    ///< 0 for primary, 1 for secondary.
+	uint16_t ioBase;
+	uint16_t controlPort;
+	uint16_t bmBase;   ///< Bus master registers for this channel, 0 if DMA is unavailable.
+	uint8_t  slave;
+	uint8_t  multiple; ///< Sectors per DRQ block for READ MULTIPLE, 0 if unsupported.
+	bool     lba48;
+	bool     dma;
+	bool     claimed;
+	uint64_t sectorCount;
+} AtaDevice;
+
+/**
+ * \brief Physical Region Descriptor for bus-master DMA.
+ */
+typedef struct {
+	uint32_t address;
+	uint16_t byteCount; ///< 0 means 64K.
+	uint16_t flags;     ///< Bit 15 marks the last entry.
+} __attribute__((packed)) AtaPrd;
+
+static AtaDevice devices[ATA_MAX_DEVICES];
+static uint32_t  deviceCount = 0;
+static bool      probed      = false;
+
+// Lives in our own segment, so its address is a physical address as well.
+static AtaPrd prdTable[ATA_PRD_ENTRIES] __attribute__((aligned(8)));
+
+/**
+ * \brief Wait for BSY to clear and the given status bits to be set.
+ *
+ * \return the status register, or -1 on error or timeout
+ */
+static int ataWait(AtaDevice *dev, uint8_t bits) {
+	uint32_t start = bda->timerTicks;
+
+	while (bda->timerTicks - start < ATA_TIMEOUT_TICKS) {
+		uint8_t status = inb(dev->ioBase + ATA_REG_STATUS);
+		if (status == 0xff)
+			return -1; // Floating bus.
+		if (status & ATA_STATUS_BSY)
+			continue;
+		if (status & ATA_STATUS_ERR)
+			return -1;
+		if ((status & bits) == bits)
+			return status;
+	}
+	return -1;
+}
+
+/**
+ * \brief Wait ~400ns by reading the alternate status register.
+ */
+static void ataDelay(AtaDevice *dev) {
+	for (int i=0; i<4; i++)
+		inb(dev->controlPort);
+}
+
+/**
+ * \brief Select a device and issue a command with an LBA and sector count.
+ */
+static int ataCommand(AtaDevice *dev, uint8_t command, uint64_t lba, uint16_t count) {
+	if (ataWait(dev, 0) < 0 && inb(dev->ioBase + ATA_REG_STATUS) & ATA_STATUS_BSY)
+		return -1;
+
+	uint16_t io = dev->ioBase;
+
+	outb(dev->controlPort, ATA_CONTROL_NIEN);
+
+	if (dev->lba48) {
+		outb(io + ATA_REG_DEVICE,   0x40 | dev->slave << 4);
+		ataDelay(dev);
+		outb(io + ATA_REG_COUNT,    count >> 8);
+		outb(io + ATA_REG_LBA_LOW,  lba >> 24);
+		outb(io + ATA_REG_LBA_MID,  lba >> 32);
+		outb(io + ATA_REG_LBA_HIGH, lba >> 40);
+	} else {
+		outb(io + ATA_REG_DEVICE,   0xe0 | dev->slave << 4 | ((lba >> 24) & 0x0f));
+		ataDelay(dev);
+	}
+	outb(io + ATA_REG_COUNT,    count);
+	outb(io + ATA_REG_LBA_LOW,  lba);
+	outb(io + ATA_REG_LBA_MID,  lba >> 8);
+	outb(io + ATA_REG_LBA_HIGH, lba >> 16);
+	outb(io + ATA_REG_STATUS,   command);
+
+	ataDelay(dev);
+
+	return 0;
+}
+
+/**
+ * \brief Re-enable the interrupts that ataCommand() disabled.
+ *
+ * The BIOS's int13h code waits for IRQ 14 or 15, for the other device on
+ * the channel too, and for this one once the disk falls back to the BIOS.
+ * Reading the status register first acknowledges a pending interrupt, so
+ * that none fires into the BIOS's handler.
+ */
+static void ataEndCommand(AtaDevice *dev) {
+	inb(dev->ioBase + ATA_REG_STATUS);
+	outb(dev->controlPort, 0);
+}
+
+/**
+ * \brief Identify a device and fill in its capabilities.
+ *
+ * \return whether an ATA (non-packet) device is present
+ */
+static bool ataIdentify(AtaDevice *dev) {
+	uint16_t id[256];
+	uint16_t io = dev->ioBase;
+
+	outb(io + ATA_REG_DEVICE, 0xa0 | dev->slave << 4);
+	ataDelay(dev);
+
+	if (inb(io + ATA_REG_STATUS) == 0xff)
+		return false;
+
+	if (ataCommand(dev, ATA_CMD_IDENTIFY, 0, 0))
+		return false;
+
+	if (!inb(io + ATA_REG_STATUS))
+		return false; // No device.
+
+	if (ataWait(dev, ATA_STATUS_DRQ) < 0)
+		return false; // Packet devices abort IDENTIFY DEVICE.
+
+	for (int i=0; i<256; i++)
+		id[i] = inw(io + ATA_REG_DATA);
+
+	dev->lba48 = !!(id[83] & (1 << 10));
+	dev->sectorCount = dev->lba48
+		? (uint64_t)id[103] << 48 | (uint64_t)id[102] << 32 | (uint32_t)id[101] << 16 | id[100]
+		: (uint32_t)id[61] << 16 | id[60];
+
+	dev->dma = dev->bmBase
+		&& (id[49] & (1 << 8))
+		&& ((id[88] >> 8) & 0x7f || (id[63] >> 8) & 0x07); // A (U)DMA mode was selected by the BIOS.
+
+	// Enable READ MULTIPLE with the largest supported block size.
+	dev->multiple = id[47] & 0xff;
+	if (dev->multiple) {
+		if (
+			   ataCommand(dev, ATA_CMD_SET_MULTIPLE, 0, dev->multiple)
+			|| ataWait(dev, 0) < 0
+		)
+			dev->multiple = 0;
+	}
+
+	return dev->sectorCount != 0;
+}
+
+/**
+ * \brief Add the devices on a channel.
+ */
+static void ataAddChannel(
+		uint32_t pciAddress,
+		uint8_t  channel,
+		uint16_t ioBase,
+		uint16_t controlPort,
+		uint16_t bmBase
+	) {
+	for (uint8_t slave=0; slave<2 && deviceCount < ATA_MAX_DEVICES; slave++) {
+		AtaDevice *dev = &devices[deviceCount];
+		memset(dev, 0, sizeof(AtaDevice));
+
+		dev->pciAddress  = pciAddress;
+		dev->channel     = channel;
+		dev->ioBase      = ioBase;
+		dev->controlPort = controlPort;
+		dev->bmBase      = bmBase;
+		dev->slave       = slave;
+
+		if (ataIdentify(dev))
+			deviceCount++;
+
+		ataEndCommand(dev);
+	}
+}
+
+/**
+ * \brief Find IDE controllers and identify their devices.
+ */
+static void ataProbe() {
+	uint32_t addr = PCI_ADDRESS_NONE;
+	bool foundController = false;
+
+	while (pciNextFunction(&addr)) {
+		uint32_t class = pciRead(addr, PCI_REG_CLASS);
+		if ((class >> 16) != 0x0101)
+			continue; // Not an IDE controller.
+
+		foundController = true;
+
+		uint8_t  progIf = class >> 8;
+		uint16_t bmBase = progIf & 0x80 ? pciGetBar(addr, 4) : 0;
+
+		pciEnable(addr, PCI_COMMAND_IO | (bmBase ? PCI_COMMAND_BUS_MASTER : 0));
+
+		for (int channel=0; channel<2; channel++) {
+			bool native = !!(progIf & (1 << (channel * 2)));
+			ataAddChannel(
+				addr, channel,
+				native ? pciGetBar(addr, channel * 2)         : (channel ? 0x170 : 0x1f0),
+				native ? pciGetBar(addr, channel * 2 + 1) + 2 : (channel ? 0x376 : 0x3f6),
+				bmBase ? bmBase + channel * 8 : 0
+			);
+		}
+	}
+
+	if (!foundController) {
+		// Legacy ISA controller, PIO only.
+		ataAddChannel(PCI_ADDRESS_NONE, 0, 0x1f0, 0x3f6, 0);
+		ataAddChannel(PCI_ADDRESS_NONE, 1, 0x170, 0x376, 0);
+	}
+}
+
+/**
+ * \brief Read sectors using PIO, one DRQ block at a time.
+ */
+static int ataReadPio(AtaDevice *dev, uint32_t dest, uint64_t lba, uint32_t count) {
+	uint8_t command =
+		dev->multiple
+		? (dev->lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE)
+		: (dev->lba48 ? ATA_CMD_READ_SECTORS_EXT  : ATA_CMD_READ_SECTORS);
+	uint32_t perBlock = dev->multiple ? dev->multiple : 1;
+
+	if (ataCommand(dev, command, lba, count))
+		return -1;
+
+	volatile uint16_t *ptr = (uint16_t*)dest;
+
+	for (uint32_t done=0; done<count; ) {
+		if (ataWait(dev, ATA_STATUS_DRQ) < 0)
+			return -1;
+
+		uint32_t n = MIN(perBlock, count - done);
+		for (uint32_t i=0; i<n * 256; i++)
+			*ptr++ = inw(dev->ioBase + ATA_REG_DATA);
+
+		done += n;
+	}
+
+	return ataWait(dev, 0) < 0 ? -1 : 0;
+}
+
+/**
+ * \brief Read sectors using bus-master DMA, directly into their destination.
+ */
+static int ataReadDma(AtaDevice *dev, uint32_t dest, uint64_t lba, uint32_t count) {
+	// Regions may not cross a 64K boundary.
+	uint32_t bytes = count * 512;
+	uint32_t i;
+	for (i=0; bytes; i++) {
+		uint32_t chunk = MIN(bytes, 0x10000 - (dest & 0xffff));
+		prdTable[i].address   = dest;
+		prdTable[i].byteCount = chunk;
+		prdTable[i].flags     = 0;
+		dest  += chunk;
+		bytes -= chunk;
+	}
+	prdTable[i-1].flags = 0x8000;
+
+	uint16_t bm = dev->bmBase;
+
+	outb(bm + ATA_BM_COMMAND, 0);
+	outl(bm + ATA_BM_PRDT,    (uint32_t)prdTable);
+	outb(bm + ATA_BM_STATUS,  inb(bm + ATA_BM_STATUS) | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ);
+	outb(bm + ATA_BM_COMMAND, ATA_BM_COMMAND_READ);
+
+	if (ataCommand(dev, dev->lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA, lba, count))
+		return -1;
+
+	outb(bm + ATA_BM_COMMAND, ATA_BM_COMMAND_READ | ATA_BM_COMMAND_START);
+
+	uint32_t start = bda->timerTicks;
+	uint8_t  bmStatus;
+	int      status;
+
+	do {
+		bmStatus = inb(bm + ATA_BM_STATUS);
+		status   = inb(dev->controlPort);
+		if (bda->timerTicks - start >= ATA_TIMEOUT_TICKS) {
+			bmStatus |= ATA_BM_STATUS_ERROR;
+			break;
+		}
+	} while (
+		   !(bmStatus & ATA_BM_STATUS_ERROR)
+		&& !(status   & ATA_STATUS_ERR)
+		&& ((bmStatus & ATA_BM_STATUS_ACTIVE) || (status & ATA_STATUS_BSY))
+	);
+
+	outb(bm + ATA_BM_COMMAND, 0);
+
+	if ((bmStatus & ATA_BM_STATUS_ERROR) || ataWait(dev, 0) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int ataRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	AtaDevice *dev = disk->driverData;
+
+	if (lba + blockCount > dev->sectorCount || (!dev->lba48 && lba + blockCount > 0x10000000))
+		return -1;
+
+	// DMA needs word-aligned buffers.
+	int ret = dev->dma && !(dest & 1)
+		? ataReadDma(dev, dest, lba, blockCount)
+		: ataReadPio(dev, dest, lba, blockCount);
+
+	ataEndCommand(dev);
+
+	return ret;
+}
+
+/**
+ * \brief Check whether a device could be a disk, according to its EDD device path.
+ *
+ * \return false if the BIOS places the disk elsewhere, true if it does not
+ *         tell, or if the device matches
+ */
+static bool ataMatchesPath(AtaDevice *dev, Disk *disk) {
+	if (!disk->path.valid || !streq(disk->path.interfaceType, "ATA"))
+		return true;
+
+	if ((uint8_t)disk->path.devicePath != dev->slave)
+		return false;
+
+	if (streq(disk->path.busType, "PCI"))
+		return dev->pciAddress == disk->pciAddress
+		    && dev->channel    == (uint8_t)(disk->path.interfacePath >> 24);
+	else if (streq(disk->path.busType, "ISA"))
+		return dev->ioBase == (uint16_t)disk->path.interfacePath;
+	else
+		return true;
+}
+
+static bool ataClaim(Disk *disk) {
+	if (!probed) {
+		ataProbe();
+		probed = true;
+	}
+
+	if (disk->blockSize != 512)
+		return false;
+
+	for (uint32_t i=0; i<deviceCount; i++) {
+		AtaDevice *dev = &devices[i];
+		if (
+			   dev->claimed
+			|| dev->sectorCount != disk->blockCount
+			|| !ataMatchesPath(dev, disk)
+		)
+			continue;
+
+		disk->driver     = &ataDiskDriver;
+		disk->driverData = dev;
+
+		if (diskCheckDriver(disk)) {
+			dev->claimed = true;
+			return true;
+		}
+	}
+
+	disk->driver     = NULL;
+	disk->driverData = NULL;
+
+	return false;
+}
+
+const DiskDriver ataDiskDriver = {
+	"ata",
+	ataClaim,
+	ataRead,
+	NULL,
+	ATA_MAX_TRANSFER_BLOCKS,
+	false,
+};
+
+#endif /* CONFIG_DISK_ATA */
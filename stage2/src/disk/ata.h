@@ -0,0 +1,24 @@
+/**
+ * \file
+ * \brief     Native ATA/IDE disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Drives PCI IDE controllers (and the legacy ISA ports if there are none)
+ * using PIO READ MULTIPLE, or bus-master DMA when the BIOS has configured a
+ * DMA mode. Interrupts are disabled on the device, completion is polled.
+ */
+#ifndef _DISK_ATA_H
+#define _DISK_ATA_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_ATA
+#define CONFIG_DISK_ATA 0
+#endif /* CONFIG_DISK_ATA */
+
+extern const DiskDriver ataDiskDriver;
+
+#endif /* _DISK_ATA_H */
@@ -0,0 +1,96 @@
+/**
+ * \file
+ * \brief     Disk block cache.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "cache.h"
+#include "heap.h"
+#include "far.h"
+
+/**
+ * \brief Cache tag, one for each cached block.
+ */
+typedef struct {
+	uint64_t lba;
+	uint32_t lastUsed; ///< Value of useCounter at the last hit or insert.
+	uint8_t  biosId;   ///< Zero if this way is empty.
+} __attribute__((packed)) DiskCacheTag;
+
+DiskCacheStats diskCacheStats;
+
+static DiskCacheTag *tags   = NULL; ///< In the heap, SETS * WAYS entries.
+static uint32_t      blocks = 0;    ///< Block data in the heap.
+static uint32_t      useCounter = 0;
+
+#define CACHE_BLOCK_ADDR(way) (blocks + (way) * DISK_MAX_BLOCK_SIZE)
+
+void diskCacheInit() {
+#if CONFIG_DISK_CACHE_SETS
+	uint32_t count = CONFIG_DISK_CACHE_SETS * CONFIG_DISK_CACHE_WAYS;
+
+	tags   = heapAlloc(count * sizeof(DiskCacheTag));
+	blocks = (uint32_t)heapAlloc(count * DISK_MAX_BLOCK_SIZE);
+
+	if (tags && blocks)
+		diskCacheStats.blocks = count;
+	else
+		tags = NULL;
+#endif /* CONFIG_DISK_CACHE_SETS */
+}
+
+/**
+ * \brief Get the index of the first way in the set that holds the given block.
+ */
+static inline uint32_t getSetStart(Disk *disk, uint64_t lba) {
+	// Consecutive blocks go to consecutive sets.
+	return (((uint32_t)lba + disk->biosId * 0x9e37) & (CONFIG_DISK_CACHE_SETS - 1))
+	       * CONFIG_DISK_CACHE_WAYS;
+}
+
+uint32_t diskCacheLookup(Disk *disk, uint64_t lba) {
+	if (!tags)
+		return 0;
+
+	uint32_t setStart = getSetStart(disk, lba);
+
+	for (uint32_t i=setStart; i<setStart + CONFIG_DISK_CACHE_WAYS; i++) {
+		if (tags[i].biosId == disk->biosId && tags[i].lba == lba) {
+			tags[i].lastUsed = ++useCounter;
+			diskCacheStats.hits++;
+			return CACHE_BLOCK_ADDR(i);
+		}
+	}
+
+	return 0;
+}
+
+void diskCacheInsert(Disk *disk, uint64_t lba, uint32_t src) {
+	if (!tags || disk->blockSize > DISK_MAX_BLOCK_SIZE)
+		return;
+
+	uint32_t setStart = getSetStart(disk, lba);
+	uint32_t victim   = setStart;
+
+	// Pick the way that already holds this block, an empty way, or else the
+	// least recently used one.
+	for (uint32_t i=setStart; i<setStart + CONFIG_DISK_CACHE_WAYS; i++) {
+		if (!tags[i].biosId || (tags[i].biosId == disk->biosId && tags[i].lba == lba)) {
+			victim = i;
+			break;
+		}
+		if (tags[i].lastUsed < tags[victim].lastUsed)
+			victim = i;
+	}
+
+	if (tags[victim].biosId && tags[victim].lba != lba)
+		diskCacheStats.evictions++;
+	diskCacheStats.misses++;
+
+	tags[victim].biosId   = disk->biosId;
+	tags[victim].lba      = lba;
+	tags[victim].lastUsed = ++useCounter;
+
+	farcpy(CACHE_BLOCK_ADDR(victim), src, disk->blockSize);
+}
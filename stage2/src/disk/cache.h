@@ -0,0 +1,68 @@
+/**
+ * \file
+ * \brief     Disk block cache.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * A set-associative, LRU-replaced cache of disk blocks in the loader heap,
+ * shared by all disks. Only small reads are cached: these are FS metadata
+ * reads (BPBs, FAT and directory blocks, partition tables) that are repeated
+ * during path lookups. Bulk file data bypasses the cache.
+ */
+#ifndef _DISK_CACHE_H
+#define _DISK_CACHE_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_CACHE_SETS
+/// Must be a power of two, zero disables the cache. Each way takes
+/// DISK_MAX_BLOCK_SIZE bytes of heap, 1 MiB in total by default.
+#define CONFIG_DISK_CACHE_SETS 64
+#endif /* CONFIG_DISK_CACHE_SETS */
+
+#ifndef CONFIG_DISK_CACHE_WAYS
+#define CONFIG_DISK_CACHE_WAYS 4
+#endif /* CONFIG_DISK_CACHE_WAYS */
+
+/// Reads larger than this bypass the cache.
+#define DISK_CACHE_MAX_READ_BLOCKS 8
+
+typedef struct {
+	uint32_t hits;      ///< Blocks served from the cache.
+	uint32_t misses;    ///< Blocks read from disk and inserted.
+	uint32_t evictions; ///< Valid blocks replaced by misses.
+	uint32_t blocks;    ///< Cache capacity in blocks, zero if the cache is disabled.
+} DiskCacheStats;
+
+extern DiskCacheStats diskCacheStats;
+
+/**
+ * \brief Allocate the cache from the loader heap.
+ *
+ * The cache stays disabled if the heap is unavailable.
+ */
+void diskCacheInit();
+
+/**
+ * \brief Look up a cached block.
+ *
+ * \param disk
+ * \param lba
+ *
+ * \return the address of the cached block, or zero on a miss
+ */
+uint32_t diskCacheLookup(Disk *disk, uint64_t lba);
+
+/**
+ * \brief Insert a block into the cache, replacing the least recently used
+ *        block in its set.
+ *
+ * \param disk
+ * \param lba
+ * \param src address of the block data
+ */
+void diskCacheInsert(Disk *disk, uint64_t lba, uint32_t src);
+
+#endif /* _DISK_CACHE_H */
@@ -8,10 +8,31 @@
 #include "disk.h"
 #include "bda.h"
 #include "console.h"
+#include "memmap.h"
+#include "far.h"
+#include "heap.h"
+#include "cache.h"
+#include "trace.h"
+#include "pci.h"
+#include "ata.h"
+#include "ahci.h"
+#include "nvme.h"
+#include "virtio-blk.h"
+#include "md.h"
+#include "lvm.h"
+#include "partition-table/gpt.h"
 #include "partition-table/dos-mbr.h"
 
 uint32_t diskCount = 0;
-Disk     disks[DISK_MAX_DISKS];
+Disk    *disks     = NULL;
+
+/// The amount of disks the disk table has room for.
+static uint32_t diskCapacity = 0;
+
+uint32_t diskTransferCount = 0;
+
+/// The amount of disks that have been scanned, and are usable.
+static uint32_t availableDiskCount = 0;
 
 /**
  * \brief Drive parameters structure, as returned by int 13h AH=48h.
@@ -30,16 +51,26 @@ typedef struct {
 	uint8_t  _reserved1;
 	uint16_t _reserved2;
 	char     busType[4];          ///< "PCI" or "ISA".
-	char     interfaceType[8];    ///< "ATA", "ATAPI", "SCSI", "USB", "1394" or "FIBRE".
+	char     interfaceType[8];    ///< "ATA", "ATAPI", "SCSI", "USB", "1394", "FIBRE", "SATA" or "NVME".
 	uint64_t interfacePath;
-	uint64_t devicePath;
+	uint8_t  devicePath[16];      ///< Phoenix EDD 3.0 (dpiLength 36) uses 8 bytes, followed by
+	                              ///  a reserved byte and the checksum. T13 EDD-3 (dpiLength 44) uses 16.
 	uint8_t  _reserved3;
-	uint8_t  dpiChecksum; ///< Checksum for Device Path Information.
+	uint8_t  dpiChecksum; ///< Checksum for Device Path Information (T13 EDD-3).
 	                      ///  Includes the 0BEDDh signature (dpiKey).
-	                      ///  2's complement of the sum of bytes 30-64.
-	                      ///  The sum of bytes 30-65 is 0.
+	                      ///  The sum of the dpiLength bytes starting at dpiKey is 0.
 } __attribute__((packed)) DriveParameters;
 
+/**
+ * \brief Device Parameter Table Extension, pointed to by DriveParameters.dptePtr.
+ *
+ * Only the fields we use.
+ */
+typedef struct {
+	uint16_t ioBase;
+	uint16_t controlPort;
+} __attribute__((packed)) DriveParameterTableExtension;
+
 /**
  * \brief Disk Address Packet for extended int13h calls.
  */
@@ -55,51 +86,208 @@ typedef struct {
 } __attribute__((packed)) DiskAddressPacket;
 
 
-Partition *getPartitionByFsId(uint64_t fsId) {
-	for (uint32_t i=0; i<diskCount; i++) {
-		for (uint32_t j=0; j<disks[i].partitionCount; j++) {
-			Partition *part = &disks[i].partitions[j];
-			if (part->fsDriver && part->fsId == fsId)
-				return part;
+/**
+ * \brief Open-addressed hash table of partitions, in the loader heap.
+ *
+ * Partitions are inserted once their filesystem is detected, and never
+ * removed.
+ */
+typedef struct {
+	Partition **slots;
+	uint32_t    size; ///< A power of two, or zero.
+} PartitionIndex;
+
+static PartitionIndex partsById;
+static PartitionIndex partsByLabel;
+static uint32_t       indexedPartCount = 0;
+
+static uint32_t hashFsId(uint64_t fsId) {
+	uint32_t hash = ((uint32_t)fsId ^ (uint32_t)(fsId >> 32)) * 0x9e3779b1;
+	return hash ^ hash >> 16;
+}
+
+static uint32_t hashFsLabel(const char *fsLabel) {
+	uint32_t hash = 0x811c9dc5; // FNV-1a.
+	while (*fsLabel)
+		hash = (hash ^ (uint8_t)*fsLabel++) * 0x01000193;
+	return hash;
+}
+
+static void partitionIndexPut(PartitionIndex *index, uint32_t hash, Partition *part) {
+	for (uint32_t i=hash;; i++) {
+		Partition **slot = &index->slots[i & (index->size - 1)];
+		if (!*slot) {
+			*slot = part;
+			return;
 		}
 	}
-	return NULL;
 }
 
-Partition *getPartitionByFsLabel(const char *fsLabel) {
-	for (uint32_t i=0; i<diskCount; i++) {
-		for (uint32_t j=0; j<disks[i].partitionCount; j++) {
-			Partition *part = &disks[i].partitions[j];
-			if (part->fsDriver && streq(part->fsLabel, fsLabel))
-				return part;
+/**
+ * \brief Add a partition with a detected filesystem to the lookup indices.
+ *
+ * Both indices are kept at most half full, and rebuilt at double the size
+ * when they would fill up further.
+ *
+ * \param part
+ */
+static void partitionIndexAdd(Partition *part) {
+	if ((indexedPartCount + 1) * 2 > partsById.size) {
+		PartitionIndex oldById = partsById;
+		uint32_t size = partsById.size ? partsById.size * 2 : 16;
+
+		Partition **byId    = heapAlloc(size * sizeof(Partition*));
+		Partition **byLabel = heapAlloc(size * sizeof(Partition*));
+		if (!byId || !byLabel) {
+			printf("warning: Out of heap memory, partition hd%u:%u is not indexed\n",
+			       part->disk->diskNo, part->partitionNo);
+			return;
+		}
+
+		partsById.slots    = byId;
+		partsById.size     = size;
+		partsByLabel.slots = byLabel;
+		partsByLabel.size  = size;
+
+		// The id index holds every indexed partition.
+		for (uint32_t i=0; i<oldById.size; i++) {
+			Partition *old = oldById.slots[i];
+			if (!old)
+				continue;
+			partitionIndexPut(&partsById, hashFsId(old->fsId), old);
+			if (old->fsLabel[0])
+				partitionIndexPut(&partsByLabel, hashFsLabel(old->fsLabel), old);
 		}
 	}
+
+	partitionIndexPut(&partsById, hashFsId(part->fsId), part);
+	if (part->fsLabel[0])
+		partitionIndexPut(&partsByLabel, hashFsLabel(part->fsLabel), part);
+
+	indexedPartCount++;
+}
+
+static bool diskProbeNext(void);
+
+static Partition *findPartitionByFsId(uint64_t fsId) {
+	for (uint32_t i=hashFsId(fsId); partsById.size; i++) {
+		Partition *part = partsById.slots[i & (partsById.size - 1)];
+		if (!part)
+			break;
+		if (part->fsId == fsId)
+			return part;
+	}
 	return NULL;
 }
 
-int diskRead(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount) {
+static Partition *findPartitionByFsLabel(const char *fsLabel) {
+	for (uint32_t i=hashFsLabel(fsLabel); partsByLabel.size; i++) {
+		Partition *part = partsByLabel.slots[i & (partsByLabel.size - 1)];
+		if (!part)
+			break;
+		if (streq(part->fsLabel, fsLabel))
+			return part;
+	}
+	return NULL;
+}
 
-	/// \note Using the 64-bit flat address doesn't seem to work in qemu and bochs.
+Partition *getPartitionByFsId(uint64_t fsId) {
+	do {
+		Partition *part = findPartitionByFsId(fsId);
+		if (part)
+			return part;
+	} while (diskProbeNext());
 
-	assert(blockCount <= 127);
+	return NULL;
+}
 
-	if (dest + (blockCount * disk->blockSize) >= 0x100000)
-		panic("Reading from disk to extended memory is not supported.");
+Partition *getPartitionByFsLabel(const char *fsLabel) {
+	do {
+		Partition *part = findPartitionByFsLabel(fsLabel);
+		if (part)
+			return part;
+	} while (diskProbeNext());
+
+	return NULL;
+}
+
+Partition *diskAddPartition(Disk *disk) {
+	if (disk->partitionCount == disk->partitionCapacity) {
+		// Grow the table. The old one is left behind, heap memory is never freed.
+		uint16_t capacity = disk->partitionCapacity ? disk->partitionCapacity * 2 : 4;
+
+		Partition *partitions = heapAlloc(capacity * sizeof(Partition));
+		if (!partitions)
+			return NULL;
+
+		if (disk->partitionCount)
+			farcpy(
+				(uint32_t)partitions,
+				(uint32_t)disk->partitions,
+				disk->partitionCount * sizeof(Partition)
+			);
+
+		disk->partitions        = partitions;
+		disk->partitionCapacity = capacity;
+	}
+
+	Partition *part = &disk->partitions[disk->partitionCount];
+	farzero((uint32_t)part, sizeof(Partition));
+
+	part->disk        = disk;
+	part->partitionNo = disk->partitionCount++;
+	part->token       = ((uint32_t)disk->diskNo << 16) | (part->partitionNo + 1);
+
+	return part;
+}
+
+/**
+ * \brief Read blocks from a hard drive using int13h.
+ *
+ * Transfers that end below 1 MiB use a seg:off destination, which every BIOS
+ * supports. Anything else uses the flat 64-bit destination address.
+ *
+ * \param disk
+ * \param dest destination address, the transfer must end below 1 MiB unless
+ *             the disk supports flat addressing
+ * \param lba
+ * \param blockCount at most DISK_MAX_TRANSFER_BLOCKS
+ *
+ * \return zero on success, the int13h error code on error
+ */
+static int biosDiskRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+
+	/// \note Using the 64-bit flat address doesn't work in qemu and bochs,
+	///       see biosProbeFlatAddressing().
+
+	bool flat = dest + blockCount * disk->blockSize > 0x100000;
+
+	assert(blockCount <= DISK_MAX_TRANSFER_BLOCKS);
+	assert(!flat || disk->biosFlatAddressing);
 
 	DiskAddressPacket dap;
 	memset(&dap, 0, sizeof(DiskAddressPacket));
-	//dap.length      = 0x18;
-	dap.length      = 0x10;
 	dap.blockCount  = blockCount;
-	//dap.destinationSeg = 0xffff; // Indicates that we want to use the flat address instead of seg:offset.
-	//dap.destinationOff = 0xffff; // .
-	dap.destinationSeg = (dest >> 4) & 0xf000;
-	dap.destinationOff = dest;
 	dap.lba         = lba;
 	dap.destination = dest;
 
+	if (flat) {
+		dap.length         = 0x18;
+		dap.destinationSeg = 0xffff; // Indicates that we want to use the flat address instead of seg:offset.
+		dap.destinationOff = 0xffff; // .
+	} else {
+		dap.length         = 0x10;
+		// Normalize the segment so that a maximal transfer fits behind the offset.
+		dap.destinationSeg = dest >> 4;
+		dap.destinationOff = dest & 0xf;
+	}
+
 	uint16_t errorCode = 0;
 
+	diskTransferCount++;
+
+	uint64_t startTsc = rdtsc();
+
 	asm volatile (
 		"int $0x13\n"
 		"jc .error1\n"
@@ -114,20 +302,439 @@ int diskRead(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount) {
 
 	errorCode >>= 8;
 
-	if (errorCode) {
-		printf("warning: Disk I/O error: disk=%02xh, AH=%02xh\n", disk->biosId, errorCode);
-		printf(
-			"         lba: %#08x.%08x, block count %#08x.%08x\n",
-			(uint32_t)(lba        >> 32), (uint32_t)lba,
-			(uint32_t)(blockCount >> 32), (uint32_t)blockCount
+	diskTraceRecord(disk->biosId, 0x42, errorCode, lba, blockCount, dest, startTsc);
+
+	return errorCode;
+}
+
+/**
+ * \brief Reset a disk's controller after a failed int13h transfer.
+ *
+ * \param disk
+ */
+static void biosDiskReset(Disk *disk) {
+	uint16_t result;
+	uint64_t startTsc = rdtsc();
+
+	asm volatile (
+		"int $0x13\n"
+		: "=a" (result)
+		: "a" (0x0000),
+		  "d" (disk->biosId)
+		: "memory", "cc"
+	);
+
+	diskTraceRecord(disk->biosId, 0x00, result >> 8, 0, 0, 0, startTsc);
+}
+
+/**
+ * \brief Get the next smaller int13h transfer size to try after a failure.
+ *
+ * Steps down through powers of two, the caps that BIOSes tend to impose.
+ *
+ * \param blockCount the transfer size that failed, at least 2
+ *
+ * \return the largest power of two below blockCount
+ */
+static uint32_t biosShrinkTransfer(uint32_t blockCount) {
+	uint32_t count = 1;
+	while (count * 2 < blockCount)
+		count *= 2;
+	return count;
+}
+
+/**
+ * \brief Find the largest transfer that int13h reliably handles for a disk.
+ *
+ * Reads from the start of the disk into the bounce buffer, shrinking the
+ * transfer until it succeeds.
+ *
+ * \param disk a disk with drive parameters filled in
+ */
+static void biosProbeTransferSize(Disk *disk) {
+	uint32_t count = MIN(DISK_MAX_TRANSFER_BLOCKS, DISK_BOUNCE_BUFFER_SIZE / disk->blockSize);
+	if (disk->blockCount < count)
+		count = disk->blockCount ? disk->blockCount : 1;
+
+	while (count > 1 && biosDiskRead(disk, DISK_BOUNCE_BUFFER_ADDR, 0, count)) {
+		biosDiskReset(disk);
+		count = biosShrinkTransfer(count);
+	}
+
+	disk->biosMaxTransferBlocks = count;
+}
+
+/**
+ * \brief Check whether int13h can read a disk directly above 1 MiB.
+ *
+ * Requires EDD 3.0 with the 64-bit extensions bit set in the extension
+ * bitmap. As not all BIOSes that claim support get it right, a block is then
+ * read both ways and compared, with the flat destination prefilled with the
+ * inverse of the expected data.
+ *
+ * \param disk a disk with drive parameters filled in
+ */
+static void biosProbeFlatAddressing(Disk *disk) {
+	static uint32_t *testBuffer = NULL; // A block above 1 MiB.
+
+	uint16_t result;
+	uint16_t signature;
+	uint16_t extensions;
+	uint64_t startTsc = rdtsc();
+
+	asm volatile (
+		"int $0x13\n"
+		"jnc .edd1\n"
+		"xor %%bx, %%bx\n"
+		".edd1:\n"
+		: "=a" (result),
+		  "=b" (signature),
+		  "=c" (extensions)
+		: "a" (0x4100),
+		  "b" (0x55aa),
+		  "d" (disk->biosId)
+		: "memory", "cc"
+	);
+
+	diskTraceRecord(
+		disk->biosId, 0x41, signature == 0xaa55 ? 0 : result >> 8,
+		0, 0, 0, startTsc
+	);
+
+	disk->biosFlatAddressing = false;
+
+	if (
+		   signature != 0xaa55
+		|| (result >> 8) < 0x30 // EDD version.
+		|| !(extensions & 0x08) // 64-bit extensions.
+	)
+		return;
+
+	if (!testBuffer)
+		testBuffer = heapAlloc(DISK_MAX_BLOCK_SIZE);
+	if (!testBuffer || (uint32_t)testBuffer < 0x100000)
+		return;
+
+	uint32_t *reference = (uint32_t*)DISK_BOUNCE_BUFFER_ADDR;
+	uint32_t  words     = disk->blockSize / 4;
+
+	if (biosDiskRead(disk, (uint32_t)reference, 0, 1))
+		return;
+
+	for (uint32_t i=0; i<words; i++)
+		testBuffer[i] = ~reference[i];
+
+	disk->biosFlatAddressing = true;
+
+	if (biosDiskRead(disk, (uint32_t)testBuffer, 0, 1)) {
+		disk->biosFlatAddressing = false;
+		return;
+	}
+
+	for (uint32_t i=0; i<words; i++) {
+		if (testBuffer[i] != reference[i]) {
+			disk->biosFlatAddressing = false;
+			return;
+		}
+	}
+}
+
+/**
+ * \brief Read blocks from a hard drive, bypassing the cache.
+ *
+ * \param disk
+ * \param dest
+ * \param lba
+ * \param blockCount
+ *
+ * \return zero on success, non-zero on error
+ */
+static int diskReadUncached(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	while (blockCount && disk->driver) {
+		uint32_t count = MIN(blockCount, disk->driver->maxTransferBlocks);
+
+		if (disk->driver->read(disk, dest, lba, count)) {
+			if (disk->virtual)
+				return -1; // There is no BIOS disk to fall back to.
+
+			if (disk->driver->noBiosFallback) {
+				printf("warning: %s read failed on disk %02xh\n", disk->driver->name, disk->biosId);
+				return -1;
+			}
+
+			printf(
+				"warning: %s read failed on disk %02xh, falling back to BIOS I/O\n",
+				disk->driver->name, disk->biosId
+			);
+			diskDropDriver(disk);
+			break;
+		}
+
+		dest       += count * disk->blockSize;
+		lba        += count;
+		blockCount -= count;
+	}
+
+	if (blockCount && disk->biosLost)
+		return -1; // The option ROM lost the controller to a native driver.
+
+	while (blockCount) {
+		// A transfer must fit in the bounce buffer, and within the BIOS's limits.
+		// Transfers that don't bounce are split at 64K boundaries below as
+		// well, so disks with 4K blocks get no more data per call than others.
+		uint32_t count = MIN(
+			blockCount,
+			MIN(disk->biosMaxTransferBlocks, DISK_BOUNCE_BUFFER_SIZE / disk->blockSize)
 		);
+
+		// Without flat addressing, int13h can only address the first MiB.
+		// Bounce anything above it.
+		bool bounce = !disk->biosFlatAddressing && dest + count * disk->blockSize > 0x100000;
+		if (!bounce) {
+			// BIOSes that use ISA-style DMA cannot cross a 64K physical
+			// boundary. The bounce buffer is aligned, so a block that
+			// straddles one is bounced instead.
+			uint32_t fit = (0x10000 - (dest & 0xffff)) / disk->blockSize;
+			if (fit) {
+				count = MIN(count, fit);
+			} else {
+				count  = 1;
+				bounce = true;
+			}
+		}
+
+		uint32_t bytes = count * disk->blockSize;
+
+		int errorCode = biosDiskRead(disk, bounce ? DISK_BOUNCE_BUFFER_ADDR : dest, lba, count);
+		if (errorCode) {
+			biosDiskReset(disk);
+
+			if (!bounce && dest + bytes > 0x100000) {
+				// The BIOS passed the probe, but can't be trusted after all.
+				printf(
+					"warning: Disk %02xh failed a flat address transfer (AH=%02xh), using the bounce buffer\n",
+					disk->biosId, errorCode
+				);
+				disk->biosFlatAddressing = false;
+				continue;
+			}
+
+			if (count > 1) {
+				// Retry in smaller pieces, and remember that this BIOS can't handle as much.
+				disk->biosMaxTransferBlocks = biosShrinkTransfer(count);
+				printf(
+					"warning: Disk %02xh failed a %u block transfer (AH=%02xh), retrying with %u blocks\n",
+					disk->biosId, count, errorCode, disk->biosMaxTransferBlocks
+				);
+				continue;
+			}
+
+			printf("warning: Disk I/O error: disk=%02xh, AH=%02xh\n", disk->biosId, errorCode);
+			printf(
+				"         lba: %#08x.%08x, block count %#08x\n",
+				(uint32_t)(lba >> 32), (uint32_t)lba,
+				count
+			);
+			return -1;
+		}
+
+		if (bounce)
+			farcpy(dest, DISK_BOUNCE_BUFFER_ADDR, bytes);
+
+		dest       += bytes;
+		lba        += count;
+		blockCount -= count;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Read blocks from a hard drive, through the cache for small reads.
+ *
+ * \param disk
+ * \param dest
+ * \param lba
+ * \param blockCount
+ *
+ * \return zero on success, non-zero on error
+ */
+static int diskReadCached(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount) {
+
+	if (dest + blockCount * disk->blockSize > 0x100000000) {
+		printf("warning: Disk read destination %#08x.%08x is out of range\n",
+		       (uint32_t)(dest >> 32), (uint32_t)dest);
 		return -1;
-	} else {
+	}
+
+	if (blockCount > DISK_CACHE_MAX_READ_BLOCKS)
+		return diskReadUncached(disk, dest, lba, blockCount);
+
+	uint32_t bs = disk->blockSize;
+	uint32_t i;
+
+	// Serve the cached part of the request, read the rest in one go.
+	for (i=0; i<blockCount; i++) {
+		uint32_t cached = diskCacheLookup(disk, lba + i);
+		if (!cached)
+			break;
+		farcpy(dest + i * bs, cached, bs);
+	}
+
+	if (i == blockCount)
 		return 0;
+
+	if (diskReadUncached(disk, dest + i * bs, lba + i, blockCount - i))
+		return -1;
+
+	for (; i<blockCount; i++)
+		diskCacheInsert(disk, lba + i, dest + i * bs);
+
+	return 0;
+}
+
+/**
+ * \brief Sort I/O vectors by LBA.
+ *
+ * An insertion sort, as vector lists are short and often nearly sorted.
+ * Copies fields one by one, the vectors may live in the heap.
+ *
+ * \param vecs
+ * \param vecCount
+ */
+static void diskIoVecSort(DiskIoVec *vecs, uint32_t vecCount) {
+	for (uint32_t i=1; i<vecCount; i++) {
+		uint64_t lba        = vecs[i].lba;
+		uint32_t blockCount = vecs[i].blockCount;
+		uint32_t dest       = vecs[i].dest;
+
+		uint32_t j = i;
+		for (; j && vecs[j-1].lba > lba; j--) {
+			vecs[j].lba        = vecs[j-1].lba;
+			vecs[j].blockCount = vecs[j-1].blockCount;
+			vecs[j].dest       = vecs[j-1].dest;
+		}
+
+		vecs[j].lba        = lba;
+		vecs[j].blockCount = blockCount;
+		vecs[j].dest       = dest;
 	}
 }
 
-int partRead(Partition *part, uint64_t dest, uint64_t relLba, uint64_t blockCount) {
+/**
+ * \brief Read a list of block ranges, with LBAs relative to lbaOffset.
+ *
+ * \param disk
+ * \param vecs
+ * \param vecCount
+ * \param lbaOffset
+ *
+ * \return zero on success, non-zero on error
+ */
+static int diskReadvAt(Disk *disk, DiskIoVec *vecs, uint32_t vecCount, uint64_t lbaOffset) {
+	diskIoVecSort(vecs, vecCount);
+
+	uint32_t bs           = disk->blockSize;
+	uint32_t bounceBlocks = DISK_BOUNCE_BUFFER_SIZE / bs;
+
+	for (uint32_t i=0; i<vecCount;) {
+		uint64_t lba        = vecs[i].lba;
+		uint32_t blockCount = vecs[i].blockCount;
+		bool     gather     = false; // Whether the run must go through the bounce buffer.
+
+		// Extend the run with vectors that continue it on disk.
+		uint32_t j = i + 1;
+		for (; j<vecCount && vecs[j].lba == lba + blockCount; j++) {
+			bool contiguous = !gather && vecs[j].dest == vecs[i].dest + blockCount * bs;
+			if (!contiguous && blockCount + vecs[j].blockCount > bounceBlocks)
+				break;
+
+			gather      = !contiguous;
+			blockCount += vecs[j].blockCount;
+		}
+
+		if (!gather) {
+			if (diskRead(disk, vecs[i].dest, lbaOffset + lba, blockCount))
+				return -1;
+		} else {
+			if (diskRead(disk, DISK_BOUNCE_BUFFER_ADDR, lbaOffset + lba, blockCount))
+				return -1;
+
+			uint32_t offset = 0;
+			for (uint32_t k=i; k<j; k++) {
+				farcpy(vecs[k].dest, DISK_BOUNCE_BUFFER_ADDR + offset, vecs[k].blockCount * bs);
+				offset += vecs[k].blockCount * bs;
+			}
+		}
+
+		i = j;
+	}
+
+	return 0;
+}
+
+int diskReadv(Disk *disk, DiskIoVec *vecs, uint32_t vecCount) {
+	return diskReadvAt(disk, vecs, vecCount, 0);
+}
+
+int diskRead(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount) {
+	uint64_t startTsc = rdtsc();
+
+	int ret = diskReadCached(disk, dest, lba, blockCount);
+
+	ioStatsAdd(&disk->stats, blockCount, disk->blockSize, startTsc, ret);
+
+	return ret;
+}
+
+void diskDropDriver(Disk *disk) {
+	if (disk->driver && disk->driver->release)
+		disk->driver->release(disk);
+
+	disk->driver     = NULL;
+	disk->driverData = NULL;
+}
+
+void diskBiosLost(uint32_t pciAddress) {
+	for (uint32_t i=0; i<diskCount; i++) {
+		if (!disks[i].virtual && disks[i].pciAddress == pciAddress)
+			disks[i].biosLost = true;
+	}
+}
+
+void *diskBlockBuffer(DiskBlockBuffer buffer) {
+	return (void*)(DISK_BLOCK_BUFFERS_ADDR + buffer * DISK_MAX_BLOCK_SIZE);
+}
+
+bool diskCheckDriver(Disk *disk) {
+	uint8_t *biosBuffer   = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_BIOS);
+	uint8_t *nativeBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_NATIVE);
+
+	return !biosDiskRead(disk, (uint32_t)biosBuffer, 0, 1)
+	    && !disk->driver->read(disk, (uint32_t)nativeBuffer, 0, 1)
+	    && memeq(biosBuffer, nativeBuffer, disk->blockSize);
+}
+
+/**
+ * \brief The range of partition blocks currently held in the read-ahead buffer.
+ */
+static struct {
+	Partition *part; ///< NULL if the buffer is empty.
+	uint64_t   relLba;
+	uint32_t   blockCount;
+} readAhead = { .part = NULL };
+
+/**
+ * \brief Read blocks from a partition, through the read-ahead buffer.
+ *
+ * \param part
+ * \param dest
+ * \param relLba
+ * \param blockCount
+ *
+ * \return zero on success, non-zero on error
+ */
+static int partReadBuffered(Partition *part, uint64_t dest, uint64_t relLba, uint64_t blockCount) {
 	if (
 			   relLba              >= part->blockCount
 			|| blockCount          >  part->blockCount
@@ -137,7 +744,137 @@ int partRead(Partition *part, uint64_t dest, uint64_t relLba, uint64_t blockCoun
 		return -1;
 	}
 
-	return diskRead(part->disk, dest, part->lbaStart + relLba, blockCount);
+	uint32_t bs = part->disk->blockSize;
+
+	// Serve the request from the read-ahead buffer if it holds all requested blocks.
+	if (
+		   readAhead.part == part
+		&& relLba              >= readAhead.relLba
+		&& relLba + blockCount <= readAhead.relLba + readAhead.blockCount
+	) {
+		farcpy(
+			dest,
+			DISK_READAHEAD_BUFFER_ADDR + (uint32_t)(relLba - readAhead.relLba) * bs,
+			blockCount * bs
+		);
+		part->readAheadNext = relLba + blockCount;
+		return 0;
+	}
+
+	if (relLba == part->readAheadNext) {
+		// Sequential access, grow the window.
+		part->readAheadWindow = part->readAheadWindow
+			? MIN(part->readAheadWindow * 2, DISK_MAX_TRANSFER_BLOCKS)
+			: DISK_READAHEAD_MIN_BLOCKS;
+	} else {
+		part->readAheadWindow = 0;
+	}
+	part->readAheadNext = relLba + blockCount;
+
+	uint32_t window = MIN(
+		MIN(part->readAheadWindow, DISK_READAHEAD_BUFFER_SIZE / bs),
+		part->blockCount - relLba
+	);
+
+	if (blockCount >= window)
+		// Not streaming, or the caller is already asking for more than we would prefetch.
+		return diskRead(part->disk, dest, part->lbaStart + relLba, blockCount);
+
+	readAhead.part = NULL;
+	if (diskRead(part->disk, DISK_READAHEAD_BUFFER_ADDR, part->lbaStart + relLba, window))
+		return -1;
+
+	readAhead.part       = part;
+	readAhead.relLba     = relLba;
+	readAhead.blockCount = window;
+
+	farcpy(dest, DISK_READAHEAD_BUFFER_ADDR, blockCount * bs);
+
+	return 0;
+}
+
+int partRead(Partition *part, uint64_t dest, uint64_t relLba, uint64_t blockCount) {
+	uint64_t startTsc = rdtsc();
+
+	int ret = partReadBuffered(part, dest, relLba, blockCount);
+
+	ioStatsAdd(&part->stats, blockCount, part->disk->blockSize, startTsc, ret);
+
+	return ret;
+}
+
+int partReadv(Partition *part, DiskIoVec *vecs, uint32_t vecCount) {
+	uint64_t startTsc   = rdtsc();
+	uint32_t blockCount = 0;
+	int      ret        = 0;
+
+	for (uint32_t i=0; i<vecCount; i++) {
+		blockCount += vecs[i].blockCount;
+
+		if (
+				   vecs[i].lba                      >= part->blockCount
+				|| vecs[i].blockCount               >  part->blockCount
+				|| vecs[i].lba + vecs[i].blockCount >  part->blockCount
+			) {
+			printf("warning: Tried to read outside of partition boundaries\n");
+			ret = -1;
+		}
+	}
+
+	if (!ret)
+		ret = diskReadvAt(part->disk, vecs, vecCount, part->lbaStart);
+
+	ioStatsAdd(&part->stats, blockCount, part->disk->blockSize, startTsc, ret);
+
+	return ret;
+}
+
+/**
+ * \brief Copy a space-padded string from the drive parameters.
+ *
+ * \param dest a buffer of length + 1 bytes
+ * \param src
+ * \param length
+ */
+static void diskCopyDpiString(char *dest, const char *src, size_t length) {
+	for (size_t i=0; i<length; i++)
+		dest[i] = src[i];
+	dest[length] = '\0';
+	rtrim(dest);
+}
+
+/**
+ * \brief Validate and store EDD 3.0 device path information.
+ *
+ * \param disk
+ * \param params
+ */
+static void diskParseDevicePath(Disk *disk, DriveParameters *params) {
+	disk->path.valid = false;
+
+	if (
+		   params->bufferSize < offsetof(DriveParameters, busType)
+		|| params->dpiKey != 0xbedd
+		|| (params->dpiLength != 36 && params->dpiLength != 44)
+		|| params->bufferSize < offsetof(DriveParameters, dpiKey) + params->dpiLength
+	)
+		return; // No device path, or one in a format that we don't know.
+
+	uint8_t sum = 0;
+	for (uint32_t i=0; i<params->dpiLength; i++)
+		sum += ((uint8_t*)&params->dpiKey)[i];
+
+	if (sum) {
+		printf("warning: Ignoring EDD device path of disk %02xh, bad checksum\n", disk->biosId);
+		return;
+	}
+
+	diskCopyDpiString(disk->path.busType,       params->busType,       sizeof(params->busType));
+	diskCopyDpiString(disk->path.interfaceType, params->interfaceType, sizeof(params->interfaceType));
+
+	disk->path.interfacePath = params->interfacePath;
+	disk->path.devicePath    = *(uint64_t*)params->devicePath;
+	disk->path.valid         = true;
 }
 
 /**
@@ -154,6 +891,7 @@ static int diskGetParams(Disk *disk) {
 	params.bufferSize = sizeof(DriveParameters);
 
 	uint16_t errorCode = 0;
+	uint64_t startTsc  = rdtsc();
 
 	asm volatile (
 		"int $0x13\n"
@@ -169,6 +907,8 @@ static int diskGetParams(Disk *disk) {
 
 	errorCode >>= 8;
 
+	diskTraceRecord(disk->biosId, 0x48, errorCode, 0, 0, (uint32_t)&params, startTsc);
+
 	if (errorCode) {
 		printf("warning: Could not get drive parameters for drive %02xh, error %02xh\n", disk->biosId, errorCode);
 		return -1;
@@ -183,14 +923,67 @@ static int diskGetParams(Disk *disk) {
 			|| disk->blockSize > DISK_MAX_BLOCK_SIZE
 		){
 		printf("warning: Block size %u not supported on disk %02xh\n", disk->blockSize, disk->biosId);
+		disk->blockSize = 0;
 		return -1;
 	}
 
-	/// @todo Extract DPI?
+	if (params.flags & 0x02) {
+		// CHS information is valid.
+		disk->cylinders       = MIN(params.physCylinders, 0xffff);
+		disk->heads           = MIN(params.physHeads, 0xff);
+		disk->sectorsPerTrack = MIN(params.physSectorsPerTrack, 0xff);
+	}
+
+	if (
+		   params.bufferSize >= offsetof(DriveParameters, dpiKey)
+		&& params.dptePtr
+		&& params.dptePtr != 0xffffffff
+	) {
+		DriveParameterTableExtension dpte;
+		segcpy((uint32_t)&dpte, params.dptePtr, sizeof(dpte));
+		disk->ioPorts[0] = dpte.ioBase;
+		disk->ioPorts[1] = dpte.controlPort;
+	}
+
+	diskParseDevicePath(disk, &params);
+
+	disk->pciAddress = PCI_ADDRESS_NONE;
+
+	if (disk->path.valid && streq(disk->path.busType, "PCI")) {
+		// The interface path holds the bus, slot and function numbers.
+		uint8_t *path = (uint8_t*)&params.interfacePath;
+		disk->pciAddress = PCI_ADDRESS(path[0], path[1], path[2]);
+	}
 
 	return 0;
 }
 
+/**
+ * \brief Treat a virtual disk with a filesystem on it as a single partition.
+ *
+ * Arrays often hold a filesystem directly. Its boot sector could pass for an
+ * empty MBR, so this runs before the partition table scanners.
+ */
+static int diskScanWhole(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
+	if (!disk->virtual)
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+
+	Partition *part = diskAddPartition(disk);
+	if (!part)
+		return DISK_PART_SCAN_ERR_IO;
+
+	part->lbaStart   = lbaStart;
+	part->blockCount = blockCount;
+	part->type       = DISK_PART_TYPE_NONE;
+
+	if (fsDetect(part)) {
+		disk->partitionCount = 0;
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+	}
+
+	return DISK_PART_SCAN_OK;
+}
+
 /**
  * \brief A named pointer to a function that parses partition tables.
  */
@@ -204,13 +997,37 @@ typedef struct {
  *        partition table type.
  */
 static const DiskScanner diskScanners[] = {
+#if CONFIG_DISK_LVM
+	{ "lvm",     lvmScan    },
+#endif /* CONFIG_DISK_LVM */
+	{ "whole",   diskScanWhole },
+	{ "gpt",     gptScan    }, // Before dos-mbr, which would accept a protective MBR.
 	{ "dos-mbr", dosMbrScan },
 };
 
 /**
- * \brief Get drive parameters and scan a disk's partition table.
+ * \brief Native disk drivers, in order of preference.
+ */
+static const DiskDriver *const diskDrivers[] = {
+#if CONFIG_DISK_ATA
+	&ataDiskDriver,
+#endif /* CONFIG_DISK_ATA */
+#if CONFIG_DISK_AHCI
+	&ahciDiskDriver,
+#endif /* CONFIG_DISK_AHCI */
+#if CONFIG_DISK_NVME
+	&nvmeDiskDriver,
+#endif /* CONFIG_DISK_NVME */
+#if CONFIG_DISK_VIRTIO
+	&virtioBlkDiskDriver,
+#endif /* CONFIG_DISK_VIRTIO */
+	NULL,
+};
+
+/**
+ * \brief Find a native driver for a disk, and scan its partition table.
  *
- * \param disk a disk structure
+ * \param disk a disk structure with drive parameters filled in
  *
  * \return the amount of partitions detected, or -1 on error
  */
@@ -218,17 +1035,35 @@ static int diskScan(Disk *disk) {
 
 	//printf("Scanning disk %02xh\n", disk->biosId);
 
-	if (diskGetParams(disk))
+	if (!disk->blockSize)
 		// Something's not right with the drive parameters, drop the disk.
 		return -1;
 
+	if (!disk->virtual) {
+		// Before a native driver gets a chance to take the controller away
+		// from the BIOS, unless that already happened for another disk.
+		if (!disk->biosLost) {
+			biosProbeTransferSize(disk);
+			biosProbeFlatAddressing(disk);
+		}
+
+		for (size_t i=0; diskDrivers[i]; i++) {
+			if (diskDrivers[i]->claim(disk))
+				break;
+		}
+
+		if (!disk->driver && disk->biosLost) {
+			printf("warning: Disk %02xh is on a reset controller, but no driver claimed it\n", disk->biosId);
+			return -1;
+		}
+	}
+
 	int ret = DISK_PART_SCAN_ERR_TRY_OTHER;
 
 	for (size_t i=0; i<ELEMS(diskScanners); i++) {
 		//printf("-> scanning partition table type '%s'\n", diskScanners[i].name);
 		ret = diskScanners[i].scannerFunc(disk, 0, disk->blockCount);
 		if (ret == DISK_PART_SCAN_OK) {
-			/// @note Could check for GPT partition here, for example.
 			break;
 		} else if (ret == DISK_PART_SCAN_ERR_CORRUPT) {
 			// The partition table was recognized by the scanner, but contains errors.
@@ -260,35 +1095,136 @@ static int diskScan(Disk *disk) {
 	}
 }
 
-int disksDiscover() {
-	diskCount = bda->hdCount;
-	uint32_t availableDisks = 0;
+/**
+ * \brief Scan a disk and detect the filesystems on it, if not done before.
+ *
+ * \param disk
+ */
+static void diskProbe(Disk *disk) {
+	if (disk->scanned)
+		return;
 
-	if (diskCount > DISK_MAX_DISKS)
-		printf("Scanning %u disk(s) out of %u\n", MIN(diskCount, DISK_MAX_DISKS), diskCount);
+	disk->scanned = true;
 
-	diskCount = MIN(diskCount, DISK_MAX_DISKS);
+	int partitionCount = diskScan(disk);
+	if (partitionCount > 0) {
+		disk->available = true;
+		availableDiskCount++;
 
-	// Detect partitions and filesystems.
-	for (uint32_t i=0; i<MIN(diskCount, DISK_MAX_DISKS); i++) {
-		memset(&disks[i], 0, sizeof(Disk));
+		for (uint32_t i=0; i<disk->partitionCount; i++) {
+			Partition *part = &disk->partitions[i];
+#if CONFIG_DISK_MD
+			if (mdProbe(part))
+				continue; // Its filesystem, if any, belongs to the array.
+#endif /* CONFIG_DISK_MD */
+#if CONFIG_DISK_LVM
+			if (lvmProbe(part))
+				continue;
+#endif /* CONFIG_DISK_LVM */
+			fsDetect(part);
+			if (part->fsDriver)
+				partitionIndexAdd(part);
+		}
 
-		disks[i].diskNo = i;
-		disks[i].biosId = 0x80 + i;
+	} else if (partitionCount == 0) {
+		printf("warning: No partitions found on disk %02xh\n", disk->biosId);
+		disk->available = true; // We might want to chainload to this disk.
+		availableDiskCount++;
+	}
 
-		int partitionCount = diskScan(&disks[i]);
-		if (partitionCount > 0) {
-			disks[i].available = true;
-			availableDisks++;
+#if CONFIG_DISK_MD
+	// Array members may be spread over several disks. Look for the missing
+	// ones before an array is assembled without them.
+	while (mdPending() && diskProbeNext())
+		;
+	mdAssemble();
+#endif /* CONFIG_DISK_MD */
 
-			for (uint32_t j=0; j<disks[i].partitionCount; j++)
-				fsDetect(&disks[i].partitions[j]);
+#if CONFIG_DISK_LVM
+	// Likewise for the physical volumes of a volume group.
+	while (lvmPending() && diskProbeNext())
+		;
+	lvmAssemble();
+#endif /* CONFIG_DISK_LVM */
+}
 
-		} else if (partitionCount == 0) {
-			printf("warning: No partitions found on disk %02xh\n", disks[i].biosId);
-			availableDisks++; // We might want to chainload to this disk.
+/**
+ * \brief Scan the first disk that has not been scanned yet.
+ *
+ * \return false if all disks have been scanned already
+ */
+static bool diskProbeNext(void) {
+	for (uint32_t i=0; i<diskCount; i++) {
+		if (!disks[i].scanned) {
+			diskProbe(&disks[i]);
+			return true;
 		}
 	}
+	return false;
+}
+
+Disk *diskAddVirtual(const DiskDriver *driver, void *driverData, uint16_t blockSize, uint64_t blockCount) {
+	if (diskCount == diskCapacity)
+		return NULL;
+
+	Disk *disk = &disks[diskCount];
+	farzero((uint32_t)disk, sizeof(Disk));
+
+	disk->diskNo     = diskCount;
+	disk->biosId     = DISK_VIRTUAL_BIOS_ID_FIRST - (diskCount - (diskCapacity - CONFIG_DISK_MAX_VIRTUAL));
+	disk->virtual    = true;
+	disk->blockSize  = blockSize;
+	disk->blockCount = blockCount;
+	disk->pciAddress = PCI_ADDRESS_NONE;
+	disk->driver     = driver;
+	disk->driverData = driverData;
+
+	diskCount++;
+
+	return disk;
+}
+
+Disk *getDisk(uint32_t diskNo) {
+	if (diskNo >= diskCount)
+		return NULL;
+
+	diskProbe(&disks[diskNo]);
+
+	return &disks[diskNo];
+}
+
+int disksDiscover(uint8_t bootDiskId) {
+	// Keep loaded files from landing in our transfer buffers.
+	reserveMem(DISK_BOUNCE_BUFFER_ADDR,    DISK_BOUNCE_BUFFER_SIZE);
+	reserveMem(DISK_READAHEAD_BUFFER_ADDR, DISK_READAHEAD_BUFFER_SIZE);
+	reserveMem(DISK_BLOCK_BUFFERS_ADDR,    DISK_BLOCK_BUFFER_COUNT * DISK_MAX_BLOCK_SIZE);
+
+	diskCacheInit();
+	diskTraceInit();
+
+	disks = heapAlloc((bda->hdCount + CONFIG_DISK_MAX_VIRTUAL) * sizeof(Disk));
+	if (!disks) {
+		printf("warning: Out of heap memory for %u disk(s)\n", bda->hdCount);
+		return 0;
+	}
+
+	diskCount    = bda->hdCount;
+	diskCapacity = bda->hdCount + CONFIG_DISK_MAX_VIRTUAL;
+
+	for (uint32_t i=0; i<diskCount; i++) {
+		disks[i].diskNo = i;
+		disks[i].biosId = 0x80 + i;
+		disks[i].biosMaxTransferBlocks = DISK_MAX_TRANSFER_BLOCKS;
+		disks[i].pciAddress = PCI_ADDRESS_NONE;
+		diskGetParams(&disks[i]);
+	}
+
+	// Only look at the disk we were loaded from, unless it turns out to be useless.
+	if (bootDiskId >= 0x80 && bootDiskId - 0x80u < diskCount)
+		diskProbe(&disks[bootDiskId - 0x80]);
+
+	while (!availableDiskCount && diskProbeNext())
+		;
 
-	return availableDisks;
+	return availableDiskCount;
 }
@@ -10,19 +10,153 @@
 
 #include "common.h"
 #include "fs/fs.h"
+#include "disk/io-stats.h"
 
-#define DISK_MAX_DISKS               4
-#define DISK_MAX_PARTITIONS_PER_DISK 7
-#define DISK_MAX_BLOCK_SIZE          512
+#define DISK_MAX_BLOCK_SIZE          4096 ///< 4Kn disks.
+
+/// Room in the disk table for virtual disks, such as md arrays.
+#ifndef CONFIG_DISK_MAX_VIRTUAL
+#define CONFIG_DISK_MAX_VIRTUAL      4
+#endif /* CONFIG_DISK_MAX_VIRTUAL */
+
+/**
+ * \brief Virtual disks get made-up BIOS ids counting down from here.
+ *
+ * They identify the disk in the cache and in messages, and are never passed
+ * to int13h.
+ */
+#define DISK_VIRTUAL_BIOS_ID_FIRST   0xff
+
+/// The maximum amount of blocks that fit in a single int13h transfer.
+#define DISK_MAX_TRANSFER_BLOCKS     127
+
+/**
+ * \brief Low-memory bounce buffer for transfers that int13h cannot address.
+ *
+ * Sits in the 64K segment directly above stage2 and fits one maximal
+ * transfer without crossing a 64K boundary. It is reserved in the memory map
+ * once disks are discovered.
+ */
+#define DISK_BOUNCE_BUFFER_ADDR      0x10000
+#define DISK_BOUNCE_BUFFER_SIZE      0x10000
+
+/**
+ * \brief Low-memory staging buffer for partition read-ahead.
+ *
+ * Directly above the bounce buffer, so that int13h can fill it without a
+ * bounce copy.
+ */
+#define DISK_READAHEAD_BUFFER_ADDR   0x20000
+#define DISK_READAHEAD_BUFFER_SIZE   0x10000
+
+/// The initial read-ahead window, doubled on every sequential read.
+#define DISK_READAHEAD_MIN_BLOCKS    8
+
+/**
+ * \brief Low-memory block buffers, directly above the read-ahead buffer.
+ *
+ * Blocks of up to 4K do not belong on the stack. Their users can be active at
+ * the same time, as loading the rc file may set off a lazy disk scan, so each
+ * gets a buffer of its own. Get their addresses with diskBlockBuffer().
+ */
+#define DISK_BLOCK_BUFFERS_ADDR      0x30000
+
+typedef enum {
+	DISK_BLOCK_BUFFER_CHECK_BIOS,   ///< Native driver checks.
+	DISK_BLOCK_BUFFER_CHECK_NATIVE, ///< .
+	DISK_BLOCK_BUFFER_TABLE,        ///< Partition table scanners: the MBR or GPT header.
+	DISK_BLOCK_BUFFER_TABLE_EXTRA,  ///< .                         an EBR or the protective MBR.
+	DISK_BLOCK_BUFFER_VFAT_BPB,
+	DISK_BLOCK_BUFFER_VFAT_FAT,
+	DISK_BLOCK_BUFFER_VFAT_DIR,
+	DISK_BLOCK_BUFFER_RCFILE,
+	DISK_BLOCK_BUFFER_ELF,
+	DISK_BLOCK_BUFFER_COUNT,
+} DiskBlockBuffer;
 
 #define DISK_PART_SCAN_OK             (0)
 #define DISK_PART_SCAN_ERR_TRY_OTHER (-1)
 #define DISK_PART_SCAN_ERR_CORRUPT   (-2)
 #define DISK_PART_SCAN_ERR_IO        (-3)
 
+/// The type of partitions that do not come from a partition table, such as
+/// a whole md array. Filesystems recognize these by their contents alone.
+#define DISK_PART_TYPE_NONE          0x00
+
 typedef struct Disk Disk; // Allows referring to Disk in the Partition struct.
 typedef struct Partition Partition;
 
+/**
+ * \brief One range of a vectored read: blocks and where they should go.
+ */
+typedef struct {
+	uint64_t lba;        ///< Relative to the partition for partReadv().
+	uint32_t blockCount;
+	uint32_t dest;       ///< Any address below 4G.
+} DiskIoVec;
+
+/**
+ * \brief A native disk driver, used instead of int13h for the disks it claims.
+ */
+typedef struct {
+	const char *name;
+
+	/**
+	 * \brief Try to take over a disk that was discovered through the BIOS.
+	 *
+	 * On success, the driver has set disk->driver and disk->driverData.
+	 * Drivers should confirm a match using diskCheckDriver().
+	 *
+	 * \param disk a disk with drive parameters filled in
+	 *
+	 * \return whether the disk was claimed
+	 */
+	bool (*claim)(Disk *disk);
+
+	/**
+	 * \brief Read blocks into any address below 4G.
+	 *
+	 * \param disk
+	 * \param dest
+	 * \param lba
+	 * \param blockCount at most maxTransferBlocks
+	 *
+	 * \return zero on success, non-zero on error
+	 */
+	int (*read)(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount);
+
+	/**
+	 * \brief Hand the device back to the BIOS (may be NULL).
+	 *
+	 * Called before a disk falls back to int13h.
+	 *
+	 * \param disk
+	 */
+	void (*release)(Disk *disk);
+
+	uint32_t maxTransferBlocks;
+
+	/**
+	 * \brief Whether the driver resets the device, after which int13h can no
+	 *        longer read from it.
+	 *
+	 * Failed reads are then reported instead of being retried through the
+	 * BIOS. Such drivers call diskBiosLost() before the reset.
+	 */
+	bool noBiosFallback;
+} DiskDriver;
+
+/**
+ * \brief Where a disk is attached, according to EDD 3.0 device path information.
+ */
+typedef struct {
+	bool     valid;            ///< Whether the BIOS reported a device path with a correct checksum.
+	char     busType[5];       ///< "PCI" or "ISA".
+	char     interfaceType[9]; ///< "ATA", "ATAPI", "SCSI", "USB", "1394", "FIBRE", "SATA", "NVME", ...
+	uint64_t interfacePath;    ///< PCI: bus, device, function and channel bytes. ISA: the I/O base address.
+	uint64_t devicePath;       ///< ATA: 0 for master, 1 for slave. SATA: the port number. NVMe: the namespace id.
+} __attribute__((packed)) DiskDevicePath;
+
 /**
  * \brief Disk partition.
  */
@@ -34,10 +168,15 @@ struct Partition {
 	uint64_t lbaStart;
 	uint64_t blockCount;
 	uint32_t token; ///< Number unique to this partition, used for caching within FS code.
+	uint64_t readAheadNext;   ///< The relative LBA a sequential reader would request next.
+	uint8_t  readAheadWindow; ///< Amount of blocks to prefetch on the next sequential read, 0 if not streaming.
 	uint16_t partitionNo;
-	uint8_t  type;
+	uint8_t  type;           ///< MBR system id, MBR_SYSTEM_ID_GPT for GPT partitions, or DISK_PART_TYPE_NONE.
+	uint8_t  typeGuid[16];   ///< GPT partition type GUID, zero for MBR partitions.
+	uint8_t  uniqueGuid[16]; ///< GPT unique partition GUID, zero for MBR partitions.
 	bool     active;
 	bool     fsInitialized; ///< Whether FS code has initialized Partition fields (currently only applies to 'label' and 'id').
+	IoStats  stats;         ///< partRead() and partReadv() requests.
 } __attribute__((packed));
 
 /**
@@ -45,21 +184,82 @@ struct Partition {
  */
 struct Disk {
 	uint16_t diskNo;    ///< 0, 1 ...
+	bool     scanned;   ///< Whether the partition table and filesystems have been probed.
 	bool     available; ///< Whether we can read from this disk.
+	bool     virtual;   ///< Not known to the BIOS, its driver builds it from other disks.
 	uint8_t  biosId;    ///< 80h, 81h, ... (used for int13h).
 	uint16_t blockSize; ///< Usually 512, may be 4096.
 	uint16_t partitionCount;
 	uint64_t blockCount;
-	Partition partitions[DISK_MAX_PARTITIONS_PER_DISK];
+	uint32_t pciAddress; ///< Host controller according to EDD, PCI_ADDRESS_NONE if unknown.
+	DiskDevicePath path; ///< EDD device path, for drivers to find the disk's controller and port.
+	uint16_t cylinders;       ///< BIOS CHS geometry, zero if unknown. Only passed on to the kernel.
+	uint8_t  heads;           ///< .
+	uint8_t  sectorsPerTrack; ///< .
+	uint16_t ioPorts[2];      ///< ATA command and control block base ports from the EDD DPTE, zero if unknown.
+	const DiskDriver *driver; ///< Native driver for this disk, NULL to use int13h.
+	void  *driverData;        ///< Driver-specific state.
+	Partition *partitions;    ///< In the loader heap, grows with diskAddPartition().
+	uint16_t partitionCapacity;
+	uint8_t  biosMaxTransferBlocks; ///< The largest int13h transfer known to work, shrinks after failures.
+	bool     biosFlatAddressing;    ///< Whether int13h can read directly above 1 MiB using 64-bit DAP addresses.
+	bool     biosLost;              ///< Whether a native driver has reset the controller, so that int13h no longer works.
+	IoStats  stats;                 ///< diskRead() requests, including those made for partitions.
 } __attribute__((packed));
 
 extern uint32_t diskCount;
-extern Disk     disks[];
+extern Disk    *disks; ///< In the loader heap, diskCount entries, not all of which may be scanned.
+
+/**
+ * \brief The amount of int13h read calls issued since boot.
+ */
+extern uint32_t diskTransferCount;
+
 
+/**
+ * \brief Add an empty partition to a disk.
+ *
+ * The partition table grows as needed. This moves it, so pointers to the
+ * disk's other partitions are invalid after the call. Partition table
+ * scanners are the only callers.
+ *
+ * \param disk
+ *
+ * \return a zeroed partition with its disk, number and token filled in, or
+ *         NULL if the heap is exhausted
+ */
+Partition *diskAddPartition(Disk *disk);
+
+/**
+ * \brief Add a virtual disk, read entirely through its driver.
+ *
+ * The disk is scanned when it is first looked up, like BIOS disks.
+ *
+ * \param driver
+ * \param driverData
+ * \param blockSize
+ * \param blockCount
+ *
+ * \return the new disk, or NULL if the disk table is full
+ */
+Disk *diskAddVirtual(const DiskDriver *driver, void *driverData, uint16_t blockSize, uint64_t blockCount);
+
+/**
+ * \brief Get a disk by number, scanning it on first use.
+ *
+ * \param diskNo
+ *
+ * \return a pointer to a Disk struct, or NULL if diskNo is out of range
+ */
+Disk *getDisk(uint32_t diskNo);
 
 /**
  * \brief Get a partition by its file system id.
  *
+ * Looked up in a hash index of all partitions with a detected filesystem.
+ * Disks that have not been scanned yet are scanned one by one until the
+ * partition is found.
+ *
  * \param fsId a filesystem UUID (id length is implementation-dependent)
  *
  * \return a pointer to a Partition struct, or NULL if the partition could not
@@ -70,6 +270,10 @@ Partition *getPartitionByFsId(uint64_t fsId);
 /**
  * \brief Get a partition by its file system label.
  *
+ * Looked up in a hash index of all partitions with a detected filesystem.
+ * Disks that have not been scanned yet are scanned one by one until the
+ * partition is found.
+ *
  * \param fsLabel a filesystem / volume label
  *
  * \return a pointer to a Partition struct, or NULL if the partition could not
@@ -80,6 +284,13 @@ Partition *getPartitionByFsLabel(const char *fsLabel);
 /**
  * \brief Read blocks from a hard drive.
  *
+ * Uses the disk's native driver if it has one, and falls back to int13h if
+ * that fails. int13h requests are split into transfers of at most the disk's
+ * biosMaxTransferBlocks that do not cross a 64K physical boundary, and
+ * destinations above 1 MiB are read through the bounce buffer, unless the BIOS
+ * has proven to support flat 64-bit destination addresses. A failed
+ * transfer is retried in smaller pieces before giving up.
+ *
  * \param disk a pointer to a disk structure
  * \param dest destination address
  * \param lba logical block address
@@ -89,11 +300,68 @@ Partition *getPartitionByFsLabel(const char *fsLabel);
  */
 int diskRead(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount);
 
+/**
+ * \brief Read a list of block ranges from a hard drive.
+ *
+ * The vectors are sorted by LBA, and ranges that are adjacent on disk are
+ * read with one request. When their destinations are not contiguous either,
+ * runs that fit in the bounce buffer are read into it and copied out.
+ *
+ * \param disk
+ * \param vecs the ranges to read, reordered in place
+ * \param vecCount
+ *
+ * \return zero on success, non-zero on error
+ */
+int diskReadv(Disk *disk, DiskIoVec *vecs, uint32_t vecCount);
+
+/**
+ * \brief Get the address of a low-memory block buffer.
+ *
+ * Constant addresses above 64K would be truncated when the compiler folds
+ * them into an instruction, so buffers are only reached through this.
+ *
+ * \param buffer
+ *
+ * \return DISK_MAX_BLOCK_SIZE bytes below 1M
+ */
+void *diskBlockBuffer(DiskBlockBuffer buffer);
+
+/**
+ * \brief Stop using int13h for all disks on a controller.
+ *
+ * Drivers call this right before they reset a controller that the BIOS
+ * drives. Disks on it that no native driver claims become unavailable.
+ *
+ * \param pciAddress
+ */
+void diskBiosLost(uint32_t pciAddress);
+
+/**
+ * \brief Check that a disk's native driver reads the same data as int13h.
+ *
+ * \param disk a disk with its driver and driverData set
+ *
+ * \return whether the driver can be trusted with this disk
+ */
+bool diskCheckDriver(Disk *disk);
+
+/**
+ * \brief Stop using a disk's native driver, and read it through int13h.
+ *
+ * \param disk
+ */
+void diskDropDriver(Disk *disk);
+
 /**
  * \brief Read blocks from a partition.
  *
  * Does bound checks.
  *
+ * Sequential reads are detected per partition: these prefetch a growing
+ * window of blocks into the read-ahead buffer, from which the following
+ * reads are served.
+ *
  * \param part
  * \param dest
  * \param relLba
@@ -104,10 +372,32 @@ int diskRead(Disk *disk, uint64_t dest, uint64_t lba, uint64_t blockCount);
 int partRead(Partition *part, uint64_t dest, uint64_t relLba, uint64_t blockCount);
 
 /**
- * \brief Detects disk drives, parses partition tables, fills Disk structs.
+ * \brief Read a list of block ranges from a partition.
+ *
+ * Does bound checks, see diskReadv(). Bypasses read-ahead.
+ *
+ * \param part
+ * \param vecs the ranges to read, with partition-relative LBAs, reordered in place
+ * \param vecCount
+ *
+ * \return zero on success, non-zero on error
+ */
+int partReadv(Partition *part, DiskIoVec *vecs, uint32_t vecCount);
+
+/**
+ * \brief Detects disk drives, and scans the disk that stage2 was loaded from.
+ *
+ * Drive parameters are read for every disk, as this does not touch the media.
+ * Other disks are scanned when they are first looked up, so that we do not
+ * wait on drives that we will not boot from.
+ * If the boot disk is unusable, the other disks are scanned until a usable one
+ * is found.
+ *
+ * \param bootDiskId the BIOS id of the disk stage2 was loaded from (80h, ...)
  *
- * \return the amount of available disk drives (disks we can read from)
+ * \return the amount of available disk drives (disks we can read from) among
+ *         the scanned disks
  */
-int disksDiscover();
+int disksDiscover(uint8_t bootDiskId);
 
 #endif /* _DISK_DISK_H */
@@ -0,0 +1,74 @@
+/**
+ * \file
+ * \brief     Disk I/O statistics.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "io-stats.h"
+#include "disk/disk.h"
+#include "heap.h"
+#include "far.h"
+
+void ioStatsAdd(IoStats *stats, uint32_t blockCount, uint32_t blockSize, uint64_t startTsc, bool error) {
+	stats->calls++;
+	stats->blocks += blockCount;
+	stats->bytes  += (uint64_t)blockCount * blockSize;
+	stats->cycles += rdtsc() - startTsc;
+
+	if (blockCount > stats->largestBlocks)
+		stats->largestBlocks = blockCount;
+	if (error)
+		stats->errors++;
+}
+
+/**
+ * \brief Fill in a statistics record.
+ *
+ * \param record in the loader heap
+ * \param biosId
+ * \param partitionNo
+ * \param stats
+ */
+static void ioStatsRecord(IoStatsRecord *record, uint8_t biosId, uint16_t partitionNo, IoStats *stats) {
+	record->biosId      = biosId;
+	record->partitionNo = partitionNo;
+	farcpy((uint32_t)&record->stats, (uint32_t)stats, sizeof(IoStats));
+}
+
+int ioStatsExport(uint32_t *start, uint32_t *end) {
+	uint32_t recordCount = 0;
+	for (uint32_t i=0; i<diskCount; i++) {
+		if (disks[i].scanned)
+			recordCount += 1 + disks[i].partitionCount;
+	}
+
+	IoStatsHeader *header = heapAlloc(sizeof(IoStatsHeader) + recordCount * sizeof(IoStatsRecord));
+	if (!header)
+		return -1;
+
+	farcpy((uint32_t)header->magic, (uint32_t)IO_STATS_MAGIC, sizeof(header->magic));
+	header->version     = IO_STATS_VERSION;
+	header->recordSize  = sizeof(IoStatsRecord);
+	header->recordCount = recordCount;
+
+	IoStatsRecord *record = (IoStatsRecord*)(header + 1);
+
+	for (uint32_t i=0; i<diskCount; i++) {
+		Disk *disk = &disks[i];
+		if (!disk->scanned)
+			continue;
+
+		ioStatsRecord(record++, disk->biosId, IO_STATS_WHOLE_DISK, &disk->stats);
+
+		for (uint32_t j=0; j<disk->partitionCount; j++) {
+			Partition *part = &disk->partitions[j];
+			ioStatsRecord(record++, disk->biosId, part->partitionNo, &part->stats);
+		}
+	}
+
+	*start = (uint32_t)header;
+	*end   = (uint32_t)record;
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * \file
+ * \brief     Disk I/O statistics.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Every Disk and Partition counts the reads issued to it. The counters can be
+ * shown with the io-stats command, and are passed to the kernel as a
+ * multiboot module, see ioStatsExport().
+ */
+#ifndef _DISK_IO_STATS_H
+#define _DISK_IO_STATS_H
+
+#include "common.h"
+
+/// The command line of the multiboot module holding the statistics.
+#define IO_STATS_MODULE_NAME "stoomboot-io-stats"
+
+#define IO_STATS_MAGIC   "SBIOSTAT"
+#define IO_STATS_VERSION 1
+
+/// IoStatsRecord.partitionNo of a whole-disk record.
+#define IO_STATS_WHOLE_DISK 0xffff
+
+/**
+ * \brief I/O counters for a disk or partition.
+ */
+typedef struct {
+	uint32_t calls;         ///< Read requests, including cache and read-ahead hits.
+	uint32_t errors;        ///< Failed read requests.
+	uint64_t blocks;        ///< Blocks requested.
+	uint64_t bytes;         ///< Bytes requested.
+	uint32_t largestBlocks; ///< The largest single request, in blocks.
+	uint64_t cycles;        ///< Time spent in requests, in TSC ticks (0 without a TSC).
+} __attribute__((packed)) IoStats;
+
+/**
+ * \brief Header of the multiboot statistics module, followed by recordCount
+ *        IoStatsRecords.
+ */
+typedef struct {
+	char     magic[8];    ///< IO_STATS_MAGIC, not NUL-terminated.
+	uint16_t version;     ///< IO_STATS_VERSION.
+	uint16_t recordSize;  ///< sizeof(IoStatsRecord), records may grow in later versions.
+	uint32_t recordCount;
+} __attribute__((packed)) IoStatsHeader;
+
+typedef struct {
+	uint8_t  biosId;
+	uint8_t  _reserved;
+	uint16_t partitionNo; ///< IO_STATS_WHOLE_DISK for the disk's own counters.
+	IoStats  stats;
+} __attribute__((packed)) IoStatsRecord;
+
+/**
+ * \brief Account a finished read request.
+ *
+ * \param stats
+ * \param blockCount
+ * \param blockSize
+ * \param startTsc the TSC at the start of the request
+ * \param error whether the request failed
+ */
+void ioStatsAdd(IoStats *stats, uint32_t blockCount, uint32_t blockSize, uint64_t startTsc, bool error);
+
+/**
+ * \brief Write the statistics of all scanned disks and their partitions to
+ *        the loader heap.
+ *
+ * The loader only reserves the heap for itself: the memory map passed to
+ * the kernel is the BIOS map, in which the heap is free memory. As with any
+ * multiboot module, the kernel must not overwrite the data before it has
+ * read it. The same goes for the drives table and the memory map itself,
+ * which are in the heap as well.
+ *
+ * \param[out] start the address of the IoStatsHeader
+ * \param[out] end   the address right after the last record
+ *
+ * \return zero on success, non-zero if the heap is exhausted
+ */
+int ioStatsExport(uint32_t *start, uint32_t *end);
+
+#endif /* _DISK_IO_STATS_H */
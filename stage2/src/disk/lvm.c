@@ -0,0 +1,842 @@
+/**
+ * \file
+ * \brief     LVM2 volume groups.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "lvm.h"
+
+#if CONFIG_DISK_LVM
+
+#include "heap.h"
+#include "far.h"
+#include "crc32.h"
+#include "console.h"
+
+#define LVM_MAX_VGS       2
+#define LVM_MAX_PVS       8  ///< Per volume group.
+#define LVM_MAX_LVS       16 ///< Per volume group.
+#define LVM_MAX_RUNS      64 ///< Per volume group.
+#define LVM_MAX_FOUND_PVS (LVM_MAX_VGS * LVM_MAX_PVS)
+
+#define LVM_NAME_LENGTH   32 ///< Longer names are cut short, they are only shown to the user.
+#define LVM_ID_LENGTH     32 ///< UUIDs, without dashes.
+#define LVM_MAX_DEPTH     8  ///< Metadata section nesting.
+
+/// Superblock locations are in 512-byte sectors, regardless of the disk's block size.
+#define LVM_SECTOR_SIZE   512u
+/// The label is in one of the first four sectors.
+#define LVM_LABEL_SECTORS 4
+
+#define LVM_MDA_HEADER_SIZE   512
+#define LVM_MAX_METADATA_SIZE 0x10000
+
+/// Metadata read buffer size, with room for partial blocks on either end.
+#define LVM_BUFFER_SIZE (LVM_MAX_METADATA_SIZE + 2 * DISK_MAX_BLOCK_SIZE)
+
+/// Checksums are CRC-32 without the final inversion, starting from this value.
+#define LVM_INITIAL_CRC 0xf597a6cf
+
+#define LVM_MDA_MAGIC " LVM2 x[5A%r0N*>"
+
+#define LVM_RAW_LOCATION_IGNORED 0x01
+
+/**
+ * \brief The label header, in one of the first four sectors of a PV.
+ */
+typedef struct {
+	char     id[8];  ///< "LABELONE".
+	uint64_t sector; ///< Where this label is.
+	uint32_t crc;    ///< Over the rest of the sector, starting at offset.
+	uint32_t offset; ///< Of the PV header, from the start of the label.
+	char     type[8]; ///< "LVM2 001".
+} __attribute__((packed)) LvmLabelHeader;
+
+/**
+ * \brief A data or metadata area on a PV, in bytes.
+ */
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+} __attribute__((packed)) LvmDiskLocation;
+
+typedef struct {
+	char     uuid[LVM_ID_LENGTH];
+	uint64_t deviceSize;
+	LvmDiskLocation areas[]; ///< Data areas, then metadata areas, each list terminated by a zero entry.
+} __attribute__((packed)) LvmPvHeader;
+
+/**
+ * \brief Where a copy of the metadata text is, relative to its metadata area.
+ */
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t checksum;
+	uint32_t flags;
+} __attribute__((packed)) LvmRawLocation;
+
+/**
+ * \brief The header of a metadata area, which is a ring buffer of metadata text.
+ */
+typedef struct {
+	uint32_t checksum; ///< Over the rest of the header.
+	char     magic[16];
+	uint32_t version;
+	uint64_t start;    ///< Where this header is, in bytes.
+	uint64_t size;     ///< Of the whole metadata area, including this header.
+	LvmRawLocation locations[]; ///< The first one is the current metadata.
+} __attribute__((packed)) LvmMdaHeader;
+
+typedef struct {
+	char       name[LVM_NAME_LENGTH]; ///< As used in LV segments, e.g. "pv0".
+	char       uuid[LVM_ID_LENGTH];
+	uint32_t   peStart;               ///< In sectors, in blocks once the volume group is assembled.
+	Partition *part;                  ///< NULL while the PV has not been found.
+} __attribute__((packed)) LvmPv;
+
+/**
+ * \brief A range of volume group extents that is contiguous on one PV.
+ */
+typedef struct {
+	uint32_t extent;   ///< On the volume group disk.
+	uint32_t extentCount;
+	uint32_t pvExtent; ///< Relative to the PV's first extent.
+	uint8_t  pv;
+} __attribute__((packed)) LvmRun;
+
+typedef struct {
+	char     name[LVM_NAME_LENGTH];
+	uint32_t extent;      ///< Where the LV starts on the volume group disk.
+	uint32_t extentCount; ///< Zero if the LV is not readable.
+} __attribute__((packed)) LvmLv;
+
+/**
+ * \brief A volume group. Its disk holds the readable LVs back to back.
+ */
+typedef struct {
+	char     name[LVM_NAME_LENGTH];
+	char     uuid[LVM_ID_LENGTH];
+	uint32_t seqno;       ///< Metadata version.
+	uint32_t extentSize;  ///< In sectors.
+	uint32_t extentCount; ///< Of the volume group disk.
+	uint8_t  extentShift; ///< log2 of the extent size in blocks, once assembled.
+	bool     assembled;
+	uint8_t  pvCount;
+	uint8_t  lvCount;
+	uint8_t  runCount;
+	LvmPv    pvs[LVM_MAX_PVS];
+	LvmLv    lvs[LVM_MAX_LVS];
+	LvmRun   runs[LVM_MAX_RUNS]; ///< Sorted by extent.
+} __attribute__((packed)) LvmVg;
+
+typedef struct {
+	char       uuid[LVM_ID_LENGTH];
+	Partition *part;
+} __attribute__((packed)) LvmFoundPv;
+
+typedef enum {
+	LVM_SECTION_OTHER = 0,
+	LVM_SECTION_ROOT,
+	LVM_SECTION_VG,
+	LVM_SECTION_PVS,
+	LVM_SECTION_PV,
+	LVM_SECTION_LVS,
+	LVM_SECTION_LV,
+	LVM_SECTION_SEGMENT,
+} LvmSection;
+
+#define LVM_TOKEN_END    0
+#define LVM_TOKEN_WORD   'w'
+#define LVM_TOKEN_STRING 's'
+
+/**
+ * \brief Metadata parser state.
+ */
+typedef struct {
+	const char *text;
+	uint32_t    length;
+	uint32_t    pos;
+	char        token[40]; ///< Long enough for a UUID with dashes.
+
+	LvmVg      *vg;
+
+	// The LV being parsed.
+	bool        lvVisible;
+	bool        lvUsable;
+	uint8_t     lvRunStart;
+	uint32_t    lvExtents;
+
+	// The segment being parsed.
+	bool        segStriped;
+	uint32_t    segStripeCount;
+	uint32_t    segStart;
+	uint32_t    segExtents;
+	int         segPv;
+	uint32_t    segPvExtent;
+} LvmParser;
+
+static LvmVg      *vgs[LVM_MAX_VGS];
+static uint32_t    vgCount = 0;
+static LvmVg      *scratchVg = NULL; ///< Parse target, kept for the next parse if the result is not used.
+static LvmFoundPv *foundPvs  = NULL;
+static uint32_t    foundPvCount = 0;
+static uint8_t    *buffer = NULL;    ///< Label and metadata read buffer, in the loader heap.
+
+static uint32_t lvmCrc(uint32_t crc, uint32_t data, uint32_t length) {
+	return ~crc32(~crc, data, length);
+}
+
+static bool lvmIdEq(const char *id1, const char *id2) {
+	return strneq(id1, id2, LVM_ID_LENGTH);
+}
+
+/**
+ * \brief Copy a UUID, dropping the dashes that the metadata text uses.
+ */
+static void lvmCopyId(char *dest, const char *src) {
+	for (uint32_t i=0; *src && i<LVM_ID_LENGTH; src++) {
+		if (*src != '-')
+			dest[i++] = *src;
+	}
+}
+
+/**
+ * \brief Read a byte range from a partition into the read buffer.
+ *
+ * \return the address of the first byte in the buffer, or 0 on error
+ */
+static uint32_t lvmReadBytes(Partition *part, uint32_t bufferOffset, uint32_t offset, uint32_t length) {
+	uint32_t bs   = part->disk->blockSize;
+	uint32_t skip = offset & (bs - 1);
+
+	uint8_t shift = 0;
+	for (; (1u << shift) < bs; shift++)
+		;
+	uint32_t lba = offset >> shift;
+
+	if (lba >= part->blockCount || bufferOffset + skip + length > LVM_BUFFER_SIZE)
+		return 0;
+
+	uint32_t dest = (uint32_t)buffer + bufferOffset;
+	if (partRead(part, dest, lba, (skip + length + bs - 1) / bs))
+		return 0;
+
+	return dest + skip;
+}
+
+static char lvmNextToken(LvmParser *p) {
+	const char *text = p->text;
+
+	for (;;) {
+		while (p->pos < p->length && text[p->pos] && (uint8_t)text[p->pos] <= ' ')
+			p->pos++;
+
+		if (p->pos < p->length && text[p->pos] == '#') {
+			while (p->pos < p->length && text[p->pos] != '\n')
+				p->pos++;
+		} else {
+			break;
+		}
+	}
+
+	if (p->pos >= p->length || !text[p->pos])
+		return LVM_TOKEN_END;
+
+	char ch = text[p->pos];
+	if (strchr("={}[],", ch)) {
+		p->pos++;
+		return ch;
+	}
+
+	uint32_t i = 0;
+	if (ch == '"') {
+		for (p->pos++; p->pos < p->length && text[p->pos] != '"'; p->pos++) {
+			if (text[p->pos] == '\\')
+				p->pos++;
+			if (i < sizeof(p->token) - 1)
+				p->token[i++] = text[p->pos];
+		}
+		p->pos++;
+		p->token[i] = '\0';
+		return LVM_TOKEN_STRING;
+	}
+
+	for (; p->pos < p->length && (uint8_t)text[p->pos] > ' ' && !strchr("={}[],\"#", text[p->pos]); p->pos++) {
+		if (i < sizeof(p->token) - 1)
+			p->token[i++] = text[p->pos];
+	}
+	p->token[i] = '\0';
+
+	return LVM_TOKEN_WORD;
+}
+
+static uint32_t lvmNumber(const char *str) {
+	uint32_t n = 0;
+	for (; *str >= '0' && *str <= '9'; str++)
+		n = n * 10 + (*str - '0');
+	return n;
+}
+
+/**
+ * \brief Append a run of extents to the volume group, extending the last run
+ *        if this one continues it.
+ *
+ * \return false if there are too many runs
+ */
+static bool lvmAddRun(LvmVg *vg, uint32_t extent, uint32_t count, uint32_t pvExtent, uint8_t pv) {
+	if (vg->runCount) {
+		LvmRun *last = &vg->runs[vg->runCount - 1];
+		if (
+			   last->pv                          == pv
+			&& last->extent   + last->extentCount == extent
+			&& last->pvExtent + last->extentCount == pvExtent
+		) {
+			last->extentCount += count;
+			return true;
+		}
+	}
+
+	if (vg->runCount == LVM_MAX_RUNS)
+		return false;
+
+	LvmRun *run = &vg->runs[vg->runCount++];
+	run->extent      = extent;
+	run->extentCount = count;
+	run->pvExtent    = pvExtent;
+	run->pv          = pv;
+
+	return true;
+}
+
+static LvmSection lvmOpenSection(LvmParser *p, LvmSection parent, const char *key) {
+	LvmVg *vg = p->vg;
+
+	if (parent == LVM_SECTION_ROOT && !vg->name[0]) {
+		strncpy(vg->name, key, LVM_NAME_LENGTH - 1);
+		return LVM_SECTION_VG;
+
+	} else if (parent == LVM_SECTION_VG && streq(key, "physical_volumes")) {
+		return LVM_SECTION_PVS;
+
+	} else if (parent == LVM_SECTION_VG && streq(key, "logical_volumes")) {
+		return LVM_SECTION_LVS;
+
+	} else if (parent == LVM_SECTION_PVS && vg->pvCount < LVM_MAX_PVS) {
+		strncpy(vg->pvs[vg->pvCount].name, key, LVM_NAME_LENGTH - 1);
+		return LVM_SECTION_PV;
+
+	} else if (parent == LVM_SECTION_LVS && vg->lvCount < LVM_MAX_LVS) {
+		strncpy(vg->lvs[vg->lvCount].name, key, LVM_NAME_LENGTH - 1);
+		p->lvVisible  = false;
+		p->lvUsable   = true;
+		p->lvRunStart = vg->runCount;
+		p->lvExtents  = 0;
+		return LVM_SECTION_LV;
+
+	} else if (parent == LVM_SECTION_LV) {
+		p->segStriped     = false;
+		p->segStripeCount = 0;
+		p->segStart       = 0;
+		p->segExtents     = 0;
+		p->segPv          = -1;
+		p->segPvExtent    = 0;
+		return LVM_SECTION_SEGMENT;
+	}
+
+	return LVM_SECTION_OTHER;
+}
+
+static void lvmCloseSection(LvmParser *p, LvmSection section) {
+	LvmVg *vg = p->vg;
+
+	if (section == LVM_SECTION_PV) {
+		vg->pvCount++;
+
+	} else if (section == LVM_SECTION_SEGMENT) {
+		// Only linear segments are supported, and they must follow each other.
+		if (
+			   !p->segStriped
+			|| p->segStripeCount != 1
+			|| p->segPv < 0
+			|| p->segStart != p->lvExtents
+			|| !lvmAddRun(vg, vg->extentCount + p->segStart, p->segExtents, p->segPvExtent, p->segPv)
+		)
+			p->lvUsable = false;
+
+		p->lvExtents += p->segExtents;
+
+	} else if (section == LVM_SECTION_LV) {
+		LvmLv *lv = &vg->lvs[vg->lvCount];
+
+		if (p->lvUsable && p->lvVisible && p->lvExtents) {
+			lv->extent       = vg->extentCount;
+			lv->extentCount  = p->lvExtents;
+			vg->extentCount += p->lvExtents;
+			vg->lvCount++;
+		} else {
+			// Snapshots, thin volumes, RAID images and the like.
+			vg->runCount = p->lvRunStart;
+		}
+	}
+}
+
+/**
+ * \brief Handle a value, or one item of a list value.
+ */
+static void lvmSetValue(LvmParser *p, LvmSection section, const char *key, uint32_t index) {
+	LvmVg   *vg = p->vg;
+	uint32_t n  = lvmNumber(p->token);
+
+	if (section == LVM_SECTION_VG) {
+		if (streq(key, "id"))
+			lvmCopyId(vg->uuid, p->token);
+		else if (streq(key, "seqno"))
+			vg->seqno = n;
+		else if (streq(key, "extent_size"))
+			vg->extentSize = n;
+
+	} else if (section == LVM_SECTION_PV) {
+		if (streq(key, "id"))
+			lvmCopyId(vg->pvs[vg->pvCount].uuid, p->token);
+		else if (streq(key, "pe_start"))
+			vg->pvs[vg->pvCount].peStart = n;
+
+	} else if (section == LVM_SECTION_LV) {
+		if (streq(key, "status") && streq(p->token, "VISIBLE"))
+			p->lvVisible = true;
+
+	} else if (section == LVM_SECTION_SEGMENT) {
+		if (streq(key, "start_extent")) {
+			p->segStart = n;
+		} else if (streq(key, "extent_count")) {
+			p->segExtents = n;
+		} else if (streq(key, "type")) {
+			p->segStriped = streq(p->token, "striped");
+		} else if (streq(key, "stripe_count")) {
+			p->segStripeCount = n;
+		} else if (streq(key, "stripes") && index == 0) {
+			for (uint32_t i=0; i<vg->pvCount; i++) {
+				if (streq(vg->pvs[i].name, p->token))
+					p->segPv = i;
+			}
+		} else if (streq(key, "stripes") && index == 1) {
+			p->segPvExtent = n;
+		}
+	}
+}
+
+/**
+ * \brief Parse volume group metadata text.
+ *
+ * The text is a tree of `name { ... }` sections with `key = value` settings,
+ * where a value is a number, a string or a list of those in brackets.
+ *
+ * \return whether the text was well-formed and describes a volume group
+ */
+static bool lvmParse(LvmVg *vg, uint32_t text, uint32_t length) {
+	LvmParser p;
+	memset(&p, 0, sizeof(p));
+	p.text   = (const char*)text;
+	p.length = length;
+	p.vg     = vg;
+
+	LvmSection sections[LVM_MAX_DEPTH];
+	uint32_t   depth = 0;
+	sections[0] = LVM_SECTION_ROOT;
+
+	char key[LVM_NAME_LENGTH];
+
+	for (;;) {
+		char token = lvmNextToken(&p);
+
+		if (token == LVM_TOKEN_END)
+			return !depth && vg->name[0] && vg->extentSize;
+
+		if (token == '}') {
+			if (!depth)
+				return false;
+			lvmCloseSection(&p, sections[depth--]);
+			continue;
+		}
+
+		if (token != LVM_TOKEN_WORD)
+			return false;
+
+		strncpy(key, p.token, sizeof(key) - 1);
+		key[sizeof(key) - 1] = '\0';
+
+		token = lvmNextToken(&p);
+
+		if (token == '{') {
+			if (depth + 1 == LVM_MAX_DEPTH)
+				return false;
+			sections[depth + 1] = lvmOpenSection(&p, sections[depth], key);
+			depth++;
+
+		} else if (token == '=') {
+			token = lvmNextToken(&p);
+			if (token == '[') {
+				for (uint32_t i=0; (token = lvmNextToken(&p)) != ']'; ) {
+					if (token == LVM_TOKEN_END)
+						return false;
+					if (token != ',')
+						lvmSetValue(&p, sections[depth], key, i++);
+				}
+			} else if (token == LVM_TOKEN_WORD || token == LVM_TOKEN_STRING) {
+				lvmSetValue(&p, sections[depth], key, 0);
+			} else {
+				return false;
+			}
+
+		} else {
+			return false;
+		}
+	}
+}
+
+/**
+ * \brief Read and parse the current metadata in a metadata area.
+ *
+ * \return whether a volume group was parsed into scratchVg
+ */
+static bool lvmReadMetadata(Partition *part, uint32_t mdaOffset) {
+	const LvmMdaHeader *header = (const LvmMdaHeader*)lvmReadBytes(part, 0, mdaOffset, LVM_MDA_HEADER_SIZE);
+	if (!header)
+		return false;
+
+	if (
+		   !strneq(header->magic, LVM_MDA_MAGIC, 16)
+		|| header->version != 1
+		|| header->start   != mdaOffset
+		|| lvmCrc(LVM_INITIAL_CRC, (uint32_t)header->magic, LVM_MDA_HEADER_SIZE - 4) != header->checksum
+	)
+		return false;
+
+	const LvmRawLocation *location = &header->locations[0];
+	if (!location->offset || location->flags & LVM_RAW_LOCATION_IGNORED)
+		return false;
+
+	if (location->size > LVM_MAX_METADATA_SIZE || location->offset >= header->size) {
+		printf("warning: lvm: metadata on hd%u:%u is too large\n", part->disk->diskNo, part->partitionNo);
+		return false;
+	}
+
+	uint32_t offset   = location->offset;
+	uint32_t size     = location->size;
+	uint32_t checksum = location->checksum;
+
+	// The text may wrap around to the start of the ring buffer.
+	uint32_t first = MIN(size, (uint32_t)header->size - offset);
+
+	uint32_t text = lvmReadBytes(part, 0, mdaOffset + offset, first);
+	if (!text)
+		return false;
+
+	if (first < size) {
+		// Read the rest into the second half of the buffer, and join the parts.
+		if (text + size > (uint32_t)buffer + LVM_BUFFER_SIZE / 2)
+			return false;
+
+		uint32_t rest = lvmReadBytes(
+			part, LVM_BUFFER_SIZE / 2,
+			mdaOffset + LVM_MDA_HEADER_SIZE,
+			size - first
+		);
+		if (!rest)
+			return false;
+		farcpy(text + first, rest, size - first);
+	}
+
+	if (lvmCrc(LVM_INITIAL_CRC, text, size) != checksum)
+		return false;
+
+	if (!scratchVg && !(scratchVg = heapAlloc(sizeof(LvmVg))))
+		return false;
+	farzero((uint32_t)scratchVg, sizeof(LvmVg));
+
+	return lvmParse(scratchVg, text, size);
+}
+
+/**
+ * \brief Keep a parsed volume group, unless we already have newer metadata for it.
+ */
+static void lvmAddVg(void) {
+	for (uint32_t i=0; i<vgCount; i++) {
+		if (!lvmIdEq(vgs[i]->uuid, scratchVg->uuid))
+			continue;
+
+		if (!vgs[i]->assembled && scratchVg->seqno > vgs[i]->seqno) {
+			LvmVg *old = vgs[i];
+			vgs[i]    = scratchVg;
+			scratchVg = old;
+		}
+		return;
+	}
+
+	if (vgCount == LVM_MAX_VGS) {
+		printf("warning: lvm: too many volume groups, ignoring %s\n", scratchVg->name);
+		return;
+	}
+
+	vgs[vgCount++] = scratchVg;
+	scratchVg      = NULL;
+}
+
+bool lvmProbe(Partition *part) {
+	uint32_t bs = part->disk->blockSize;
+
+	if (!buffer && !(buffer = heapAlloc(LVM_BUFFER_SIZE)))
+		return false;
+
+	uint32_t labelArea = lvmReadBytes(part, 0, 0, LVM_LABEL_SECTORS * LVM_SECTOR_SIZE);
+	if (!labelArea)
+		return false;
+
+	const LvmLabelHeader *label = NULL;
+	for (uint32_t i=0; i<LVM_LABEL_SECTORS && !label; i++) {
+		label = (const LvmLabelHeader*)(labelArea + i * LVM_SECTOR_SIZE);
+		if (
+			   !strneq(label->id, "LABELONE", 8)
+			|| !strneq(label->type, "LVM2 001", 8)
+			|| label->sector != i
+			|| label->offset > LVM_SECTOR_SIZE - sizeof(LvmPvHeader) - 2 * sizeof(LvmDiskLocation)
+			|| lvmCrc(LVM_INITIAL_CRC, (uint32_t)&label->offset, LVM_SECTOR_SIZE - 20) != label->crc
+		)
+			label = NULL;
+	}
+	if (!label)
+		return false;
+
+	const LvmPvHeader *pvHeader = (const LvmPvHeader*)((uint32_t)label + label->offset);
+
+	if (!foundPvs && !(foundPvs = heapAlloc(LVM_MAX_FOUND_PVS * sizeof(LvmFoundPv))))
+		return true;
+
+	if (foundPvCount < LVM_MAX_FOUND_PVS) {
+		farcpy((uint32_t)foundPvs[foundPvCount].uuid, (uint32_t)pvHeader->uuid, LVM_ID_LENGTH);
+		foundPvs[foundPvCount++].part = part;
+	}
+
+	// Skip the data areas to find the metadata areas. The buffer is reused
+	// for metadata, so remember where they are first. A second metadata area
+	// at the end of a PV beyond 4GiB is not used.
+	uint32_t mdas[2] = { 0, 0 };
+	uint32_t end     = (uint32_t)label + LVM_SECTOR_SIZE;
+
+	const LvmDiskLocation *area = pvHeader->areas;
+	for (; (uint32_t)(area + 1) <= end && area->offset; area++)
+		;
+	area++;
+	for (uint32_t i=0; i<2 && (uint32_t)(area + 1) <= end && area->offset; i++, area++)
+		mdas[i] = area->offset >> 32 ? 0 : area->offset;
+
+	for (uint32_t i=0; i<2 && mdas[i]; i++) {
+		if (mdas[i] & (bs - 1))
+			continue;
+		if (lvmReadMetadata(part, mdas[i])) {
+			lvmAddVg();
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * \brief Look up the partitions of a volume group's PVs.
+ *
+ * \return the amount of PVs that have not been found
+ */
+static uint32_t lvmFindPvs(LvmVg *vg) {
+	uint32_t missing = 0;
+
+	for (uint32_t i=0; i<vg->pvCount; i++) {
+		LvmPv *pv = &vg->pvs[i];
+		for (uint32_t j=0; j<foundPvCount && !pv->part; j++) {
+			if (lvmIdEq(foundPvs[j].uuid, pv->uuid))
+				pv->part = foundPvs[j].part;
+		}
+		if (!pv->part)
+			missing++;
+	}
+
+	return missing;
+}
+
+bool lvmPending(void) {
+	for (uint32_t i=0; i<vgCount; i++) {
+		if (!vgs[i]->assembled && lvmFindPvs(vgs[i]))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * \brief Convert a volume group's sectors to blocks, and drop LVs that cannot
+ *        be read, because their PVs are missing or they lie beyond 2^32 blocks.
+ *
+ * \param vg
+ * \param[out] blockSize
+ *
+ * \return false if the PVs disagree on their block size, or extents do not
+ *         line up with blocks
+ */
+static bool lvmMapBlocks(LvmVg *vg, uint16_t *blockSize) {
+	*blockSize = 0;
+	for (uint32_t i=0; i<vg->pvCount; i++) {
+		Partition *part = vg->pvs[i].part;
+		if (!part)
+			continue;
+		if (*blockSize && *blockSize != part->disk->blockSize)
+			return false;
+		*blockSize = part->disk->blockSize;
+	}
+	if (!*blockSize)
+		return false;
+
+	uint8_t shift = 0;
+	for (; (LVM_SECTOR_SIZE << shift) < *blockSize; shift++)
+		;
+
+	for (vg->extentShift=shift; (1u << vg->extentShift) < vg->extentSize; vg->extentShift++)
+		;
+	if ((1u << vg->extentShift) != vg->extentSize)
+		return false;
+	vg->extentShift -= shift;
+
+	for (uint32_t i=0; i<vg->pvCount; i++) {
+		if (vg->pvs[i].peStart & ((1 << shift) - 1))
+			return false;
+		vg->pvs[i].peStart >>= shift;
+	}
+
+	// Keep the volume group disk below 2^32 blocks.
+	uint32_t maxExtents = 0xffffffff >> vg->extentShift;
+	vg->extentCount = MIN(vg->extentCount, maxExtents);
+
+	for (uint32_t i=0; i<vg->lvCount; i++) {
+		LvmLv   *lv  = &vg->lvs[i];
+		uint32_t end = lv->extent + lv->extentCount;
+		bool     ok  = end <= maxExtents;
+
+		for (uint32_t j=0; j<vg->runCount && ok; j++) {
+			LvmRun *run = &vg->runs[j];
+			LvmPv  *pv  = &vg->pvs[run->pv];
+			if (run->extent >= lv->extent && run->extent < end)
+				ok = pv->part
+				  && pv->peStart + ((uint64_t)(run->pvExtent + run->extentCount) << vg->extentShift)
+				     <= pv->part->blockCount;
+		}
+		if (!ok) {
+			printf("warning: lvm: cannot read %s/%s\n", vg->name, lv->name);
+			lv->extentCount = 0;
+		}
+	}
+
+	return true;
+}
+
+void lvmAssemble(void) {
+	for (uint32_t i=0; i<vgCount; i++) {
+		LvmVg *vg = vgs[i];
+		if (vg->assembled)
+			continue;
+
+		vg->assembled = true;
+		lvmFindPvs(vg);
+
+		uint16_t blockSize;
+		Disk *disk = NULL;
+		if (lvmMapBlocks(vg, &blockSize))
+			disk = diskAddVirtual(&lvmDiskDriver, vg, blockSize, vg->extentCount << vg->extentShift);
+		if (!disk) {
+			printf("warning: lvm: cannot use volume group %s\n", vg->name);
+			continue;
+		}
+
+		printf("lvm: volume group %s is hd%u\n", vg->name, disk->diskNo);
+	}
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+int lvmScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
+	if (disk->driver != &lvmDiskDriver)
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+
+	LvmVg *vg = disk->driverData;
+
+	for (uint32_t i=0; i<vg->lvCount; i++) {
+		LvmLv *lv = &vg->lvs[i];
+		if (!lv->extentCount)
+			continue;
+
+		Partition *part = diskAddPartition(disk);
+		if (!part)
+			return DISK_PART_SCAN_ERR_IO;
+
+		part->lbaStart   = lv->extent      << vg->extentShift;
+		part->blockCount = lv->extentCount << vg->extentShift;
+		part->type       = DISK_PART_TYPE_NONE; // The filesystem is detected by its contents.
+
+		printf("lvm: %s/%s is hd%u:%u\n", vg->name, lv->name, disk->diskNo, part->partitionNo);
+	}
+
+	return DISK_PART_SCAN_OK;
+}
+
+#pragma GCC diagnostic pop
+
+static int lvmRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	LvmVg   *vg    = disk->driverData;
+	uint8_t  shift = vg->extentShift;
+	uint32_t block = lba; // Volume group disks are kept below 2^32 blocks.
+
+	for (uint32_t i; blockCount; ) {
+		uint32_t extent = block >> shift;
+
+		// Runs are sorted by extent.
+		for (i=0; i<vg->runCount && vg->runs[i].extent + vg->runs[i].extentCount <= extent; i++)
+			;
+		if (i == vg->runCount || vg->runs[i].extent > extent)
+			return -1; // Not part of any readable LV.
+
+		LvmRun    *run  = &vg->runs[i];
+		LvmPv     *pv   = &vg->pvs[run->pv];
+		Partition *part = pv->part;
+		if (!part)
+			return -1;
+
+		// Runs are merged as they are added, so a run ends where the data
+		// stops being contiguous on the PV.
+		uint32_t offset = block - (run->extent << shift);
+		uint32_t count  = MIN(blockCount, (run->extentCount << shift) - offset);
+
+		if (diskRead(
+				part->disk, dest,
+				part->lbaStart + pv->peStart + ((uint64_t)run->pvExtent << shift) + offset,
+				count
+			))
+			return -1;
+
+		dest       += count * disk->blockSize;
+		block      += count;
+		blockCount -= count;
+	}
+
+	return 0;
+}
+
+const DiskDriver lvmDiskDriver = {
+	"lvm",
+	NULL, // Volume groups are assembled from partitions, not claimed from the BIOS.
+	lvmRead,
+	NULL,
+	0x10000,
+	false,
+};
+
+#endif /* CONFIG_DISK_LVM */
@@ -0,0 +1,68 @@
+/**
+ * \file
+ * \brief     LVM2 volume groups.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Partitions with an LVM2 physical volume label are collected, and the text
+ * metadata of their volume group is parsed into a list of extent runs. Each
+ * volume group becomes a virtual disk on which the visible linear logical
+ * volumes are laid out back to back, as partitions without a partition type.
+ *
+ * Reads on the volume group disk are translated through the extent runs.
+ * Runs that continue each other on the same physical volume are merged, so
+ * that a large read of a contiguous logical volume stays one large read.
+ */
+#ifndef _DISK_LVM_H
+#define _DISK_LVM_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_LVM
+#define CONFIG_DISK_LVM 0
+#endif /* CONFIG_DISK_LVM */
+
+extern const DiskDriver lvmDiskDriver;
+
+/**
+ * \brief Check a partition for a physical volume label, and read the volume
+ *        group metadata on it.
+ *
+ * \param part
+ *
+ * \return whether the partition is a physical volume
+ */
+bool lvmProbe(Partition *part);
+
+/**
+ * \brief Check whether any volume group is still missing physical volumes.
+ *
+ * \return true if a volume group that has not been assembled yet is incomplete
+ */
+bool lvmPending(void);
+
+/**
+ * \brief Turn all volume groups into virtual disks.
+ *
+ * Logical volumes on missing physical volumes are left out.
+ */
+void lvmAssemble(void);
+
+/**
+ * \brief Partition "table" scanner for volume group disks.
+ *
+ * Adds one partition per logical volume.
+ *
+ * \param disk
+ * \param lbaStart
+ * \param blockCount
+ *
+ * \retval DISK_PART_SCAN_OK
+ * \retval DISK_PART_SCAN_ERR_TRY_OTHER the disk is not a volume group
+ * \retval DISK_PART_SCAN_ERR_IO
+ */
+int lvmScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount);
+
+#endif /* _DISK_LVM_H */
@@ -0,0 +1,431 @@
+/**
+ * \file
+ * \brief     Linux md RAID arrays.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "md.h"
+
+#if CONFIG_DISK_MD
+
+#include "heap.h"
+#include "far.h"
+#include "console.h"
+
+#define MD_MAX_ARRAYS  4
+#define MD_MAX_MEMBERS 8
+
+#define MD_MAGIC 0xa92b4efc
+
+/// The superblock and its device role array fit in the first 4K.
+#define MD_SUPERBLOCK_SIZE 4096
+
+/// Superblock locations are in 512-byte sectors, regardless of the disk's block size.
+#define MD_SECTOR_SIZE 512u
+
+#define MD_FEATURE_RECOVERY_OFFSET 0x02 ///< The member is being rebuilt.
+#define MD_FEATURE_RESHAPE_ACTIVE  0x04
+
+/**
+ * \brief The md v1.x superblock, without the device role array that follows it.
+ *
+ * All fields are little-endian, sizes and offsets are in 512-byte sectors.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t majorVersion;
+	uint32_t featureMap;
+	uint32_t _pad0;
+	uint8_t  setUuid[16];
+	char     setName[32];
+	uint64_t ctime;
+	uint32_t level;
+	uint32_t layout;
+	uint64_t size;         ///< Used size of each member, for RAID1.
+	uint32_t chunkSize;
+	uint32_t raidDisks;
+	uint32_t bitmapOffset;
+	uint32_t newLevel;
+	uint64_t reshapePosition;
+	uint32_t deltaDisks;
+	uint32_t newLayout;
+	uint32_t newChunk;
+	uint32_t newOffset;
+	uint64_t dataOffset;
+	uint64_t dataSize;
+	uint64_t superOffset;  ///< Where this superblock is.
+	uint64_t recoveryOffset;
+	uint32_t devNumber;    ///< Index into devRoles.
+	uint32_t cntCorrectedRead;
+	uint8_t  deviceUuid[16];
+	uint8_t  devFlags;
+	uint8_t  bblogShift;
+	uint16_t bblogSize;
+	uint32_t bblogOffset;
+	uint64_t utime;
+	uint64_t events;       ///< Update count, stale members have a lower count.
+	uint64_t resyncOffset;
+	uint32_t checksum;
+	uint32_t maxDev;       ///< Size of devRoles.
+	uint8_t  _pad3[32];
+	uint16_t devRoles[];   ///< Slot in the array per device, higher than raidDisks for spares.
+} __attribute__((packed)) MdSuperblock;
+
+typedef struct {
+	Partition *part;       ///< NULL if the member is missing.
+	uint64_t   dataOffset; ///< In member blocks.
+	uint64_t   nextLba;    ///< Array LBA following the last read, for read balancing.
+	bool       failed;
+} __attribute__((packed)) MdMember;
+
+typedef struct {
+	uint8_t  uuid[16];
+	char     name[33];
+	bool     assembled;
+	uint64_t events;
+	uint32_t level;
+	uint32_t raidDisks;
+	uint32_t memberCount;
+	uint16_t blockSize;
+	uint8_t  chunkShift;   ///< RAID0: log2 of the chunk size in blocks.
+	uint64_t memberBlocks; ///< Usable data blocks on every member.
+	MdMember members[MD_MAX_MEMBERS]; ///< Indexed by role.
+} __attribute__((packed)) MdArray;
+
+static MdArray *arrays[MD_MAX_ARRAYS];
+static uint32_t arrayCount = 0;
+
+/// Superblock read buffer, in the loader heap.
+static uint8_t *superblockBuffer = NULL;
+
+/**
+ * \brief Calculate the checksum of the superblock in the read buffer.
+ *
+ * A 64-bit sum of all 32-bit words with the checksum itself set to zero,
+ * folded to 32 bits.
+ */
+static uint32_t mdChecksum(const MdSuperblock *sb) {
+	uint32_t size  = sizeof(MdSuperblock) + sb->maxDev * 2;
+	uint64_t sum   = 0;
+
+	const uint32_t *words = (const uint32_t*)superblockBuffer;
+	for (uint32_t i=0; i<size/4; i++)
+		sum += words[i];
+	if (size & 2)
+		sum += ((const uint16_t*)superblockBuffer)[size/2 - 1];
+
+	sum -= sb->checksum;
+
+	return (uint32_t)sum + (uint32_t)(sum >> 32);
+}
+
+/**
+ * \brief Find the array with the given UUID, creating it if needed.
+ *
+ * \return an array, or NULL if there are too many arrays or the heap is exhausted
+ */
+static MdArray *mdGetArray(const uint8_t *uuid) {
+	for (uint32_t i=0; i<arrayCount; i++) {
+		uint32_t j = 0;
+		for (; j<16 && arrays[i]->uuid[j] == uuid[j]; j++)
+			;
+		if (j == 16)
+			return arrays[i];
+	}
+
+	if (arrayCount == MD_MAX_ARRAYS)
+		return NULL;
+
+	MdArray *array = heapAlloc(sizeof(MdArray));
+	if (!array)
+		return NULL;
+
+	farcpy((uint32_t)array->uuid, (uint32_t)uuid, 16);
+
+	return arrays[arrayCount++] = array;
+}
+
+/**
+ * \brief Add a partition to the array described by its superblock.
+ *
+ * \param part
+ * \param sb
+ * \param shift log2 of the member block size in sectors
+ */
+static void mdAddMember(Partition *part, const MdSuperblock *sb, uint8_t shift) {
+	if (sb->level > 1 || !sb->raidDisks || sb->raidDisks > MD_MAX_MEMBERS) {
+		printf(
+			"warning: md: unsupported array on hd%u:%u (level %u, %u disks)\n",
+			part->disk->diskNo, part->partitionNo, sb->level, sb->raidDisks
+		);
+		return;
+	}
+
+	if (sb->featureMap & MD_FEATURE_RESHAPE_ACTIVE) {
+		printf("warning: md: array on hd%u:%u is being reshaped\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	uint32_t sectorMask = (1 << shift) - 1;
+	uint32_t chunk      = sb->chunkSize >> shift;
+
+	if (
+		   (uint32_t)(sb->dataOffset | sb->dataSize | sb->size) & sectorMask
+		|| (sb->level == 0 && (!chunk || chunk & (chunk - 1) || sb->chunkSize & sectorMask))
+	) {
+		printf("warning: md: misaligned array on hd%u:%u\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	MdArray *array = mdGetArray(sb->setUuid);
+	if (!array) {
+		printf("warning: md: too many arrays, ignoring hd%u:%u\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	if (array->assembled)
+		return; // Too late, the array runs without this member.
+
+	if (array->memberCount && sb->events < array->events) {
+		printf("warning: md: hd%u:%u is out of date, not using it\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	if (!array->memberCount || sb->events > array->events) {
+		// The first member, or the others are stale. Start over with this superblock.
+		for (uint32_t i=0; i<MD_MAX_MEMBERS; i++)
+			array->members[i].part = NULL;
+
+		array->memberCount  = 0;
+		array->events       = sb->events;
+		array->level        = sb->level;
+		array->raidDisks    = sb->raidDisks;
+		array->blockSize    = part->disk->blockSize;
+		array->memberBlocks = (sb->level ? sb->size : sb->dataSize) >> shift;
+
+		for (array->chunkShift=0; (1u << array->chunkShift) < chunk; array->chunkShift++)
+			;
+
+		farcpy((uint32_t)array->name, (uint32_t)sb->setName, 32);
+	}
+
+	if (sb->devNumber >= sb->maxDev)
+		return;
+
+	uint16_t role = sb->devRoles[sb->devNumber];
+	if (role >= array->raidDisks || sb->featureMap & MD_FEATURE_RECOVERY_OFFSET)
+		return; // A spare, or a member that is not in sync.
+
+	MdMember *member = &array->members[role];
+	if (member->part)
+		return;
+
+	if (part->disk->blockSize != array->blockSize) {
+		printf("warning: md: hd%u:%u has a different block size than its array\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	uint64_t dataBlocks = sb->dataSize >> shift;
+	if ((sb->dataOffset >> shift) + dataBlocks > part->blockCount) {
+		printf("warning: md: data on hd%u:%u runs past the partition\n", part->disk->diskNo, part->partitionNo);
+		return;
+	}
+
+	if (array->level) {
+		// RAID1: every mirror holds the whole array.
+		if (dataBlocks < array->memberBlocks)
+			return;
+	} else {
+		// RAID0: members of different sizes form several zones. Only the
+		// first zone, striped over all members, is supported.
+		array->memberBlocks = MIN(array->memberBlocks, dataBlocks);
+	}
+
+	member->part       = part;
+	member->dataOffset = sb->dataOffset >> shift;
+	member->nextLba    = 0;
+	member->failed     = false;
+	array->memberCount++;
+}
+
+bool mdProbe(Partition *part) {
+	uint32_t bs = part->disk->blockSize;
+
+	uint8_t shift = 0;
+	for (; (MD_SECTOR_SIZE << shift) < bs; shift++)
+		;
+
+	uint64_t sectors = part->blockCount << shift;
+	if (sectors < 2 * MD_SUPERBLOCK_SIZE / MD_SECTOR_SIZE)
+		return false;
+
+	if (!superblockBuffer && !(superblockBuffer = heapAlloc(MD_SUPERBLOCK_SIZE)))
+		return false;
+
+	// Metadata 1.1, 1.2 and 1.0 respectively.
+	uint64_t locations[] = { 0, 8, (sectors - 8*2) & ~(uint64_t)(4*2 - 1) };
+
+	const MdSuperblock *sb = (const MdSuperblock*)superblockBuffer;
+
+	for (uint32_t i=0; i<ELEMS(locations); i++) {
+		if (diskRead(
+				part->disk,
+				(uint32_t)superblockBuffer,
+				part->lbaStart + (locations[i] >> shift),
+				MAX(1u, MD_SUPERBLOCK_SIZE / bs)
+			))
+			return false;
+
+		if (
+			   sb->magic        != MD_MAGIC
+			|| sb->majorVersion != 1
+			|| sb->superOffset  != locations[i]
+		)
+			continue;
+
+		if (sb->maxDev > (MD_SUPERBLOCK_SIZE - sizeof(MdSuperblock)) / 2 || mdChecksum(sb) != sb->checksum) {
+			printf("warning: md: bad superblock on hd%u:%u\n", part->disk->diskNo, part->partitionNo);
+			continue;
+		}
+
+		mdAddMember(part, sb, shift);
+		return true;
+	}
+
+	return false;
+}
+
+bool mdPending(void) {
+	for (uint32_t i=0; i<arrayCount; i++) {
+		if (!arrays[i]->assembled && arrays[i]->memberCount < arrays[i]->raidDisks)
+			return true;
+	}
+	return false;
+}
+
+void mdAssemble(void) {
+	for (uint32_t i=0; i<arrayCount; i++) {
+		MdArray *array = arrays[i];
+		if (array->assembled)
+			continue;
+
+		array->assembled = true;
+
+		if (!array->memberCount || (!array->level && array->memberCount < array->raidDisks)) {
+			printf("warning: md: array %s is missing members\n", array->name);
+			continue;
+		}
+
+		uint64_t blockCount = array->memberBlocks;
+		if (!array->level) {
+			// Keep chunk numbers within 32 bits.
+			blockCount = MIN(blockCount >> array->chunkShift, 0xffffffff / array->raidDisks);
+			blockCount = (blockCount * array->raidDisks) << array->chunkShift;
+		}
+
+		Disk *disk = diskAddVirtual(&mdDiskDriver, array, array->blockSize, blockCount);
+		if (!disk) {
+			printf("warning: md: no room for a disk for array %s\n", array->name);
+			continue;
+		}
+
+		printf(
+			"md: assembled RAID%u array %s from %u of %u members as hd%u\n",
+			array->level, array->name, array->memberCount, array->raidDisks, disk->diskNo
+		);
+	}
+}
+
+/**
+ * \brief Read from a member, relative to the start of its data.
+ */
+static int mdReadMember(MdMember *member, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	Partition *part = member->part;
+
+	return diskRead(part->disk, dest, part->lbaStart + member->dataOffset + lba, blockCount);
+}
+
+/**
+ * \brief Read from the mirror closest to the requested blocks, failing over
+ *        to the other mirrors on errors.
+ */
+static int mdReadRaid1(MdArray *array, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	for (;;) {
+		MdMember *best         = NULL;
+		uint64_t  bestDistance = 0;
+
+		for (uint32_t i=0; i<array->raidDisks; i++) {
+			MdMember *member = &array->members[i];
+			if (!member->part || member->failed)
+				continue;
+
+			uint64_t distance = member->nextLba > lba
+			                  ? member->nextLba - lba
+			                  : lba - member->nextLba;
+
+			if (!best || distance < bestDistance) {
+				best         = member;
+				bestDistance = distance;
+			}
+		}
+
+		if (!best)
+			return -1;
+
+		if (!mdReadMember(best, dest, lba, blockCount)) {
+			best->nextLba = lba + blockCount;
+			return 0;
+		}
+
+		printf(
+			"warning: md: read failed on hd%u:%u, removing it from array %s\n",
+			best->part->disk->diskNo, best->part->partitionNo, array->name
+		);
+		best->failed = true;
+	}
+}
+
+/**
+ * \brief Read from a striped array, one chunk at a time.
+ */
+static int mdReadRaid0(MdArray *array, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	uint32_t chunkBlocks = 1 << array->chunkShift;
+
+	while (blockCount) {
+		uint32_t chunkNo = lba >> array->chunkShift;
+		uint32_t offset  = (uint32_t)lba & (chunkBlocks - 1);
+		uint32_t count   = MIN(blockCount, chunkBlocks - offset);
+
+		MdMember *member   = &array->members[chunkNo % array->raidDisks];
+		uint64_t memberLba = ((uint64_t)(chunkNo / array->raidDisks) << array->chunkShift) + offset;
+
+		if (mdReadMember(member, dest, memberLba, count))
+			return -1;
+
+		dest       += count * array->blockSize;
+		lba        += count;
+		blockCount -= count;
+	}
+
+	return 0;
+}
+
+static int mdRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	MdArray *array = disk->driverData;
+
+	return array->level
+		? mdReadRaid1(array, dest, lba, blockCount)
+		: mdReadRaid0(array, dest, lba, blockCount);
+}
+
+const DiskDriver mdDiskDriver = {
+	"md",
+	NULL, // Arrays are assembled from partitions, not claimed from the BIOS.
+	mdRead,
+	NULL,
+	0x10000,
+	false,
+};
+
+#endif /* CONFIG_DISK_MD */
@@ -0,0 +1,56 @@
+/**
+ * \file
+ * \brief     Linux md RAID arrays.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Partitions with an md v1.x superblock (metadata 1.0, 1.1 or 1.2) are
+ * collected into arrays. RAID0 and RAID1 arrays are assembled into virtual
+ * disks, whose partitions and filesystems are then detected like those of any
+ * other disk.
+ *
+ * RAID1 reads go to the mirror whose last read ended closest to the requested
+ * block, so that sequential streams stay on one member while independent
+ * streams spread over the mirrors. A member that fails a read is taken out of
+ * the array, and the read is retried on the next mirror.
+ */
+#ifndef _DISK_MD_H
+#define _DISK_MD_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_MD
+#define CONFIG_DISK_MD 0
+#endif /* CONFIG_DISK_MD */
+
+extern const DiskDriver mdDiskDriver;
+
+/**
+ * \brief Check a partition for an md superblock, and add it to its array.
+ *
+ * \param part
+ *
+ * \return whether the partition is an array member, in which case any
+ *         filesystem on it belongs to the array
+ */
+bool mdProbe(Partition *part);
+
+/**
+ * \brief Check whether any array is still missing members.
+ *
+ * \return true if an array that has not been assembled yet is incomplete
+ */
+bool mdPending(void);
+
+/**
+ * \brief Assemble all usable arrays into virtual disks.
+ *
+ * Complete arrays are assembled, as are RAID1 arrays with at least one
+ * member. Call this once mdPending() returns false, or once all disks have
+ * been scanned.
+ */
+void mdAssemble(void);
+
+#endif /* _DISK_MD_H */
@@ -0,0 +1,476 @@
+/**
+ * \file
+ * \brief     Native NVMe disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "nvme.h"
+
+#if CONFIG_DISK_NVME
+
+#include "pci.h"
+#include "bda.h"
+#include "heap.h"
+#include "far.h"
+#include "console.h"
+
+#define NVME_MAX_CONTROLLERS 2
+#define NVME_MAX_NAMESPACES  8
+
+#define NVME_PAGE_SIZE 4096
+
+/// Commands queued per read call, each with its own PRP list.
+#define NVME_MAX_QUEUED 4
+/// I/O queue entries, one more than we queue so the queue never looks empty when full.
+#define NVME_IO_QUEUE_SIZE (NVME_MAX_QUEUED + 1)
+/// Bytes per command with a single PRP list page (the first page is PRP1).
+#define NVME_MAX_COMMAND_BYTES ((NVME_PAGE_SIZE / 8) * NVME_PAGE_SIZE)
+
+/// Command timeout in PIT ticks (~5 seconds).
+#define NVME_TIMEOUT_TICKS 91
+
+// Controller registers (dword indices).
+#define NVME_REG_CAP   0
+#define NVME_REG_CAPHI 1
+#define NVME_REG_CC    5
+#define NVME_REG_CSTS  7
+#define NVME_REG_AQA   9
+#define NVME_REG_ASQ   10
+#define NVME_REG_ASQHI 11
+#define NVME_REG_ACQ   12
+#define NVME_REG_ACQHI 13
+
+#define NVME_CC_EN      (1U <<  0)
+#define NVME_CC_IOSQES  (6U << 16) ///< 64 byte submission entries.
+#define NVME_CC_IOCQES  (4U << 20) ///< 16 byte completion entries.
+#define NVME_CSTS_RDY   (1U <<  0)
+#define NVME_CSTS_CFS   (1U <<  1)
+
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+#define NVME_IO_READ         0x02
+
+/**
+ * \brief Submission queue entry.
+ */
+typedef struct {
+	uint32_t opcode; ///< Opcode in bits 0-7, command ID in bits 16-31.
+	uint32_t nsId;
+	uint32_t _reserved[2];
+	uint64_t metadata;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw[6]; ///< Command dwords 10-15.
+} __attribute__((packed)) NvmeCommand;
+
+/**
+ * \brief Completion queue entry.
+ */
+typedef struct {
+	uint32_t result;
+	uint32_t _reserved;
+	uint16_t sqHead;
+	uint16_t sqId;
+	uint16_t commandId;
+	uint16_t status; ///< Phase tag in bit 0.
+} __attribute__((packed)) NvmeCompletion;
+
+typedef struct {
+	NvmeCommand    *sq;
+	volatile NvmeCompletion *cq;
+	uint16_t id;
+	uint16_t size;
+	uint16_t sqTail;
+	uint16_t cqHead;
+	uint16_t phase;
+} NvmeQueue;
+
+typedef struct {
+	volatile uint32_t *regs;
+	uint32_t pciAddress;
+	uint32_t doorbellStride; ///< In dwords.
+	uint32_t maxCommandBytes;
+	uint32_t namespaceCount;
+	NvmeQueue admin;
+	NvmeQueue io;
+	uint64_t *prpLists; ///< One page for each queued command.
+	uint8_t  *identify; ///< One page for identify data.
+} NvmeController;
+
+typedef struct {
+	NvmeController *ctrl;
+	uint32_t id;
+	uint64_t blockCount;
+	uint32_t blockSize;
+} NvmeNamespace;
+
+static NvmeController controllers[NVME_MAX_CONTROLLERS];
+static uint32_t       controllerCount = 0;
+
+static NvmeNamespace namespaces[NVME_MAX_NAMESPACES];
+static uint32_t      namespaceCount = 0;
+
+/**
+ * \brief Allocate zeroed, page-aligned memory from the loader heap.
+ */
+static void *nvmeAllocPages(uint32_t pages) {
+	uint32_t mem = (uint32_t)heapAlloc((pages + 1) * NVME_PAGE_SIZE);
+	if (!mem)
+		return NULL;
+	return (void*)((mem + NVME_PAGE_SIZE - 1) & ~(NVME_PAGE_SIZE - 1));
+}
+
+static volatile uint32_t *nvmeDoorbell(NvmeController *ctrl, uint16_t queueId, bool completion) {
+	return &ctrl->regs[0x1000 / 4 + (2 * queueId + completion) * ctrl->doorbellStride];
+}
+
+/**
+ * \brief Append a command to a submission queue, without ringing its doorbell.
+ *
+ * \return the new entry, with only the opcode and command ID filled in
+ */
+static NvmeCommand *nvmeQueueCommand(NvmeQueue *queue, uint8_t opcode) {
+	NvmeCommand *cmd = &queue->sq[queue->sqTail];
+
+	farzero((uint32_t)cmd, sizeof(NvmeCommand));
+	cmd->opcode = opcode | (uint32_t)queue->sqTail << 16;
+
+	queue->sqTail = (queue->sqTail + 1) % queue->size;
+
+	return cmd;
+}
+
+/**
+ * \brief Ring a queue's doorbell and wait for `count` completions.
+ *
+ * \return zero on success, non-zero on timeout or command failure
+ */
+static int nvmeRun(NvmeController *ctrl, NvmeQueue *queue, uint32_t count) {
+	int ret = 0;
+
+	asm volatile ("" ::: "memory"); // Commands must be in memory before the doorbell rings.
+	*nvmeDoorbell(ctrl, queue->id, false) = queue->sqTail;
+
+	uint32_t start = bda->timerTicks;
+
+	while (count) {
+		volatile NvmeCompletion *entry = &queue->cq[queue->cqHead];
+
+		if ((entry->status & 1) != queue->phase) {
+			if (bda->timerTicks - start >= NVME_TIMEOUT_TICKS)
+				return -1;
+			continue;
+		}
+
+		if (entry->status >> 1)
+			ret = -1;
+
+		if (++queue->cqHead == queue->size) {
+			queue->cqHead = 0;
+			queue->phase ^= 1;
+		}
+		count--;
+	}
+
+	*nvmeDoorbell(ctrl, queue->id, true) = queue->cqHead;
+
+	return ret;
+}
+
+/**
+ * \brief Fill in a command's data pointers for a contiguous destination.
+ */
+static void nvmeSetPrps(NvmeCommand *cmd, uint64_t *prpList, uint32_t dest, uint32_t bytes) {
+	uint32_t firstBytes = NVME_PAGE_SIZE - (dest & (NVME_PAGE_SIZE - 1));
+
+	cmd->prp1 = dest;
+
+	if (bytes <= firstBytes)
+		return;
+
+	uint32_t page = (dest & ~(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE;
+
+	if (bytes - firstBytes <= NVME_PAGE_SIZE) {
+		cmd->prp2 = page;
+		return;
+	}
+
+	cmd->prp2 = (uint32_t)prpList;
+	for (uint32_t i=0; i * NVME_PAGE_SIZE < bytes - firstBytes; i++)
+		prpList[i] = page + i * NVME_PAGE_SIZE;
+}
+
+static int nvmeIdentify(NvmeController *ctrl, uint32_t cns, uint32_t nsId) {
+	NvmeCommand *cmd = nvmeQueueCommand(&ctrl->admin, NVME_ADMIN_IDENTIFY);
+	cmd->nsId   = nsId;
+	cmd->prp1   = (uint32_t)ctrl->identify;
+	cmd->cdw[0] = cns;
+
+	return nvmeRun(ctrl, &ctrl->admin, 1);
+}
+
+/**
+ * \brief Reset a controller and set up our admin and I/O queues.
+ *
+ * \return zero on success, non-zero on error
+ */
+static int nvmeReset(NvmeController *ctrl) {
+	uint8_t *mem = nvmeAllocPages(5 + NVME_MAX_QUEUED);
+	if (!mem)
+		return -1;
+
+	ctrl->admin.sq  = (NvmeCommand*)   (mem + 0 * NVME_PAGE_SIZE);
+	ctrl->admin.cq  = (NvmeCompletion*)(mem + 1 * NVME_PAGE_SIZE);
+	ctrl->io.sq     = (NvmeCommand*)   (mem + 2 * NVME_PAGE_SIZE);
+	ctrl->io.cq     = (NvmeCompletion*)(mem + 3 * NVME_PAGE_SIZE);
+	ctrl->identify  =                   mem + 4 * NVME_PAGE_SIZE;
+	ctrl->prpLists  = (uint64_t*)      (mem + 5 * NVME_PAGE_SIZE);
+
+	ctrl->admin.id   = 0;
+	ctrl->admin.size = 2;
+	ctrl->admin.phase = 1;
+	ctrl->io.id      = 1;
+	ctrl->io.size    = NVME_IO_QUEUE_SIZE;
+	ctrl->io.phase   = 1;
+
+	volatile uint32_t *regs = ctrl->regs;
+
+	ctrl->doorbellStride = 1U << (regs[NVME_REG_CAPHI] & 0xf);
+
+	// CAP.TO is in units of 500 ms.
+	uint32_t timeout = ((regs[NVME_REG_CAP] >> 24) & 0xff) * 500 / 55 + 2;
+	uint32_t start;
+
+	regs[NVME_REG_CC] &= ~NVME_CC_EN;
+	for (start = bda->timerTicks; regs[NVME_REG_CSTS] & NVME_CSTS_RDY; )
+		if (bda->timerTicks - start >= timeout)
+			return -1;
+
+	regs[NVME_REG_AQA]   = (uint32_t)(ctrl->admin.size - 1) << 16 | (ctrl->admin.size - 1);
+	regs[NVME_REG_ASQ]   = (uint32_t)ctrl->admin.sq;
+	regs[NVME_REG_ASQHI] = 0;
+	regs[NVME_REG_ACQ]   = (uint32_t)ctrl->admin.cq;
+	regs[NVME_REG_ACQHI] = 0;
+	regs[NVME_REG_CC]    = NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN;
+
+	for (start = bda->timerTicks; !(regs[NVME_REG_CSTS] & NVME_CSTS_RDY); )
+		if (regs[NVME_REG_CSTS] & NVME_CSTS_CFS || bda->timerTicks - start >= timeout)
+			return -1;
+
+	if (nvmeIdentify(ctrl, 1, 0))
+		return -1;
+
+	// MDTS is a power of two in units of the minimum page size, 0 means no limit.
+	uint8_t  mdts       = ctrl->identify[77];
+	uint32_t minPageLog = 12 + ((regs[NVME_REG_CAPHI] >> 16) & 0xf);
+
+	ctrl->maxCommandBytes = NVME_MAX_COMMAND_BYTES;
+	if (mdts && mdts + minPageLog < 32)
+		ctrl->maxCommandBytes = MIN(ctrl->maxCommandBytes, 1U << (mdts + minPageLog));
+
+	ctrl->namespaceCount = *(uint32_t*)(ctrl->identify + 516);
+
+	NvmeCommand *cmd = nvmeQueueCommand(&ctrl->admin, NVME_ADMIN_CREATE_CQ);
+	cmd->prp1   = (uint32_t)ctrl->io.cq;
+	cmd->cdw[0] = (uint32_t)(ctrl->io.size - 1) << 16 | ctrl->io.id;
+	cmd->cdw[1] = 1; // Physically contiguous, no interrupts.
+	if (nvmeRun(ctrl, &ctrl->admin, 1))
+		return -1;
+
+	cmd = nvmeQueueCommand(&ctrl->admin, NVME_ADMIN_CREATE_SQ);
+	cmd->prp1   = (uint32_t)ctrl->io.sq;
+	cmd->cdw[0] = (uint32_t)(ctrl->io.size - 1) << 16 | ctrl->io.id;
+	cmd->cdw[1] = (uint32_t)ctrl->io.id << 16 | 1;
+
+	return nvmeRun(ctrl, &ctrl->admin, 1);
+}
+
+/**
+ * \brief Find the controller at a PCI address, resetting it on first use.
+ *
+ * \return a controller, or NULL if there is no usable NVMe controller there
+ */
+static NvmeController *nvmeGetController(uint32_t pciAddress) {
+	for (uint32_t i=0; i<controllerCount; i++) {
+		if (controllers[i].pciAddress == pciAddress)
+			return controllers[i].regs ? &controllers[i] : NULL;
+	}
+
+	if (controllerCount == NVME_MAX_CONTROLLERS)
+		return NULL;
+
+	NvmeController *ctrl = &controllers[controllerCount++];
+	memset(ctrl, 0, sizeof(NvmeController));
+	ctrl->pciAddress = pciAddress;
+
+	uint32_t bar = pciGetBar(pciAddress, 0);
+	if (!bar || bar & 1)
+		return NULL;
+
+	pciEnable(pciAddress, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+	ctrl->regs = (uint32_t*)bar;
+
+	// Whether or not the reset succeeds, the option ROM's queues are gone.
+	diskBiosLost(pciAddress);
+
+	if (nvmeReset(ctrl)) {
+		printf("warning: Could not initialize NVMe controller %02x:%02x.%x\n",
+		       PCI_ADDRESS_BUS(pciAddress),
+		       PCI_ADDRESS_DEVICE(pciAddress),
+		       PCI_ADDRESS_FUNCTION(pciAddress));
+		ctrl->regs = NULL;
+		return NULL;
+	}
+
+	return ctrl;
+}
+
+/**
+ * \brief Find an unclaimed namespace with the given geometry.
+ */
+static NvmeNamespace *nvmeFindNamespace(NvmeController *ctrl, uint64_t blockCount, uint32_t blockSize) {
+	if (namespaceCount == NVME_MAX_NAMESPACES)
+		return NULL;
+
+	for (uint32_t id=1; id<=ctrl->namespaceCount; id++) {
+		bool claimed = false;
+		for (uint32_t i=0; i<namespaceCount; i++)
+			claimed |= namespaces[i].ctrl == ctrl && namespaces[i].id == id;
+		if (claimed || nvmeIdentify(ctrl, 0, id))
+			continue;
+
+		uint8_t *data = ctrl->identify;
+
+		// The LBA format in use is selected by FLBAS, LBADS is its block size shift.
+		uint8_t lbaFormat = data[26] & 0xf;
+		uint8_t lbads     = data[128 + lbaFormat * 4 + 2];
+
+		if (*(uint64_t*)data != blockCount || lbads >= 32 || (1U << lbads) != blockSize)
+			continue;
+
+		NvmeNamespace *ns = &namespaces[namespaceCount];
+		ns->ctrl       = ctrl;
+		ns->id         = id;
+		ns->blockCount = blockCount;
+		ns->blockSize  = blockSize;
+
+		return ns;
+	}
+
+	return NULL;
+}
+
+static int nvmeRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	NvmeNamespace  *ns   = disk->driverData;
+	NvmeController *ctrl = ns->ctrl;
+
+	if (lba + blockCount > ns->blockCount)
+		return -1;
+
+	if (dest & 3) {
+		// PRPs must be dword-aligned, and there is no BIOS to leave this to.
+		while (blockCount) {
+			uint32_t count = MIN(blockCount, DISK_BOUNCE_BUFFER_SIZE / ns->blockSize);
+			if (nvmeRead(disk, DISK_BOUNCE_BUFFER_ADDR, lba, count))
+				return -1;
+			farcpy(dest, DISK_BOUNCE_BUFFER_ADDR, count * ns->blockSize);
+
+			dest       += count * ns->blockSize;
+			lba        += count;
+			blockCount -= count;
+		}
+		return 0;
+	}
+
+	uint32_t maxBlocks = ctrl->maxCommandBytes / ns->blockSize;
+
+	// Queue as many commands as we have PRP lists for, then wait for all of them.
+	while (blockCount) {
+		uint32_t queued = 0;
+		for (; queued < NVME_MAX_QUEUED && blockCount; queued++) {
+			uint32_t count = MIN(blockCount, maxBlocks);
+
+			NvmeCommand *cmd = nvmeQueueCommand(&ctrl->io, NVME_IO_READ);
+			cmd->nsId   = ns->id;
+			cmd->cdw[0] = lba;
+			cmd->cdw[1] = lba >> 32;
+			cmd->cdw[2] = count - 1;
+			nvmeSetPrps(
+				cmd,
+				ctrl->prpLists + queued * (NVME_PAGE_SIZE / 8),
+				dest,
+				count * ns->blockSize
+			);
+
+			dest       += count * ns->blockSize;
+			lba        += count;
+			blockCount -= count;
+		}
+		if (nvmeRun(ctrl, &ctrl->io, queued))
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool nvmeClaim(Disk *disk) {
+	if (disk->pciAddress == PCI_ADDRESS_NONE)
+		return false;
+
+	// The option ROM stops working once we reset the controller, so read the
+	// reference block through int13h first, if it is still available.
+	uint8_t *biosBuffer   = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_BIOS);
+	uint8_t *nativeBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_NATIVE);
+
+	bool haveReference = false;
+	bool knownController = false;
+	for (uint32_t i=0; i<controllerCount; i++)
+		knownController |= controllers[i].pciAddress == disk->pciAddress;
+
+	if (!knownController) {
+		if ((pciRead(disk->pciAddress, PCI_REG_CLASS) >> 8) != 0x010802)
+			return false; // Not an NVMe controller.
+		haveReference = !diskRead(disk, (uint32_t)biosBuffer, 0, 1);
+	}
+
+	NvmeController *ctrl = nvmeGetController(disk->pciAddress);
+	if (!ctrl)
+		return false;
+
+	NvmeNamespace *ns = nvmeFindNamespace(ctrl, disk->blockCount, disk->blockSize);
+	if (!ns) {
+		printf("warning: No NVMe namespace matches disk %02xh\n", disk->biosId);
+		return false;
+	}
+
+	disk->driver     = &nvmeDiskDriver;
+	disk->driverData = ns;
+
+	if (
+		   nvmeRead(disk, (uint32_t)nativeBuffer, 0, 1)
+		|| (haveReference && !memeq(biosBuffer, nativeBuffer, disk->blockSize))
+	) {
+		printf("warning: NVMe namespace %u does not match disk %02xh\n", ns->id, disk->biosId);
+		disk->driver     = NULL;
+		disk->driverData = NULL;
+		return false;
+	}
+
+	namespaceCount++;
+
+	return true;
+}
+
+const DiskDriver nvmeDiskDriver = {
+	"nvme",
+	nvmeClaim,
+	nvmeRead,
+	NULL, // The option ROM's queues are gone, there is no way back.
+	NVME_MAX_QUEUED * NVME_MAX_COMMAND_BYTES / 512,
+	true,
+};
+
+#endif /* CONFIG_DISK_NVME */
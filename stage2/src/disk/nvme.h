@@ -0,0 +1,25 @@
+/**
+ * \file
+ * \brief     Native NVMe disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * A polled driver with one admin queue and one I/O queue per controller.
+ * Disks are matched to their controller through the EDD device path, since
+ * the controller must be reset to take it over: its option ROM cannot be used
+ * afterwards, so there is no falling back to int13h for these disks.
+ */
+#ifndef _DISK_NVME_H
+#define _DISK_NVME_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_NVME
+#define CONFIG_DISK_NVME 0
+#endif /* CONFIG_DISK_NVME */
+
+extern const DiskDriver nvmeDiskDriver;
+
+#endif /* _DISK_NVME_H */
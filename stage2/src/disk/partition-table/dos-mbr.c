@@ -8,6 +8,9 @@
 #include "dos-mbr.h"
 #include "console.h"
 
+/// Guards against circular EBR chains.
+#define DOS_MBR_MAX_EBRS 256
+
 /**
  * \brief A Partition Table Entry in an MBR partition table.
  */
@@ -42,8 +45,8 @@ typedef struct {
 
 
 int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
-	uint8_t mbrBuffer[DISK_MAX_BLOCK_SIZE];
-	memset(mbrBuffer, 0, DISK_MAX_BLOCK_SIZE);
+	uint8_t *mbrBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_TABLE);
+	memset(mbrBuffer, 0, disk->blockSize);
 
 	if (diskRead(disk, (uint32_t)mbrBuffer, lbaStart, 1))
 		return DISK_PART_SCAN_ERR_IO;
@@ -56,7 +59,7 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 		const DosMbr *mbr = (DosMbr*)mbrBuffer;
 		const MbrPartitionTable *table = &mbr->partitionTable;
 
-		for (int i=0; i<4 && disk->partitionCount < DISK_MAX_PARTITIONS_PER_DISK; i++) {
+		for (int i=0; i<4; i++) {
 			const MbrPartitionTableEntry *pte = &table->entries[i];
 
 			if (pte->lbaStart && pte->blockCount) {
@@ -67,10 +70,15 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 					uint64_t extSize    = pte->blockCount; ///< Extended partition size.
 					uint64_t nextEbr    = extStart;        ///< Start of the next EBR.
 
-					uint8_t ebrBuffer[DISK_MAX_BLOCK_SIZE];
-					memset(ebrBuffer, 0, DISK_MAX_BLOCK_SIZE);
+					uint8_t *ebrBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_TABLE_EXTRA);
+					memset(ebrBuffer, 0, disk->blockSize);
+
+					for (uint32_t ebrCount=0;; ebrCount++) {
+						if (ebrCount == DOS_MBR_MAX_EBRS) {
+							printf("warning: EBR chain too long, is it circular?\n");
+							goto invalidPartitionLayout;
+						}
 
-					for (; disk->partitionCount<DISK_MAX_PARTITIONS_PER_DISK;) {
 						if (nextEbr > MIN(extStart + extSize, blockCount)) {
 							printf(
 								"warning: EBR out of range (%#08x > MIN(%#08x, %#08x))\n",
@@ -81,7 +89,6 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 
 						if (diskRead(disk, (uint32_t)ebrBuffer, nextEbr, 1)) {
 							disk->partitionCount = 0;
-							memset(disk->partitions, 0, sizeof(disk->partitions));
 							return DISK_PART_SCAN_ERR_IO;
 						}
 						DosMbr *ebr = (DosMbr*)ebrBuffer;
@@ -93,9 +100,9 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 						MbrPartitionTableEntry *ebrPte = &ebr->partitionTable.entries[1];
 
 						if (logPte->lbaStart && logPte->blockCount) {
-							Partition *partition   = &disk->partitions[disk->partitionCount];
-							partition->disk        = disk;
-							partition->partitionNo = disk->partitionCount++;
+							Partition *partition = diskAddPartition(disk);
+							if (!partition)
+								goto outOfMemory;
 							partition->lbaStart    = nextEbr + logPte->lbaStart;
 							partition->blockCount  = logPte->blockCount;
 							partition->type        = logPte->systemId;
@@ -111,14 +118,13 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 						nextEbr    = extStart + ebrPte->lbaStart;
 					}
 				} else {
-					Partition *partition   = &disk->partitions[disk->partitionCount];
-					partition->disk        = disk;
-					partition->partitionNo = disk->partitionCount++;
+					Partition *partition = diskAddPartition(disk);
+					if (!partition)
+						goto outOfMemory;
 					partition->lbaStart    = pte->lbaStart;
 					partition->blockCount  = pte->blockCount;
 					partition->type        = pte->systemId;
 					partition->active      = pte->active & 0x80;
-					partition->token       = ((uint32_t)disk->diskNo << 16) | (partition->partitionNo + 1);
 				}
 			}
 		}
@@ -128,8 +134,12 @@ int dosMbrScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
 		} else {
 		invalidPartitionLayout:
 			disk->partitionCount = 0;
-			memset(disk->partitions, 0, sizeof(disk->partitions));
 			return DISK_PART_SCAN_ERR_CORRUPT;
+
+		outOfMemory:
+			printf("warning: Out of heap memory for partitions on disk %02xh\n", disk->biosId);
+			disk->partitionCount = 0;
+			return DISK_PART_SCAN_ERR_IO;
 		}
 	} else {
 		return DISK_PART_SCAN_ERR_TRY_OTHER;
@@ -18,9 +18,8 @@
 /**
  * \brief Detects and scans a DOS-style MBR partition table.
  *
- * Note that finding a protective MBR counts as a success; The caller should
- * check for the existence of a GPT partition and call the GPT scan function to
- * overwrite the disk's partition list.
+ * Note that finding a protective MBR counts as a success; gptScan() should be
+ * tried first.
  *
  * \param disk
  * \param lbaStart where the MBR covered disk section starts (usually 0)
@@ -0,0 +1,233 @@
+/**
+ * \file
+ * \brief     GUID Partition Table scanner.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "gpt.h"
+#include "dos-mbr.h"
+#include "console.h"
+#include "crc32.h"
+#include "far.h"
+
+/**
+ * \brief Where the partition entry array is read to.
+ *
+ * Nothing else uses the bounce buffer while disks are being scanned, and at
+ * 64K it fits the usual 128 entries of 128 bytes several times over.
+ */
+#define GPT_ENTRY_BUFFER_ADDR DISK_BOUNCE_BUFFER_ADDR
+#define GPT_ENTRY_BUFFER_SIZE DISK_BOUNCE_BUFFER_SIZE
+
+/// Partition entry attribute: legacy BIOS bootable.
+#define GPT_ATTR_LEGACY_BIOS_BOOTABLE (1 << 2)
+
+/**
+ * \brief The GPT header, found in the second block of the disk, and in its
+ *        last block as a backup.
+ */
+typedef struct {
+	char     signature[8]; ///< "EFI PART".
+	uint32_t revision;
+	uint32_t headerSize;
+	uint32_t headerCrc32;  ///< Calculated with this field set to zero.
+	uint32_t _reserved;
+	uint64_t myLba;
+	uint64_t alternateLba;
+	uint64_t firstUsableLba;
+	uint64_t lastUsableLba;
+	uint8_t  diskGuid[16];
+	uint64_t partitionEntryLba;
+	uint32_t partitionEntryCount;
+	uint32_t partitionEntrySize;
+	uint32_t partitionEntryArrayCrc32;
+} __attribute__((packed)) GptHeader;
+
+/**
+ * \brief A partition entry. Entries may be larger than this, in which case
+ *        the rest is ignored.
+ */
+typedef struct {
+	uint8_t  typeGuid[16]; ///< All zeroes for unused entries.
+	uint8_t  uniqueGuid[16];
+	uint64_t firstLba;
+	uint64_t lastLba;      ///< Inclusive.
+	uint64_t attributes;
+	uint16_t name[36];     ///< UTF-16LE.
+} __attribute__((packed)) GptEntry;
+
+/**
+ * \brief Read and verify a GPT header and its partition entry array.
+ *
+ * On success, the entry array is in the entry buffer.
+ *
+ * \param disk
+ * \param lbaStart
+ * \param blockCount
+ * \param lba the header location, relative to lbaStart
+ * \param header a buffer of one block
+ *
+ * \return zero on success, non-zero on failure
+ * \retval DISK_PART_SCAN_OK
+ * \retval DISK_PART_SCAN_ERR_TRY_OTHER there is no GPT header at this location
+ * \retval DISK_PART_SCAN_ERR_CORRUPT
+ * \retval DISK_PART_SCAN_ERR_IO
+ */
+static int gptReadHeader(
+		Disk *disk,
+		uint64_t lbaStart,
+		uint64_t blockCount,
+		uint64_t lba,
+		GptHeader *header
+	) {
+
+	if (diskRead(disk, (uint32_t)header, lbaStart + lba, 1))
+		return DISK_PART_SCAN_ERR_IO;
+
+	if (!memeq(header->signature, "EFI PART", 8))
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+
+	if (
+		   header->headerSize < sizeof(GptHeader)
+		|| header->headerSize > disk->blockSize
+	)
+		return DISK_PART_SCAN_ERR_CORRUPT;
+
+	uint32_t headerCrc32 = header->headerCrc32;
+	header->headerCrc32 = 0;
+	if (crc32(0, (uint32_t)header, header->headerSize) != headerCrc32)
+		return DISK_PART_SCAN_ERR_CORRUPT;
+
+	// Check the entry size and count before multiplying them.
+	if (
+		   header->myLba != lba
+		|| header->firstUsableLba > header->lastUsableLba
+		|| header->lastUsableLba >= blockCount
+		|| header->partitionEntrySize < sizeof(GptEntry)
+		|| header->partitionEntrySize % sizeof(GptEntry)
+		|| header->partitionEntrySize > GPT_ENTRY_BUFFER_SIZE
+		|| header->partitionEntryCount > GPT_ENTRY_BUFFER_SIZE / header->partitionEntrySize
+	)
+		return DISK_PART_SCAN_ERR_CORRUPT;
+
+	uint32_t entryArraySize = header->partitionEntryCount * header->partitionEntrySize;
+
+	uint32_t entryBlocks = (entryArraySize + disk->blockSize - 1) / disk->blockSize;
+
+	if (
+		   header->partitionEntryLba >= blockCount
+		|| header->partitionEntryLba + entryBlocks > blockCount
+	)
+		return DISK_PART_SCAN_ERR_CORRUPT;
+
+	if (entryBlocks && diskRead(
+			disk,
+			GPT_ENTRY_BUFFER_ADDR,
+			lbaStart + header->partitionEntryLba,
+			entryBlocks
+		))
+		return DISK_PART_SCAN_ERR_IO;
+
+	if (crc32(0, GPT_ENTRY_BUFFER_ADDR, entryArraySize) != header->partitionEntryArrayCrc32)
+		return DISK_PART_SCAN_ERR_CORRUPT;
+
+	return DISK_PART_SCAN_OK;
+}
+
+/**
+ * \brief Check whether the disk starts with a protective (or hybrid) MBR.
+ *
+ * \param disk
+ * \param lbaStart
+ *
+ * \return whether a partition of type MBR_SYSTEM_ID_GPT exists in the MBR
+ */
+static bool gptHasProtectiveMbr(Disk *disk, uint64_t lbaStart) {
+	uint8_t *mbrBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_TABLE_EXTRA);
+
+	if (diskRead(disk, (uint32_t)mbrBuffer, lbaStart, 1))
+		return false;
+
+	if (mbrBuffer[510] != 0x55 || mbrBuffer[511] != 0xaa)
+		return false;
+
+	// The system ids of the four partition table entries.
+	for (uint32_t i=0; i<4; i++) {
+		if (mbrBuffer[446 + i * 16 + 4] == MBR_SYSTEM_ID_GPT)
+			return true;
+	}
+
+	return false;
+}
+
+int gptScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount) {
+	if (blockCount < 3)
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+
+	GptHeader *header = diskBlockBuffer(DISK_BLOCK_BUFFER_TABLE);
+
+	int ret = gptReadHeader(disk, lbaStart, blockCount, 1, header);
+
+	if (ret == DISK_PART_SCAN_ERR_TRY_OTHER && !gptHasProtectiveMbr(disk, lbaStart))
+		// Most likely a plain MBR disk.
+		return DISK_PART_SCAN_ERR_TRY_OTHER;
+
+	if (ret == DISK_PART_SCAN_ERR_IO)
+		return ret;
+
+	if (ret != DISK_PART_SCAN_OK) {
+		ret = gptReadHeader(disk, lbaStart, blockCount, blockCount - 1, header);
+		if (ret == DISK_PART_SCAN_OK) {
+			printf("warning: Primary GPT on disk %02xh is damaged, using the backup\n", disk->biosId);
+		} else if (ret == DISK_PART_SCAN_ERR_IO) {
+			return ret;
+		} else {
+			printf("warning: Both the primary and the backup GPT on disk %02xh are damaged\n", disk->biosId);
+			return DISK_PART_SCAN_ERR_CORRUPT;
+		}
+	}
+
+	for (uint32_t i=0; i<header->partitionEntryCount; i++) {
+		const GptEntry *entry = (const GptEntry*)(
+			GPT_ENTRY_BUFFER_ADDR + i * header->partitionEntrySize
+		);
+
+		// The buffer is above 64K, so no memeq() here.
+		const uint32_t *typeGuid = (const uint32_t*)entry->typeGuid;
+		if (!(typeGuid[0] | typeGuid[1] | typeGuid[2] | typeGuid[3]))
+			continue; // Unused.
+
+		if (
+			   entry->firstLba > entry->lastLba
+			|| entry->firstLba < header->firstUsableLba
+			|| entry->lastLba  > header->lastUsableLba
+		) {
+			printf("warning: GPT entry %u on disk %02xh is out of range\n", i, disk->biosId);
+			disk->partitionCount = 0;
+			return DISK_PART_SCAN_ERR_CORRUPT;
+		}
+
+		Partition *partition = diskAddPartition(disk);
+		if (!partition) {
+			printf("warning: Out of heap memory for partitions on disk %02xh\n", disk->biosId);
+			disk->partitionCount = 0;
+			return DISK_PART_SCAN_ERR_IO;
+		}
+
+		partition->lbaStart   = lbaStart + entry->firstLba;
+		partition->blockCount = entry->lastLba - entry->firstLba + 1;
+		partition->type       = MBR_SYSTEM_ID_GPT;
+		partition->active     = !!(entry->attributes & GPT_ATTR_LEGACY_BIOS_BOOTABLE);
+
+		farcpy((uint32_t)partition->typeGuid,   (uint32_t)entry->typeGuid,   sizeof(entry->typeGuid));
+		farcpy((uint32_t)partition->uniqueGuid, (uint32_t)entry->uniqueGuid, sizeof(entry->uniqueGuid));
+	}
+
+	if (verifyPartitionLayout(disk)) {
+		return DISK_PART_SCAN_OK;
+	} else {
+		disk->partitionCount = 0;
+		return DISK_PART_SCAN_ERR_CORRUPT;
+	}
+}
@@ -0,0 +1,41 @@
+/**
+ * \file
+ * \brief     GUID Partition Table scanner.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#ifndef _DISK_PARTITION_TABLE_GPT_H
+#define _DISK_PARTITION_TABLE_GPT_H
+
+#include "common.h"
+#include "partition-table.h"
+#include "disk/disk.h"
+
+/// Partition type GUIDs, in on-disk byte order.
+/// EBD0A0A2-B9E5-4433-87C0-68B6B72699C7, used for FAT and NTFS.
+#define GPT_TYPE_BASIC_DATA \
+	{ 0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44, 0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7 }
+/// C12A7328-F81F-11D2-BA4B-00A0C93EC93B, the EFI system partition.
+#define GPT_TYPE_EFI_SYSTEM \
+	{ 0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b }
+
+/**
+ * \brief Detects and scans a GUID Partition Table.
+ *
+ * Verifies the header and partition entry array CRCs, and falls back to the
+ * backup header at the end of the disk if the primary one is damaged.
+ *
+ * \param disk
+ * \param lbaStart where the GPT covered disk section starts (usually 0)
+ * \param blockCount the size of the disk section covered by the GPT (usually $BLOCKCOUNT)
+ *
+ * \return zero on success, non-zero on failure
+ * \retval DISK_PART_SCAN_OK
+ * \retval DISK_PART_SCAN_ERR_TRY_OTHER
+ * \retval DISK_PART_SCAN_ERR_CORRUPT
+ * \retval DISK_PART_SCAN_ERR_IO
+ */
+int gptScan(Disk *disk, uint64_t lbaStart, uint64_t blockCount);
+
+#endif /* _DISK_PARTITION_TABLE_GPT_H */
@@ -0,0 +1,55 @@
+/**
+ * \file
+ * \brief     int13h request trace.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "trace.h"
+#include "heap.h"
+
+uint32_t diskTraceTotal = 0;
+
+static DiskTraceEntry *ring = NULL;
+
+void diskTraceInit() {
+	if (CONFIG_DISK_TRACE_ENTRIES)
+		ring = heapAlloc(CONFIG_DISK_TRACE_ENTRIES * sizeof(DiskTraceEntry));
+}
+
+void diskTraceRecord(
+		uint8_t  biosId,
+		uint8_t  function,
+		uint8_t  result,
+		uint64_t lba,
+		uint32_t blockCount,
+		uint32_t dest,
+		uint64_t startTsc
+	) {
+
+	if (!ring)
+		return;
+
+	uint64_t cycles = rdtsc() - startTsc;
+
+	DiskTraceEntry *entry = &ring[diskTraceTotal++ & (CONFIG_DISK_TRACE_ENTRIES - 1)];
+
+	entry->lba        = lba;
+	entry->dest       = dest;
+	entry->cycles     = cycles >> 32 ? 0xffffffff : (uint32_t)cycles;
+	entry->biosId     = biosId;
+	entry->function   = function;
+	entry->result     = result;
+	entry->blockCount = blockCount;
+}
+
+DiskTraceEntry *diskTraceGet(uint32_t seq) {
+	if (
+		   !ring
+		|| seq >= diskTraceTotal
+		|| diskTraceTotal - seq > CONFIG_DISK_TRACE_ENTRIES
+	)
+		return NULL;
+
+	return &ring[seq & (CONFIG_DISK_TRACE_ENTRIES - 1)];
+}
@@ -0,0 +1,92 @@
+/**
+ * \file
+ * \brief     int13h request trace.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * A ring buffer in the loader heap that holds the most recent int13h calls
+ * made by the disk layer, for finding out what a slow BIOS is doing.
+ */
+#ifndef _DISK_TRACE_H
+#define _DISK_TRACE_H
+
+#include "common.h"
+
+#ifndef CONFIG_DISK_TRACE_ENTRIES
+/// Must be a power of two, zero disables tracing.
+#define CONFIG_DISK_TRACE_ENTRIES 512
+#endif /* CONFIG_DISK_TRACE_ENTRIES */
+
+#define DISK_TRACE_MAGIC   "SBDTRACE"
+#define DISK_TRACE_VERSION 1
+
+/**
+ * \brief A traced int13h call.
+ */
+typedef struct {
+	uint64_t lba;        ///< Zero for calls that do not transfer data.
+	uint32_t dest;
+	uint32_t cycles;     ///< TSC ticks spent in the call, saturated at 0xffffffff.
+	uint8_t  biosId;
+	uint8_t  function;   ///< AH of the request.
+	uint8_t  result;     ///< AH on return, zero on success.
+	uint8_t  blockCount;
+} __attribute__((packed)) DiskTraceEntry;
+
+/**
+ * \brief Header of a binary trace dump, followed by entryCount entries,
+ *        oldest first.
+ */
+typedef struct {
+	char     magic[8];   ///< DISK_TRACE_MAGIC, not NUL-terminated.
+	uint16_t version;    ///< DISK_TRACE_VERSION.
+	uint16_t entrySize;  ///< sizeof(DiskTraceEntry).
+	uint32_t entryCount;
+	uint32_t firstSeq;   ///< Sequence number of the first entry, earlier ones were overwritten.
+} __attribute__((packed)) DiskTraceHeader;
+
+/**
+ * \brief Allocate the ring buffer from the loader heap.
+ *
+ * Tracing stays disabled if the heap is unavailable.
+ */
+void diskTraceInit();
+
+/**
+ * \brief Record a finished int13h call.
+ *
+ * \param biosId
+ * \param function AH of the request
+ * \param result AH on return
+ * \param lba
+ * \param blockCount
+ * \param dest
+ * \param startTsc the TSC right before the call
+ */
+void diskTraceRecord(
+		uint8_t  biosId,
+		uint8_t  function,
+		uint8_t  result,
+		uint64_t lba,
+		uint32_t blockCount,
+		uint32_t dest,
+		uint64_t startTsc
+	);
+
+/**
+ * \brief The amount of calls recorded since boot, including overwritten ones.
+ */
+extern uint32_t diskTraceTotal;
+
+/**
+ * \brief Get a recorded call by its sequence number.
+ *
+ * \param seq from MAX(0, diskTraceTotal - CONFIG_DISK_TRACE_ENTRIES) up to
+ *            diskTraceTotal
+ *
+ * \return the entry in the loader heap, or NULL if it is not in the buffer
+ */
+DiskTraceEntry *diskTraceGet(uint32_t seq);
+
+#endif /* _DISK_TRACE_H */
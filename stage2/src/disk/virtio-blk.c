@@ -0,0 +1,468 @@
+/**
+ * \file
+ * \brief     Native virtio-blk disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "virtio-blk.h"
+
+#if CONFIG_DISK_VIRTIO
+
+#include "ioport.h"
+#include "pci.h"
+#include "bda.h"
+#include "heap.h"
+#include "far.h"
+#include "console.h"
+
+#define VIRTIO_MAX_DEVICES 8
+
+#define VIRTIO_PAGE_SIZE 4096
+
+/// Largest queue we set up, the queue memory is sized for it.
+#define VIRTIO_MAX_QUEUE_SIZE 256
+/// Data descriptors per request.
+#define VIRTIO_MAX_SEGMENTS   8
+/// Bytes per data descriptor, unless the device asks for less.
+#define VIRTIO_SEGMENT_BYTES  (4 * 1024 * 1024)
+
+/// Request timeout in PIT ticks (~5 seconds).
+#define VIRTIO_TIMEOUT_TICKS 91
+
+#define VIRTIO_PCI_VENDOR            0x1af4
+#define VIRTIO_PCI_DEVICE_LEGACY_BLK 0x1001
+#define VIRTIO_PCI_DEVICE_BLK        0x1042
+
+// Legacy I/O register offsets.
+#define VIRTIO_LEGACY_DEVICE_FEATURES 0x00
+#define VIRTIO_LEGACY_DRIVER_FEATURES 0x04
+#define VIRTIO_LEGACY_QUEUE_PFN       0x08
+#define VIRTIO_LEGACY_QUEUE_SIZE      0x0c
+#define VIRTIO_LEGACY_QUEUE_SELECT    0x0e
+#define VIRTIO_LEGACY_QUEUE_NOTIFY    0x10
+#define VIRTIO_LEGACY_STATUS          0x12
+#define VIRTIO_LEGACY_CONFIG          0x14
+
+// Modern common configuration offsets.
+#define VIRTIO_COMMON_DEVICE_FEATURE_SELECT 0x00
+#define VIRTIO_COMMON_DEVICE_FEATURE        0x04
+#define VIRTIO_COMMON_DRIVER_FEATURE_SELECT 0x08
+#define VIRTIO_COMMON_DRIVER_FEATURE        0x0c
+#define VIRTIO_COMMON_STATUS                0x14
+#define VIRTIO_COMMON_QUEUE_SELECT          0x16
+#define VIRTIO_COMMON_QUEUE_SIZE            0x18
+#define VIRTIO_COMMON_QUEUE_ENABLE          0x1c
+#define VIRTIO_COMMON_QUEUE_NOTIFY_OFF      0x1e
+#define VIRTIO_COMMON_QUEUE_DESC            0x20
+#define VIRTIO_COMMON_QUEUE_DRIVER          0x28
+#define VIRTIO_COMMON_QUEUE_DEVICE          0x30
+
+// PCI capability types.
+#define VIRTIO_PCI_CAP_ID          0x09
+#define VIRTIO_PCI_CAP_COMMON_CFG  1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG  2
+#define VIRTIO_PCI_CAP_DEVICE_CFG  4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+
+#define VIRTIO_BLK_F_SIZE_MAX (1U << 1)
+#define VIRTIO_BLK_F_SEG_MAX  (1U << 2)
+#define VIRTIO_F_VERSION_1    (1U << 0) ///< In the second feature dword.
+
+// Block device configuration offsets.
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_SIZE_MAX 8
+#define VIRTIO_BLK_CONFIG_SEG_MAX  12
+
+#define VIRTIO_BLK_T_IN 0
+
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+
+typedef struct {
+	uint64_t address;
+	uint32_t length;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed)) VirtqDesc;
+
+/**
+ * \brief Block request header, followed by data and a status byte.
+ */
+typedef struct {
+	uint32_t type;
+	uint32_t _reserved;
+	uint64_t sector; ///< Always in 512-byte units.
+	uint8_t  status; ///< Written by the device.
+} __attribute__((packed)) VirtioBlkRequest;
+
+typedef struct {
+	uint32_t pciAddress;
+	bool     modern;
+	uint16_t ioBase;           ///< Legacy devices.
+	volatile uint8_t  *common; ///< Modern devices.
+	volatile uint8_t  *config; ///< Modern devices.
+	volatile uint16_t *notify; ///< Modern devices.
+
+	uint16_t queueSize;
+	uint16_t availIdx;
+	VirtqDesc         *desc;
+	volatile uint16_t *avail; ///< flags, idx, ring[queueSize].
+	volatile uint16_t *used;  ///< flags, idx, ring[queueSize] of {id, length} dword pairs.
+	VirtioBlkRequest  *request;
+
+	uint32_t segmentBytes;
+	uint32_t segmentCount;
+	uint64_t capacity; ///< In 512-byte sectors.
+	bool     claimed;
+} VirtioBlkDevice;
+
+static VirtioBlkDevice devices[VIRTIO_MAX_DEVICES];
+static uint32_t        deviceCount = 0;
+
+static uint8_t virtioGetStatus(VirtioBlkDevice *dev) {
+	return dev->modern
+		? dev->common[VIRTIO_COMMON_STATUS]
+		: inb(dev->ioBase + VIRTIO_LEGACY_STATUS);
+}
+
+static void virtioSetStatus(VirtioBlkDevice *dev, uint8_t status) {
+	if (dev->modern)
+		dev->common[VIRTIO_COMMON_STATUS] = status;
+	else
+		outb(dev->ioBase + VIRTIO_LEGACY_STATUS, status);
+}
+
+static uint32_t virtioReadConfig(VirtioBlkDevice *dev, uint8_t offset) {
+	return dev->modern
+		? *(volatile uint32_t*)(dev->config + offset)
+		: inl(dev->ioBase + VIRTIO_LEGACY_CONFIG + offset);
+}
+
+static volatile uint32_t *virtioCommon32(VirtioBlkDevice *dev, uint8_t offset) {
+	return (volatile uint32_t*)(dev->common + offset);
+}
+
+static volatile uint16_t *virtioCommon16(VirtioBlkDevice *dev, uint8_t offset) {
+	return (volatile uint16_t*)(dev->common + offset);
+}
+
+/**
+ * \brief Find the modern register windows in the vendor capabilities.
+ *
+ * \return whether all required windows were found below 4G
+ */
+static bool virtioFindModernRegs(VirtioBlkDevice *dev) {
+	uint32_t notifyMultiplier = 0;
+	uint8_t  capPtr = pciRead(dev->pciAddress, PCI_REG_CAPABILITY) & 0xfc;
+
+	for (uint32_t i=0; capPtr && i<48; i++) {
+		uint32_t header = pciRead(dev->pciAddress, capPtr);
+
+		if ((header & 0xff) == VIRTIO_PCI_CAP_ID) {
+			uint8_t  type  = header >> 24;
+			uint8_t  barNo = pciRead(dev->pciAddress, capPtr + 4) & 0xff;
+			uint32_t bar   = 0;
+
+			// The register windows live in memory BARs.
+			if (barNo < 6 && !(pciRead(dev->pciAddress, PCI_REG_BAR0 + barNo * 4) & 1))
+				bar = pciGetBar(dev->pciAddress, barNo);
+
+			if (bar) {
+				uint32_t base = bar + pciRead(dev->pciAddress, capPtr + 8);
+
+				if (type == VIRTIO_PCI_CAP_COMMON_CFG) {
+					dev->common = (uint8_t*)base;
+				} else if (type == VIRTIO_PCI_CAP_DEVICE_CFG) {
+					dev->config = (uint8_t*)base;
+				} else if (type == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+					dev->notify      = (uint16_t*)base;
+					notifyMultiplier = pciRead(dev->pciAddress, capPtr + 16);
+				}
+			}
+		}
+		capPtr = (header >> 8) & 0xfc;
+	}
+
+	if (!dev->common || !dev->config || !dev->notify)
+		return false;
+
+	// Each queue has its own notification address.
+	*virtioCommon16(dev, VIRTIO_COMMON_QUEUE_SELECT) = 0;
+	dev->notify = (uint16_t*)(
+		(uint32_t)dev->notify
+		+ *virtioCommon16(dev, VIRTIO_COMMON_QUEUE_NOTIFY_OFF) * notifyMultiplier
+	);
+
+	return true;
+}
+
+/**
+ * \brief Reset a device, negotiate features and set up its request queue.
+ *
+ * \return zero on success, non-zero on error
+ */
+static int virtioReset(VirtioBlkDevice *dev) {
+	virtioSetStatus(dev, 0);
+	virtioSetStatus(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+	virtioSetStatus(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	uint32_t features;
+	if (dev->modern) {
+		*virtioCommon32(dev, VIRTIO_COMMON_DEVICE_FEATURE_SELECT) = 1;
+		if (!(*virtioCommon32(dev, VIRTIO_COMMON_DEVICE_FEATURE) & VIRTIO_F_VERSION_1))
+			return -1;
+		*virtioCommon32(dev, VIRTIO_COMMON_DRIVER_FEATURE_SELECT) = 1;
+		*virtioCommon32(dev, VIRTIO_COMMON_DRIVER_FEATURE)        = VIRTIO_F_VERSION_1;
+
+		*virtioCommon32(dev, VIRTIO_COMMON_DEVICE_FEATURE_SELECT) = 0;
+		features = *virtioCommon32(dev, VIRTIO_COMMON_DEVICE_FEATURE)
+		         & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX);
+		*virtioCommon32(dev, VIRTIO_COMMON_DRIVER_FEATURE_SELECT) = 0;
+		*virtioCommon32(dev, VIRTIO_COMMON_DRIVER_FEATURE)        = features;
+
+		virtioSetStatus(dev, virtioGetStatus(dev) | VIRTIO_STATUS_FEATURES_OK);
+		if (!(virtioGetStatus(dev) & VIRTIO_STATUS_FEATURES_OK))
+			return -1;
+	} else {
+		features = inl(dev->ioBase + VIRTIO_LEGACY_DEVICE_FEATURES)
+		         & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX);
+		outl(dev->ioBase + VIRTIO_LEGACY_DRIVER_FEATURES, features);
+	}
+
+	dev->capacity = (uint64_t)virtioReadConfig(dev, VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32
+	              | virtioReadConfig(dev, VIRTIO_BLK_CONFIG_CAPACITY);
+
+	dev->segmentBytes = VIRTIO_SEGMENT_BYTES;
+	dev->segmentCount = VIRTIO_MAX_SEGMENTS;
+	if (features & VIRTIO_BLK_F_SIZE_MAX)
+		dev->segmentBytes = MIN(dev->segmentBytes, virtioReadConfig(dev, VIRTIO_BLK_CONFIG_SIZE_MAX) & ~0x1ff);
+	if (features & VIRTIO_BLK_F_SEG_MAX)
+		dev->segmentCount = MIN(dev->segmentCount, virtioReadConfig(dev, VIRTIO_BLK_CONFIG_SEG_MAX));
+	if (!dev->segmentBytes || !dev->segmentCount)
+		return -1;
+
+	// Legacy devices dictate the queue size, modern ones let us shrink it.
+	if (dev->modern) {
+		*virtioCommon16(dev, VIRTIO_COMMON_QUEUE_SELECT) = 0;
+		dev->queueSize = MIN(*virtioCommon16(dev, VIRTIO_COMMON_QUEUE_SIZE), VIRTIO_MAX_QUEUE_SIZE);
+		*virtioCommon16(dev, VIRTIO_COMMON_QUEUE_SIZE) = dev->queueSize;
+	} else {
+		outw(dev->ioBase + VIRTIO_LEGACY_QUEUE_SELECT, 0);
+		dev->queueSize = inw(dev->ioBase + VIRTIO_LEGACY_QUEUE_SIZE);
+	}
+	if (dev->queueSize < VIRTIO_MAX_SEGMENTS + 2 || dev->queueSize > VIRTIO_MAX_QUEUE_SIZE)
+		return -1;
+
+	// The legacy layout: descriptors and available ring, then the used ring on the next page.
+	uint32_t mem = (uint32_t)heapAlloc(4 * VIRTIO_PAGE_SIZE);
+	if (!mem)
+		return -1;
+	mem = (mem + VIRTIO_PAGE_SIZE - 1) & ~(VIRTIO_PAGE_SIZE - 1);
+
+	dev->desc    = (VirtqDesc*)mem;
+	dev->avail   = (uint16_t*)(mem + VIRTIO_MAX_QUEUE_SIZE * sizeof(VirtqDesc));
+	dev->used    = (uint16_t*)(mem + 2 * VIRTIO_PAGE_SIZE);
+	dev->request = (VirtioBlkRequest*)(mem + 2 * VIRTIO_PAGE_SIZE - sizeof(VirtioBlkRequest));
+	dev->availIdx = 0;
+
+	if (dev->modern) {
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DESC)       = (uint32_t)dev->desc;
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DESC + 4)   = 0;
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DRIVER)     = (uint32_t)dev->avail;
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DRIVER + 4) = 0;
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DEVICE)     = (uint32_t)dev->used;
+		*virtioCommon32(dev, VIRTIO_COMMON_QUEUE_DEVICE + 4) = 0;
+		*virtioCommon16(dev, VIRTIO_COMMON_QUEUE_ENABLE)     = 1;
+	} else {
+		// Legacy devices derive the ring offsets from the queue size they report.
+		dev->avail = (uint16_t*)(mem + dev->queueSize * sizeof(VirtqDesc));
+		dev->used  = (uint16_t*)(
+			(mem + dev->queueSize * sizeof(VirtqDesc) + 6 + 2 * dev->queueSize + VIRTIO_PAGE_SIZE - 1)
+			& ~(VIRTIO_PAGE_SIZE - 1)
+		);
+		outl(dev->ioBase + VIRTIO_LEGACY_QUEUE_PFN, mem / VIRTIO_PAGE_SIZE);
+	}
+
+	virtioSetStatus(dev, virtioGetStatus(dev) | VIRTIO_STATUS_DRIVER_OK);
+
+	return 0;
+}
+
+/**
+ * \brief Set up the device at a PCI address.
+ *
+ * \return a device, or NULL if there is no usable virtio-blk device there
+ */
+static VirtioBlkDevice *virtioGetDevice(uint32_t pciAddress) {
+	for (uint32_t i=0; i<deviceCount; i++) {
+		if (devices[i].pciAddress == pciAddress)
+			return devices[i].queueSize ? &devices[i] : NULL;
+	}
+
+	if (deviceCount == VIRTIO_MAX_DEVICES)
+		return NULL;
+
+	VirtioBlkDevice *dev = &devices[deviceCount++];
+	memset(dev, 0, sizeof(VirtioBlkDevice));
+	dev->pciAddress = pciAddress;
+
+	uint16_t deviceId = pciRead(pciAddress, PCI_REG_VENDOR_ID) >> 16;
+
+	// Prefer the modern interface, transitional devices may still offer only
+	// the legacy one if the modern BAR was mapped above 4G.
+	dev->modern = virtioFindModernRegs(dev);
+	if (!dev->modern) {
+		if (deviceId != VIRTIO_PCI_DEVICE_LEGACY_BLK)
+			return NULL;
+		dev->ioBase = pciGetBar(pciAddress, 0);
+		if (!(pciRead(pciAddress, PCI_REG_BAR0) & 1))
+			return NULL;
+	}
+
+	pciEnable(
+		pciAddress,
+		(dev->modern ? PCI_COMMAND_MEMORY : PCI_COMMAND_IO) | PCI_COMMAND_BUS_MASTER
+	);
+
+	// Whether or not the reset succeeds, the BIOS's queue is gone.
+	diskBiosLost(pciAddress);
+
+	if (virtioReset(dev)) {
+		printf("warning: Could not initialize virtio-blk device %02x:%02x.%x\n",
+		       PCI_ADDRESS_BUS(pciAddress),
+		       PCI_ADDRESS_DEVICE(pciAddress),
+		       PCI_ADDRESS_FUNCTION(pciAddress));
+		virtioSetStatus(dev, 0);
+		dev->queueSize = 0;
+		return NULL;
+	}
+
+	return dev;
+}
+
+static int virtioRead(Disk *disk, uint32_t dest, uint64_t lba, uint32_t blockCount) {
+	VirtioBlkDevice *dev = disk->driverData;
+
+	uint32_t sectorsPerBlock = disk->blockSize / 512;
+
+	if ((lba + blockCount) * sectorsPerBlock > dev->capacity)
+		return -1;
+
+	VirtioBlkRequest *req = dev->request;
+
+	while (blockCount) {
+		req->type      = VIRTIO_BLK_T_IN;
+		req->_reserved = 0;
+		req->sector    = lba * sectorsPerBlock;
+		req->status    = 0xff;
+
+		// Header, data segments into the destination, status byte.
+		dev->desc[0].address = (uint32_t)req;
+		dev->desc[0].length  = 16;
+		dev->desc[0].flags   = VIRTQ_DESC_F_NEXT;
+		dev->desc[0].next    = 1;
+
+		uint16_t d = 1;
+		for (; d <= dev->segmentCount && blockCount; d++) {
+			uint32_t count = MIN(blockCount, dev->segmentBytes / disk->blockSize);
+
+			dev->desc[d].address = dest;
+			dev->desc[d].length  = count * disk->blockSize;
+			dev->desc[d].flags   = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+			dev->desc[d].next    = d + 1;
+
+			dest       += count * disk->blockSize;
+			lba        += count;
+			blockCount -= count;
+		}
+
+		dev->desc[d].address = (uint32_t)&req->status;
+		dev->desc[d].length  = 1;
+		dev->desc[d].flags   = VIRTQ_DESC_F_WRITE;
+		dev->desc[d].next    = 0;
+
+		uint16_t usedIdx = dev->used[1];
+
+		dev->avail[2 + dev->availIdx % dev->queueSize] = 0; // Head descriptor.
+		asm volatile ("" ::: "memory"); // The chain must be in memory before it is made available.
+		dev->avail[1] = ++dev->availIdx;
+
+		if (dev->modern)
+			*dev->notify = 0;
+		else
+			outw(dev->ioBase + VIRTIO_LEGACY_QUEUE_NOTIFY, 0);
+
+		uint32_t start = bda->timerTicks;
+		while (dev->used[1] == usedIdx) {
+			if (bda->timerTicks - start >= VIRTIO_TIMEOUT_TICKS)
+				return -1;
+		}
+
+		if (((volatile VirtioBlkRequest*)req)->status)
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool virtioClaim(Disk *disk) {
+	if (disk->pciAddress == PCI_ADDRESS_NONE)
+		return false;
+
+	// Like with NVMe, the BIOS loses the device when we reset it, so read the
+	// reference block through int13h first.
+	uint8_t *biosBuffer   = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_BIOS);
+	uint8_t *nativeBuffer = diskBlockBuffer(DISK_BLOCK_BUFFER_CHECK_NATIVE);
+
+	bool haveReference = false;
+	bool knownDevice   = false;
+	for (uint32_t i=0; i<deviceCount; i++)
+		knownDevice |= devices[i].pciAddress == disk->pciAddress;
+
+	if (!knownDevice) {
+		uint32_t id = pciRead(disk->pciAddress, PCI_REG_VENDOR_ID);
+		if (
+			   (id & 0xffff) != VIRTIO_PCI_VENDOR
+			|| ((id >> 16) != VIRTIO_PCI_DEVICE_LEGACY_BLK && (id >> 16) != VIRTIO_PCI_DEVICE_BLK)
+		)
+			return false; // Not a virtio-blk device.
+		haveReference = !diskRead(disk, (uint32_t)biosBuffer, 0, 1);
+	}
+
+	VirtioBlkDevice *dev = virtioGetDevice(disk->pciAddress);
+	if (!dev || dev->claimed || dev->capacity * 512 != disk->blockCount * disk->blockSize)
+		return false;
+
+	disk->driver     = &virtioBlkDiskDriver;
+	disk->driverData = dev;
+
+	if (
+		   virtioRead(disk, (uint32_t)nativeBuffer, 0, 1)
+		|| (haveReference && !memeq(biosBuffer, nativeBuffer, disk->blockSize))
+	) {
+		printf("warning: virtio-blk device does not match disk %02xh\n", disk->biosId);
+		disk->driver     = NULL;
+		disk->driverData = NULL;
+		return false;
+	}
+
+	dev->claimed = true;
+
+	return true;
+}
+
+const DiskDriver virtioBlkDiskDriver = {
+	"virtio-blk",
+	virtioClaim,
+	virtioRead,
+	NULL, // The BIOS's queue is gone after the reset.
+	VIRTIO_MAX_SEGMENTS * VIRTIO_SEGMENT_BYTES / 512,
+	true,
+};
+
+#endif /* CONFIG_DISK_VIRTIO */
@@ -0,0 +1,26 @@
+/**
+ * \file
+ * \brief     Native virtio-blk disk driver.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ *
+ * Supports both legacy (I/O port) and modern (memory-mapped) virtio PCI
+ * devices. Each read is a single request whose data descriptors point straight
+ * at the destination, so that a VM takes one exit per request instead of one
+ * per int13h call. Like the NVMe driver, disks are matched to their device
+ * through EDD, as the device is reset when we take it over.
+ */
+#ifndef _DISK_VIRTIO_BLK_H
+#define _DISK_VIRTIO_BLK_H
+
+#include "common.h"
+#include "disk/disk.h"
+
+#ifndef CONFIG_DISK_VIRTIO
+#define CONFIG_DISK_VIRTIO 0
+#endif /* CONFIG_DISK_VIRTIO */
+
+extern const DiskDriver virtioBlkDiskDriver;
+
+#endif /* _DISK_VIRTIO_BLK_H */
@@ -10,6 +10,15 @@
 #include "console.h"
 #include "memmap.h"
 #include "far.h"
+#include "bda.h"
+
+/**
+ * \brief The maximum amount of blocks to request from the FS driver at once,
+ *        unless the disk's native driver can read more in one request.
+ *
+ * Bounds the time between progress indicator updates.
+ */
+#define ELF_READ_CHUNK_BLOCKS (DISK_MAX_TRANSFER_BLOCKS * 8)
 
 // ELF32 types.
 typedef uint32_t elf32_addr_t;
@@ -113,8 +122,7 @@ typedef struct {
 uint64_t loadElf(FileInfo *file) {
 
 	Partition *part = file->partition;
-	size_t bufferSize = part->disk->blockSize;
-	uint8_t buffer[bufferSize]; ///< We'll use this for IO.
+	uint8_t *buffer = diskBlockBuffer(DISK_BLOCK_BUFFER_ELF); ///< We'll use this for IO.
 
 	if (file->size < sizeof(Elf64Header))
 		goto readError;
@@ -279,6 +287,10 @@ uint64_t loadElf(FileInfo *file) {
 		int progressWidth = 20;
 		int progressI     =  0;
 		uint32_t totalFileCopied = 0;
+		uint32_t progressShown   = 0;
+
+		uint32_t startTicks     = bda->timerTicks;
+		uint32_t startTransfers = diskTransferCount;
 
 		if (showProgress) {
 			printf("Loading [");
@@ -292,6 +304,11 @@ uint64_t loadElf(FileInfo *file) {
 			struct LoadableSegments *seg = &loadableSegments[i];
 			uint16_t bs = part->disk->blockSize;
 
+			// Let native drivers fill all of their queue slots with one request.
+			uint32_t chunkBlocks = part->disk->driver
+				? MAX(part->disk->driver->maxTransferBlocks, ELF_READ_CHUNK_BLOCKS)
+				: ELF_READ_CHUNK_BLOCKS;
+
 			if (!seg->memAddr || !seg->memSize)
 				continue; // An empty segment? Done.
 
@@ -310,20 +327,37 @@ uint64_t loadElf(FileInfo *file) {
 				totalFileCopied += memI;
 
 				while (memI < seg->fileSize) {
-					// Read a block.
-					READ_NEXT_BLOCK();
-					uint32_t toRead = MIN(bs, seg->fileSize - memI);
-					// Copy it to the right address.
-					farcpy(
-						seg->memAddr + memI,
-						(uint32_t)buffer,
-						toRead
-					);
+					uint32_t toRead = seg->fileSize - memI;
+
+					if (toRead >= bs) {
+						// Read as many whole blocks as the FS can give us, straight to their destination.
+						if (bytesRead >= file->size)
+							goto readError;
+
+						int blocksRead = part->fsDriver->readFileBlocks(
+							file,
+							seg->memAddr + memI,
+							MIN(toRead / bs, chunkBlocks)
+						);
+						if (blocksRead <= 0)
+							goto readError;
+
+						toRead     = blocksRead * bs;
+						bytesRead += toRead;
+
+						// Keep the last block around for whoever seeks into it next.
+						farcpy((uint32_t)buffer, seg->memAddr + memI + toRead - bs, bs);
+					} else {
+						// Read the final, partial block.
+						READ_NEXT_BLOCK();
+						farcpy(seg->memAddr + memI, (uint32_t)buffer, toRead);
+					}
 					memI            += toRead;
 					totalFileCopied += toRead;
 
 					// Show progress indicator.
-					if (showProgress && (bytesRead & 0x7fff) == 0) {
+					if (showProgress && totalFileCopied - progressShown >= 0x8000) {
+						progressShown = totalFileCopied;
 						int dots = 1+ (totalFileCopied * progressWidth) / (totalFileCopySize);
 						printf("\rLoading [");
 						for (int j = 0; j < dots-1; ++j)
@@ -349,6 +383,14 @@ uint64_t loadElf(FileInfo *file) {
 			}
 		}
 
+		if (showProgress)
+			printf(
+				"\nLoaded %'uK in %u disk transfers, %u ms\n",
+				totalFileCopied / 1024,
+				diskTransferCount - startTransfers,
+				(bda->timerTicks - startTicks) * 55
+			);
+
 		return entryPoint;
 	}
 
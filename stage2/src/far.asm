@@ -27,13 +27,30 @@ farcpy:
 	mov edi, [ebp +  8]
 	mov esi, [ebp + 12]
 
-.loop:
+	; Move whole dwords first, then the remaining bytes.
+	mov edx, ecx
+	shr ecx, 2
+	jz .bytes
+
+.dwordLoop:
+	mov eax, [ds:esi]
+	mov [ds:edi], eax
+	add edi, 4
+	add esi, 4
+	dec ecx
+	jnz .dwordLoop
+
+.bytes:
+	and edx, 3
+	jz .end
+
+.byteLoop:
 	mov al, [ds:esi]
 	mov [ds:edi], al
 	inc edi
 	inc esi
-	dec ecx
-	jnz .loop
+	dec edx
+	jnz .byteLoop
 
 .end:
 	pop esi
@@ -54,13 +71,27 @@ farzero:
 	jz .end
 
 	mov edi, [ebp +  8]
-	xor al, al
+	xor eax, eax
+
+	mov edx, ecx
+	shr ecx, 2
+	jz .bytes
 
-.loop:
+.dwordLoop:
+	mov [ds:edi], eax
+	add edi, 4
+	dec ecx
+	jnz .dwordLoop
+
+.bytes:
+	and edx, 3
+	jz .end
+
+.byteLoop:
 	mov [ds:edi], al
 	inc edi
-	dec ecx
-	jnz .loop
+	dec edx
+	jnz .byteLoop
 
 .end:
 	pop edi
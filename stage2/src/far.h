@@ -13,11 +13,13 @@
 /**
  * \brief Copy data using 32-bit pointers.
  *
+ * Implemented in far.asm, which takes its arguments on the stack.
+ *
  * \param dest
  * \param src
  * \param length
  */
-void farcpy(uint32_t dest, uint32_t src, uint32_t length);
+void farcpy(uint32_t dest, uint32_t src, uint32_t length) __attribute__((regparm(0)));
 
 /**
  * \brief Copy data across memory segments.
@@ -38,9 +40,11 @@ void farcpy(uint32_t dest, uint32_t src, uint32_t length);
 /**
  * \brief Zeroes memory.
  *
+ * Implemented in far.asm, which takes its arguments on the stack.
+ *
  * \param dest
  * \param length
  */
-void farzero(uint32_t dest, uint32_t length);
+void farzero(uint32_t dest, uint32_t length) __attribute__((regparm(0)));
 
 #endif /* _FAR_H */
@@ -15,6 +15,7 @@ static FileSystemDriver fsDrivers[] = {
 		vfatDetect,
 		vfatGetFile,
 		vfatReadFileBlock,
+		vfatReadFileBlocks,
 		vfatReadDir,
 	},
 };
@@ -99,6 +99,29 @@ struct FileSystemDriver {
 		uint8_t *buffer
 	);
 
+	/**
+	 * \brief Read up to `blockCount` consecutive blocks from the given file.
+	 *
+	 * Reads as many blocks as can be fetched from disk in one go: at least
+	 * one, at most `blockCount`. Fewer blocks may be returned when the
+	 * file is fragmented past the current position.
+	 *
+	 * `dest` must be able to hold `blockCount` blocks.
+	 *
+	 * \param fileInfo
+	 * \param dest destination address
+	 * \param blockCount
+	 *
+	 * \return the amount of blocks read, or a negative value on failure
+	 * \retval FS_INTERNAL_ERROR
+	 * \retval FS_IO_ERROR
+	 */
+	int (*readFileBlocks)(
+		FileInfo *fileInfo,
+		uint32_t dest,
+		uint32_t blockCount
+	);
+
 	/**
 	 * \brief Read at most `count` directory entries from the given directory.
 	 *
@@ -108,8 +131,7 @@ struct FileSystemDriver {
 	 * \param offset amount of directory entries to skip
 	 * \param count
 	 *
-	 * \return zero on success, non-zero on failure
-	 * \retval FS_SUCCESS
+	 * \return the amount of entries read, or a negative value on failure
 	 * \retval FS_INTERNAL_ERROR
 	 * \retval FS_IO_ERROR
 	 */
@@ -8,10 +8,25 @@
 #include "vfat.h"
 #include "console.h"
 #include "dump.h"
+#include "heap.h"
+#include "far.h"
+#include "disk/partition-table/dos-mbr.h"
+#include "disk/partition-table/gpt.h"
 
 #define VFAT_READ_ERROR (-1)
 #define VFAT_READ_EOF   (-2)
 
+#define VFAT_EXTENT_MAPS 4  ///< Amount of files whose extents are remembered.
+#define VFAT_MAX_EXTENTS 32 ///< Files in more pieces are read by following their cluster chain.
+#define VFAT_READ_VECS    8  ///< Amount of extents read with one partReadv().
+
+#define VFAT_DENTRY_CACHE_SIZE  32 ///< Amount of remembered path lookups.
+#define VFAT_DENTRY_NAME_LENGTH 31 ///< Longer path components are not cached.
+
+#define VFAT_DIR_INDEXES     8    ///< Amount of directories whose names are indexed.
+#define VFAT_DIR_INDEX_SLOTS 1024 ///< Per directory.
+#define VFAT_DIR_INDEX_MAX_ENTRIES (VFAT_DIR_INDEX_SLOTS / 4 * 3)
+
 /**
  * \brief VFAT BPB.
  */
@@ -63,13 +78,19 @@ typedef struct {
 
 	uint32_t currentClusterNo;
 	uint32_t currentFatBlockNo; ///< Partition LBA that contains the currently buffered FAT block.
-	uint8_t  currentFatBlock[DISK_MAX_BLOCK_SIZE];
+	uint8_t *currentFatBlock; ///< A low-memory block buffer, so that the FAT can be read without a heap.
 	uint32_t currentClusterBlockNo; ///< Block number within the current cluster.
 
 	uint8_t  clusterSize;
 
 	bool endOfCluster;
 
+#if CONFIG_VFAT_FAT_MIRROR_SIZE
+	uint32_t *fatMirror;        ///< CONFIG_VFAT_FAT_MIRROR_SIZE bytes in the loader heap.
+	uint32_t  fatMirrorEntries; ///< Amount of FAT entries that fit in the mirror, zero if there is none.
+	bool      fatMirrorChunks[CONFIG_VFAT_FAT_MIRROR_SIZE / VFAT_FAT_MIRROR_CHUNK_SIZE]; ///< Which chunks have been read.
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
 } VfatPartData;
 
 /**
@@ -102,12 +123,119 @@ typedef struct {
 	uint32_t fileSize; ///< In bytes.
 } __attribute__((packed)) VfatDirEntry;
 
+/**
+ * \brief VFAT long file name directory entry.
+ *
+ * A long name is stored in fragments of 13 UCS-2 characters, in the
+ * directory entries right before the short entry of the file. The last
+ * fragment comes first.
+ */
+typedef struct {
+	uint8_t  seqNo;      ///< 1-based fragment number, VFAT_LFN_LAST is set on the last fragment.
+	uint16_t name1[5];
+	uint8_t  attributes; ///< VFAT_LFN_ATTRIBUTES.
+	uint8_t  type;
+	uint8_t  checksum;   ///< Of the short name.
+	uint16_t name2[6];
+	uint16_t clusterNo;  ///< Zero.
+	uint16_t name3[2];
+} __attribute__((packed)) VfatLfnEntry;
+
+#define VFAT_LFN_ATTRIBUTES    0x0f ///< Read-only, hidden, system and volume label.
+#define VFAT_LFN_LAST          0x40
+#define VFAT_LFN_SEQ_NO_MASK   0x1f
+#define VFAT_LFN_CHARS         13   ///< Per fragment.
+
+/**
+ * \brief The state of a long file name, while its fragments stream past.
+ */
+typedef struct {
+	uint32_t entryNo;  ///< Where the long name starts.
+	uint32_t hash;
+	uint8_t  seqNo;    ///< Of the fragment seen last, zero if there is no valid long name.
+	uint8_t  checksum; ///< Of the short name that the fragments belong to.
+	bool     matches;  ///< Whether the long name equals the name looked for, so far.
+} VfatLfn;
+
+/**
+ * \brief A range of file blocks that is contiguous on disk.
+ */
+typedef struct {
+	uint32_t lba; ///< Partition-relative.
+	uint32_t blockCount;
+} VfatExtent;
+
+/**
+ * \brief The extents of a file's cluster chain, in file order.
+ */
+typedef struct {
+	uint32_t   token;          ///< Of the partition, zero if the map is unused.
+	uint32_t   startClusterNo; ///< Of the file.
+	uint32_t   extentCount;
+	VfatExtent extents[VFAT_MAX_EXTENTS];
+} VfatExtentMap;
+
+/**
+ * \brief The result of looking up a path component in a directory.
+ */
+typedef struct {
+	uint32_t token;        ///< Of the partition, zero if the entry is unused.
+	uint32_t dirClusterNo; ///< Of the directory that was searched.
+	char     name[VFAT_DENTRY_NAME_LENGTH + 1]; ///< The path component that was looked up.
+	bool     found;        ///< False for names that do not exist.
+	bool     directory;
+	uint32_t clusterNo;
+	uint32_t fileSize;
+	char     fileName[FS_MAX_FILE_NAME_LENGTH + 1]; ///< As found in the directory, the long name if there is one.
+} VfatDentry;
+
+/**
+ * \brief A slot in a directory's name hash table.
+ */
+typedef struct {
+	uint32_t hash;    ///< Of the file name, lower case.
+	uint32_t entryNo; ///< Plus one, zero for free slots.
+} VfatDirIndexSlot;
+
+/**
+ * \brief A hash table of the file names in a directory.
+ */
+typedef struct {
+	uint32_t token;        ///< Of the partition, zero if the index is unused.
+	uint32_t dirClusterNo;
+	uint32_t entryCount;
+	VfatDirIndexSlot slots[VFAT_DIR_INDEX_SLOTS];
+} VfatDirIndex;
+
+/**
+ * \brief What a directory scan looks for, and where it puts what it finds.
+ */
+typedef struct {
+	const char   *name;   ///< The name to look up, NULL to list files instead.
+	uint32_t      nameLength;
+	bool          single; ///< Stop after the first file entry.
+	VfatDirIndex *index;  ///< If not NULL, all names are added to it, and the scan continues to the end of the directory.
+	VfatDentry   *result; ///< Filled in when the name is found.
+	FileInfo     *files;  ///< Where the next listed file goes.
+	size_t        skip;   ///< Amount of files to skip before listing.
+	size_t        count;  ///< Amount of files left to list.
+} VfatScan;
+
 static struct {
 	uint32_t token;
 	VfatPartData partData;
 
 } partCache = { .token = 0 };
 
+static VfatExtentMap *extentMaps = NULL; ///< VFAT_EXTENT_MAPS maps in the loader heap.
+static uint32_t       nextExtentMap = 0; ///< The map to replace next.
+
+static VfatDentry *dentryCache = NULL; ///< VFAT_DENTRY_CACHE_SIZE entries in the loader heap.
+static uint32_t    nextDentry  = 0;    ///< The entry to replace next.
+
+static VfatDirIndex *dirIndexes   = NULL; ///< VFAT_DIR_INDEXES indexes in the loader heap.
+static uint32_t      nextDirIndex = 0;    ///< The index to replace next.
+
 /**
  * \brief Convert a cluster number to a block address that contains the FAT entry for that cluster number.
  *
@@ -120,6 +248,42 @@ static inline uint32_t getFatBlockNoForClusterNo(VfatPartData *partData, uint32_
 	return partData->fatStart + clusterNo / (partData->partition->disk->blockSize / 4);
 };
 
+#if CONFIG_VFAT_FAT_MIRROR_SIZE
+/**
+ * \brief Make sure the FAT mirror holds the entry of the given cluster number.
+ *
+ * The chunk that contains the entry is read with a single partRead() if it
+ * has not been read before.
+ *
+ * \param partData
+ * \param clusterNo
+ *
+ * \return whether the entry can be looked up in the mirror
+ */
+static bool loadFatMirror(VfatPartData *partData, uint32_t clusterNo) {
+	if (clusterNo >= partData->fatMirrorEntries)
+		return false;
+
+	uint32_t chunk = clusterNo / (VFAT_FAT_MIRROR_CHUNK_SIZE / 4);
+	if (partData->fatMirrorChunks[chunk])
+		return true;
+
+	uint32_t chunkBlocks = VFAT_FAT_MIRROR_CHUNK_SIZE / partData->partition->disk->blockSize;
+	uint32_t blockNo     = chunk * chunkBlocks;
+
+	if (partRead(
+			partData->partition,
+			(uint32_t)partData->fatMirror + chunk * VFAT_FAT_MIRROR_CHUNK_SIZE,
+			partData->fatStart + blockNo,
+			MIN(chunkBlocks, partData->fatSize - blockNo)
+		))
+		return false; // Fall back to reading single FAT blocks.
+
+	partData->fatMirrorChunks[chunk] = true;
+	return true;
+}
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
 /**
  * \brief Load the FAT block that describes the given cluster number.
  *
@@ -133,6 +297,11 @@ static int seekCluster(VfatPartData *partData, uint32_t clusterNo) {
 	partData->currentClusterNo      = clusterNo;
 	partData->endOfCluster          = false;
 
+#if CONFIG_VFAT_FAT_MIRROR_SIZE
+	if (loadFatMirror(partData, clusterNo))
+		return 0;
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
 	uint32_t fatBlockNo = getFatBlockNoForClusterNo(partData, partData->currentClusterNo);
 	if (partData->currentFatBlockNo == fatBlockNo) {
 		return 0;
@@ -155,9 +324,17 @@ static int seekCluster(VfatPartData *partData, uint32_t clusterNo) {
  * \return a cluster number, or 0 if the end of the cluster chain was reached
  */
 static uint32_t getNextClusterNo(VfatPartData *partData) {
-	uint32_t nextClusterNo = ((uint32_t*)(partData->currentFatBlock))[
-		partData->currentClusterNo % (partData->partition->disk->blockSize / 4)
-	];
+	const uint32_t *fat = (uint32_t*)partData->currentFatBlock;
+	uint32_t index = partData->currentClusterNo % (partData->partition->disk->blockSize / 4);
+
+#if CONFIG_VFAT_FAT_MIRROR_SIZE
+	if (loadFatMirror(partData, partData->currentClusterNo)) {
+		fat   = partData->fatMirror;
+		index = partData->currentClusterNo;
+	}
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
+	uint32_t nextClusterNo = fat[index];
 
 	if ((nextClusterNo & 0x0ffffff8) == 0x0ffffff8)
 		// Anything higher than or equal to 0x0ffffff8 indicates the end of cluster chain.
@@ -168,44 +345,225 @@ static uint32_t getNextClusterNo(VfatPartData *partData) {
 }
 
 /**
- * \brief Reads the next file block belonging to the sought cluster number.
+ * \brief Get the partition LBA of the first block of a cluster.
+ *
+ * \param partData
+ * \param clusterNo
+ *
+ * \return
+ */
+static inline uint32_t getClusterLba(VfatPartData *partData, uint32_t clusterNo) {
+	return partData->dataStart + (clusterNo - 2) * partData->clusterSize;
+}
+
+/**
+ * \brief Find the extent map of a file.
  *
  * \param partData
+ * \param startClusterNo
  *
- * \return zero on success, non-zero on error or EOF
- * \retval 0
+ * \return the map, or NULL if the file's extents are not known
+ */
+static VfatExtentMap *findExtentMap(VfatPartData *partData, uint32_t startClusterNo) {
+	for (uint32_t i=0; extentMaps && i<VFAT_EXTENT_MAPS; i++) {
+		VfatExtentMap *map = &extentMaps[i];
+		if (map->token == partData->partition->token && map->startClusterNo == startClusterNo)
+			return map;
+	}
+	return NULL;
+}
+
+/**
+ * \brief Follow a file's cluster chain once, and remember its extents.
+ *
+ * Nothing is remembered for files that consist of more than VFAT_MAX_EXTENTS
+ * extents, or whose chain cannot be read.
+ *
+ * \param partData
+ * \param clusterNo the file's first cluster
+ * \param blockCount the file's size in blocks, the chain is not followed further
+ */
+static void mapExtents(VfatPartData *partData, uint32_t clusterNo, uint32_t blockCount) {
+	if (findExtentMap(partData, clusterNo))
+		return;
+	if (!extentMaps && !(extentMaps = heapAlloc(VFAT_EXTENT_MAPS * sizeof(VfatExtentMap))))
+		return;
+
+	VfatExtentMap *map = &extentMaps[nextExtentMap];
+	map->token          = 0;
+	map->startClusterNo = clusterNo;
+
+	VfatExtent *extent = NULL;
+	uint32_t    count  = 0;
+
+	for (uint32_t blocks=0; clusterNo >= 2 && blocks < blockCount; blocks += partData->clusterSize) {
+		uint32_t lba = getClusterLba(partData, clusterNo);
+
+		if (extent && extent->lba + extent->blockCount == lba) {
+			extent->blockCount += partData->clusterSize;
+		} else if (count < VFAT_MAX_EXTENTS) {
+			extent = &map->extents[count++];
+			extent->lba        = lba;
+			extent->blockCount = partData->clusterSize;
+		} else {
+			return;
+		}
+
+		if (seekCluster(partData, clusterNo))
+			return;
+		clusterNo = getNextClusterNo(partData);
+	}
+
+	map->extentCount = count;
+	map->token       = partData->partition->token;
+	nextExtentMap    = (nextExtentMap + 1) % VFAT_EXTENT_MAPS;
+}
+
+/**
+ * \brief Read the next file blocks from the file's extent map.
+ *
+ * Reads on from the extent that contains the current position into the
+ * following ones, up to VFAT_READ_VECS extents, with a single partReadv().
+ *
+ * \param partData
+ * \param map
+ * \param fileInfo
+ * \param dest
+ * \param maxBlocks the maximum amount of blocks to read
+ *
+ * \return the amount of blocks read, zero if the position is not in the map,
+ *         or VFAT_READ_ERROR
+ */
+static int readExtentBlocks(
+	VfatPartData *partData,
+	const VfatExtentMap *map,
+	FileInfo *fileInfo,
+	uint32_t dest,
+	uint32_t maxBlocks
+) {
+	uint32_t clusterNo = fileInfo->fsAddressCurrent >> 32;
+	uint32_t blockNo   = (uint32_t)fileInfo->fsAddressCurrent;
+
+	// Past the last cluster in the map, the cluster chain knows what comes next.
+	if (clusterNo < 2 || blockNo >= partData->clusterSize)
+		return 0;
+
+	uint32_t lba = getClusterLba(partData, clusterNo) + blockNo;
+
+	uint32_t i = 0;
+	for (; i<map->extentCount; i++) {
+		if (lba >= map->extents[i].lba && lba < map->extents[i].lba + map->extents[i].blockCount)
+			break;
+	}
+	if (i == map->extentCount)
+		return 0;
+
+	uint32_t  bs         = partData->partition->disk->blockSize;
+	uint32_t  end        = 0;
+	uint32_t  blockCount = 0;
+	uint32_t  vecCount   = 0;
+	DiskIoVec vecs[VFAT_READ_VECS];
+
+	for (;;) {
+		end = map->extents[i].lba + map->extents[i].blockCount;
+		uint32_t count = MIN(maxBlocks - blockCount, end - lba);
+
+		vecs[vecCount].lba        = lba;
+		vecs[vecCount].blockCount = count;
+		vecs[vecCount].dest       = dest + blockCount * bs;
+		vecCount++;
+
+		blockCount += count;
+		lba        += count;
+
+		if (
+			   lba < end
+			|| i + 1 == map->extentCount
+			|| blockCount == maxBlocks
+			|| vecCount == VFAT_READ_VECS
+		)
+			break;
+
+		lba = map->extents[++i].lba;
+	}
+
+	// A single range can still be served from the read-ahead buffer.
+	int ret = vecCount == 1
+		? partRead(partData->partition, dest, vecs[0].lba, blockCount)
+		: partReadv(partData->partition, vecs, vecCount);
+	if (ret)
+		return VFAT_READ_ERROR;
+
+	// Keep the position inside the map: move on to the next extent, or
+	// stay at the end of the last cluster of the last one.
+	bool last = lba == end && i + 1 == map->extentCount;
+	if (lba == end && !last)
+		lba = map->extents[i + 1].lba;
+
+	uint32_t offset = lba - partData->dataStart - last;
+	fileInfo->fsAddressCurrent =
+		  (uint64_t)(offset / partData->clusterSize + 2) << 32
+		| (offset % partData->clusterSize + last);
+
+	return blockCount;
+}
+
+/**
+ * \brief Reads the next file blocks belonging to the sought cluster number.
+ *
+ * Continues into following clusters for as long as they are physically
+ * adjacent to the current one, so that a contiguous run of clusters is read
+ * with a single partRead().
+ *
+ * \param partData
+ * \param dest
+ * \param maxBlocks the maximum amount of blocks to read
+ *
+ * \return the amount of blocks read, or a negative value on error or EOF
  * \retval VFAT_READ_ERROR
  * \retval VFAT_READ_EOF
  */
-static int readClusterBlock(VfatPartData *partData, uint8_t *buffer) {
+static int readClusterBlocks(VfatPartData *partData, uint32_t dest, uint32_t maxBlocks) {
 
 	assert(!partData->endOfCluster);
+	assert(maxBlocks);
 
 	if (partData->currentClusterBlockNo >= partData->clusterSize) {
 		// End of cluster reached, seek to next cluster in chain.
 		uint32_t nextClusterNo = getNextClusterNo(partData);
 		if (nextClusterNo) {
-			seekCluster(partData, nextClusterNo);
+			if (seekCluster(partData, nextClusterNo))
+				return VFAT_READ_ERROR;
 		} else {
 			partData->endOfCluster = true;
 			return VFAT_READ_EOF;
 		}
 	}
 
-	if (partRead(
-			partData->partition,
-			(uint32_t)buffer,
-			(
-				partData->dataStart
-				+ (partData->currentClusterNo - 2) * partData->clusterSize
-				+ partData->currentClusterBlockNo++
-			),
-			1
-		)) {
-		return VFAT_READ_ERROR;
-	} else {
-		return 0;
+	uint32_t startLba = (
+		getClusterLba(partData, partData->currentClusterNo)
+		+ partData->currentClusterBlockNo
+	);
+	uint32_t blockCount = MIN(maxBlocks, partData->clusterSize - partData->currentClusterBlockNo);
+	partData->currentClusterBlockNo += blockCount;
+
+	// Extend the run for as long as the chain stays contiguous on disk.
+	while (blockCount < maxBlocks) {
+		uint32_t nextClusterNo = getNextClusterNo(partData);
+		if (nextClusterNo != partData->currentClusterNo + 1)
+			break;
+		if (seekCluster(partData, nextClusterNo))
+			return VFAT_READ_ERROR;
+
+		uint32_t count = MIN(maxBlocks - blockCount, partData->clusterSize);
+		partData->currentClusterBlockNo = count;
+		blockCount += count;
 	}
+
+	if (partRead(partData->partition, dest, startLba, blockCount))
+		return VFAT_READ_ERROR;
+	else
+		return blockCount;
 }
 
 /**
@@ -223,10 +581,23 @@ static VfatPartData *vfatInit (Partition *part) {
 
 	// No, read the BPB and fill the partition data struct.
 
-	uint8_t bpbBuffer[DISK_MAX_BLOCK_SIZE];
-	if (partRead(part, (uint32_t)bpbBuffer, 0, 1))
+	const BiosParameterBlock *bpb = diskBlockBuffer(DISK_BLOCK_BUFFER_VFAT_BPB);
+	if (partRead(part, (uint32_t)bpb, 0, 1))
+		return NULL;
+
+	// Not every partition we are asked about holds FAT32.
+	if (
+		   bpb->_signature[0] != 0x55
+		|| bpb->_signature[1] != 0xaa
+		|| !bpb->reservedBlocks
+		|| !bpb->fatCount
+		|| !bpb->fatSize
+		|| bpb->_fatSizeShort
+		|| bpb->rootDirEntries
+		|| !bpb->clusterSize
+		|| bpb->clusterSize & (bpb->clusterSize - 1)
+	)
 		return NULL;
-	const BiosParameterBlock *bpb = (BiosParameterBlock*)bpbBuffer;
 
 	if (bpb->blockSize != part->disk->blockSize) {
 		printf("error: Unmatched vfat block size (%u != %u).\n", bpb->blockSize, part->disk->blockSize);
@@ -247,6 +618,18 @@ static VfatPartData *vfatInit (Partition *part) {
 	VfatPartData *partData = &partCache.partData;
 	memset(partData, 0, sizeof(VfatPartData));
 
+	partData->currentFatBlock = diskBlockBuffer(DISK_BLOCK_BUFFER_VFAT_FAT);
+
+#if CONFIG_VFAT_FAT_MIRROR_SIZE
+	static uint32_t *fatMirror = NULL;
+	if (!fatMirror)
+		fatMirror = heapAlloc(CONFIG_VFAT_FAT_MIRROR_SIZE);
+
+	// Without a mirror, every FAT block is read when it is needed.
+	partData->fatMirror        = fatMirror;
+	partData->fatMirrorEntries = fatMirror ? MIN(bpb->fatSize * bpb->blockSize, CONFIG_VFAT_FAT_MIRROR_SIZE) / 4 : 0;
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
 	partData->partition      = part;
 	partData->fatStart       = bpb->reservedBlocks;
 	partData->fatSize        = bpb->fatSize;
@@ -262,7 +645,19 @@ static VfatPartData *vfatInit (Partition *part) {
 }
 
 bool vfatDetect (Partition *part) {
-	if (part->type != 0x0c)
+	static const uint8_t basicData[16] = GPT_TYPE_BASIC_DATA;
+	static const uint8_t efiSystem[16] = GPT_TYPE_EFI_SYSTEM;
+
+	// GPT basic data partitions may also hold NTFS, and partitions without a
+	// type anything at all. vfatInit() checks the BPB.
+	if (
+		   part->type != 0x0c
+		&& part->type != DISK_PART_TYPE_NONE
+		&& !(
+			   part->type == MBR_SYSTEM_ID_GPT
+			&& (memeq(part->typeGuid, basicData, 16) || memeq(part->typeGuid, efiSystem, 16))
+		)
+	)
 		return false;
 
 	if (!vfatInit(part))
@@ -272,44 +667,204 @@ bool vfatDetect (Partition *part) {
 }
 
 /**
- * \brief Traverse a directory tree and fill the given FileInfo struct with the requested file.
+ * \brief Hash one character of a file name, at the given position.
+ *
+ * The hashes of all characters of a name are added up, so they can be
+ * hashed in any order.
+ *
+ * \param ch
+ * \param pos
+ *
+ * \return
+ */
+static uint32_t hashNameChar(uint16_t ch, uint32_t pos) {
+	if (ch >= 'A' && ch <= 'Z')
+		ch += 'a' - 'A';
+
+	uint32_t x = (pos << 16 | ch) * 0x9e3779b1;
+	return x ^ x >> 16;
+}
+
+static uint32_t hashName(const char *name) {
+	uint32_t hash = 0;
+	for (uint32_t i=0; name[i]; i++)
+		hash += hashNameChar((uint8_t)name[i], i);
+	return hash;
+}
+
+/**
+ * \brief Add a file entry to a directory index.
+ *
+ * Entries that do not fit are counted but not added, an index that has
+ * filled up is not used.
+ *
+ * \param index
+ * \param hash the hash of the file name
+ * \param entryNo the directory entry where the file entry starts
+ */
+static void addToDirIndex(VfatDirIndex *index, uint32_t hash, uint32_t entryNo) {
+	if (++index->entryCount > VFAT_DIR_INDEX_MAX_ENTRIES)
+		return;
+
+	uint32_t i = hash % VFAT_DIR_INDEX_SLOTS;
+	while (index->slots[i].entryNo)
+		i = (i + 1) % VFAT_DIR_INDEX_SLOTS;
+
+	index->slots[i].hash    = hash;
+	index->slots[i].entryNo = entryNo + 1;
+}
+
+/**
+ * \brief Fill in a FileInfo struct, apart from its name.
  *
  * \param partData
  * \param fileInfo
- * \param rootCluster
- * \param path
+ * \param clusterNo
+ * \param size
+ * \param directory
+ */
+static void fillFileInfo(VfatPartData *partData, FileInfo *fileInfo, uint32_t clusterNo, uint32_t size, bool directory) {
+	fileInfo->partition        = partData->partition;
+	fileInfo->fsAddressStart   = clusterNo;
+	fileInfo->fsAddressCurrent = (uint64_t)clusterNo << 32;
+	fileInfo->size             = size;
+
+	fileInfo->type =
+		directory
+		? FILE_TYPE_DIRECTORY
+		: FILE_TYPE_REGULAR;
+}
+
+static inline char toLower(uint16_t ch) {
+	return ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch;
+}
+
+/**
+ * \brief Compute the checksum of a short name, as stored in its long name fragments.
+ */
+static uint8_t getShortNameChecksum(const VfatDirEntry *dentry) {
+	const uint8_t *name = (const uint8_t*)dentry; // Name and extension.
+
+	uint8_t sum = 0;
+	for (uint32_t i=0; i<11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+/**
+ * \brief Process one long file name fragment.
+ *
+ * The fragment is compared to the name that is looked for directly, and is
+ * hashed, so no copy of the long name is needed. Fragments that are out of
+ * sequence or belong to another short name invalidate the long name.
+ *
+ * \param lfn
+ * \param entry
+ * \param entryNo
+ * \param scan the name looked for
+ * \param[out] nameOut if not NULL, the ASCII characters of the long name are
+ *                     put here, others as '?'
+ */
+static void readLfnEntry(VfatLfn *lfn, const VfatLfnEntry *entry, uint32_t entryNo, const VfatScan *scan, char *nameOut) {
+	const char *name = scan->name;
+	uint8_t seqNo = entry->seqNo & VFAT_LFN_SEQ_NO_MASK;
+
+	if (entry->seqNo & VFAT_LFN_LAST) {
+		lfn->entryNo  = entryNo;
+		lfn->hash     = 0;
+		lfn->checksum = entry->checksum;
+		lfn->matches  = !!name;
+		if (nameOut)
+			memset(nameOut, 0, FS_MAX_FILE_NAME_LENGTH + 1);
+
+	} else if (!lfn->seqNo || seqNo != lfn->seqNo - 1 || entry->checksum != lfn->checksum) {
+		lfn->seqNo = 0;
+		return;
+	}
+
+	lfn->seqNo = seqNo;
+
+	uint32_t pos    = (seqNo - 1) * VFAT_LFN_CHARS;
+	uint32_t length = pos + VFAT_LFN_CHARS; ///< Unless terminated within the fragment.
+
+	// Offsets of the characters in the entry.
+	static const uint8_t charOffsets[VFAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+	for (uint32_t i=0; i<VFAT_LFN_CHARS; i++, pos++) {
+		uint16_t ch = *(const uint16_t*)((const uint8_t*)entry + charOffsets[i]);
+
+		if (!ch || ch == 0xffff) {
+			// Terminated, and padded.
+			length = MIN(length, pos);
+			continue;
+		}
+
+		lfn->hash += hashNameChar(ch, pos);
+
+		if (name && (pos >= scan->nameLength || ch >= 0x80 || toLower(ch) != toLower(name[pos])))
+			lfn->matches = false;
+		if (nameOut && pos < FS_MAX_FILE_NAME_LENGTH)
+			nameOut[pos] = ch < 0x80 ? ch : '?';
+	}
+
+	// The fragment that comes first holds the end of the name.
+	if (entry->seqNo & VFAT_LFN_LAST && length != scan->nameLength)
+		lfn->matches = false;
+}
+
+/**
+ * \brief Scan a directory for a name, or list its files.
+ *
+ * \param partData
+ * \param dirClusterNo
+ * \param entryNo the directory entry to start at
+ * \param scan what to look for, and where to put what is found
  *
  * \return zero on success, non-zero on failure
- * \retval FS_SUCCESS
+ * \retval FS_SUCCESS the name was found, or the listing was filled in
  * \retval FS_IO_ERROR
  * \retval FS_FILE_NOT_FOUND
  */
-static int getFile(VfatPartData *partData, FileInfo *fileInfo, uint32_t rootCluster, const char *path) {
-	size_t nextPathPartLength = strchr(path, '/') - path;
-	char curPathPart[nextPathPartLength + 1];
-	memset( curPathPart, 0,    sizeof(curPathPart));
-	strncpy(curPathPart, path, sizeof(curPathPart)-1);
+static int scanDir(VfatPartData *partData, uint32_t dirClusterNo, uint32_t entryNo, VfatScan *scan) {
+	uint32_t blockSize       = partData->partition->disk->blockSize;
+	uint32_t entriesPerBlock = blockSize / sizeof(VfatDirEntry);
+	int      notFound        = scan->name ? FS_FILE_NOT_FOUND : FS_SUCCESS;
 
-	if (seekCluster(partData, rootCluster))
+	if (seekCluster(partData, dirClusterNo))
 		return FS_IO_ERROR;
 
+	// Skip to the cluster and block that hold the first entry.
+	for (uint32_t i=entryNo / entriesPerBlock / partData->clusterSize; i; i--) {
+		uint32_t nextClusterNo = getNextClusterNo(partData);
+		if (!nextClusterNo)
+			return notFound;
+		if (seekCluster(partData, nextClusterNo))
+			return FS_IO_ERROR;
+	}
+	partData->currentClusterBlockNo = entryNo / entriesPerBlock % partData->clusterSize;
+
 	// Read the containing directory.
 
-	uint8_t buffer[partData->partition->disk->blockSize];
-	VfatDirEntry dentry;
-	memset(&dentry, 0, sizeof(VfatDirEntry));
+	uint8_t *buffer = diskBlockBuffer(DISK_BLOCK_BUFFER_VFAT_DIR);
 	int ret;
 	bool endOfDirectory = false;
+	bool found          = false;
+
+	VfatLfn lfn;
+	memset(&lfn, 0, sizeof(lfn));
 
-	while ((ret = readClusterBlock(partData, buffer)) != VFAT_READ_EOF && !endOfDirectory) {
+	// The long name of the file entry being read, when looking up a name.
+	char lfnName[FS_MAX_FILE_NAME_LENGTH + 1];
+
+	while ((ret = readClusterBlocks(partData, (uint32_t)buffer, 1)) != VFAT_READ_EOF && !endOfDirectory) {
 		if (ret == VFAT_READ_ERROR) {
-			printf("warning: Could not read cluster %#08x\n", rootCluster);
+			printf("warning: Could not read cluster %#08x\n", dirClusterNo);
 			return FS_IO_ERROR;
 		}
 
 		// For each directory entry...
 
-		for (uint32_t i=0; i<partData->partition->disk->blockSize; i += sizeof(VfatDirEntry)) {
+		for (uint32_t i=entryNo % entriesPerBlock * sizeof(VfatDirEntry); i<blockSize; i += sizeof(VfatDirEntry), entryNo++) {
 			VfatDirEntry *dentry = (VfatDirEntry*)&buffer[i];
 			if (dentry->name[0] == 0) {
 				// Entry is available, no more entries in this directory.
@@ -318,9 +873,21 @@ static int getFile(VfatPartData *partData, FileInfo *fileInfo, uint32_t rootClus
 				break;
 			} else if (dentry->name[0] == '\xe5') {
 				// Entry is available.
+				lfn.seqNo = 0;
 				continue;
 			}
 
+			// Listed files get their long name written straight into their FileInfo.
+			bool listing = !scan->name && scan->count && !scan->skip;
+
+			if (((VfatLfnEntry*)dentry)->attributes == VFAT_LFN_ATTRIBUTES) {
+				readLfnEntry(&lfn, (VfatLfnEntry*)dentry, entryNo, scan, listing ? scan->files->name : scan->name ? lfnName : NULL);
+				continue;
+			}
+
+			bool hasLfn = lfn.seqNo == 1 && lfn.checksum == getShortNameChecksum(dentry);
+			lfn.seqNo = 0;
+
 			if (dentry->attrVolumeLabel || dentry->attrDisk)
 				// We are only interested in directories and regular files.
 				continue;
@@ -337,37 +904,205 @@ static int getFile(VfatPartData *partData, FileInfo *fileInfo, uint32_t rootClus
 			}
 			toLowerCase(fileName);
 
-			if (streq(fileName, curPathPart)) {
-				// Found it!
-				uint32_t clusterNo = dentry->clusterNoHigh << 16 | dentry->clusterNoLow;
+			// Both names lead to the start of the file entry.
+			if (scan->index) {
+				addToDirIndex(scan->index, hashName(fileName), hasLfn ? lfn.entryNo : entryNo);
+				if (hasLfn)
+					addToDirIndex(scan->index, lfn.hash, lfn.entryNo);
+			}
+
+			uint32_t clusterNo = dentry->clusterNoHigh << 16 | dentry->clusterNoLow;
 
-				if (streq(curPathPart, path)) {
-					// This is the requested file.
-					strncpy(fileInfo->name, fileName, sizeof(fileInfo->name));
+			if (scan->name && !found && (streq(fileName, scan->name) || (hasLfn && lfn.matches))) {
+				// Found it!
+				found = true;
+				scan->result->found     = true;
+				scan->result->directory = dentry->attrDirectory;
+				scan->result->clusterNo = clusterNo;
+				scan->result->fileSize  = dentry->fileSize;
+				strncpy(scan->result->fileName, hasLfn ? lfnName : fileName, sizeof(scan->result->fileName)-1);
+			}
 
-					fileInfo->partition        = partData->partition;
-					fileInfo->fsAddressStart   = clusterNo;
-					fileInfo->fsAddressCurrent = (uint64_t)clusterNo << 32;
-					fileInfo->size             = dentry->fileSize;
+			if (listing) {
+				FileInfo *file = scan->files++;
+				scan->count--;
 
-					fileInfo->type =
-						dentry->attrDirectory
-						? FILE_TYPE_DIRECTORY
-						: FILE_TYPE_REGULAR;
+				if (!hasLfn)
+					strncpy(file->name, fileName, sizeof(file->name));
+				fillFileInfo(partData, file, clusterNo, dentry->fileSize, dentry->attrDirectory);
 
+				if (!scan->count)
 					return FS_SUCCESS;
 
-				} else {
-					// We need to go deeper!
-					/// @todo Prevent possible stack overflow in looping / very deep directories.
-					///       For now we will call this a user error ;-)
-					return getFile(partData, fileInfo, clusterNo, path + strlen(curPathPart) + 1);
-				}
+			} else if (!scan->name && scan->skip) {
+				scan->skip--;
 			}
+
+			if ((found && !scan->index) || scan->single)
+				return found ? FS_SUCCESS : notFound;
 		}
 	}
 
-	return FS_FILE_NOT_FOUND;
+	return found ? FS_SUCCESS : notFound;
+}
+
+/**
+ * \brief Look up a name in a directory.
+ *
+ * The first lookup in a directory scans all of it, and builds an index of
+ * its file names. Later lookups only read the entries whose name hash
+ * matches.
+ *
+ * \param partData
+ * \param dirClusterNo
+ * \param name
+ * \param[out] result filled in when the name is found
+ *
+ * \return zero on success, non-zero on failure
+ * \retval FS_SUCCESS
+ * \retval FS_IO_ERROR
+ * \retval FS_FILE_NOT_FOUND
+ */
+static int findDirEntry(VfatPartData *partData, uint32_t dirClusterNo, const char *name, VfatDentry *result) {
+	uint32_t token = partData->partition->token;
+
+	VfatScan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.name       = name;
+	scan.nameLength = strlen(name);
+	scan.result     = result;
+
+	if (!dirIndexes && !(dirIndexes = heapAlloc(VFAT_DIR_INDEXES * sizeof(VfatDirIndex))))
+		return scanDir(partData, dirClusterNo, 0, &scan);
+
+	for (uint32_t i=0; i<VFAT_DIR_INDEXES; i++) {
+		VfatDirIndex *index = &dirIndexes[i];
+		if (index->token != token || index->dirClusterNo != dirClusterNo)
+			continue;
+
+		uint32_t hash = hashName(name);
+		scan.single   = true;
+		for (uint32_t j=hash % VFAT_DIR_INDEX_SLOTS; index->slots[j].entryNo; j = (j + 1) % VFAT_DIR_INDEX_SLOTS) {
+			if (index->slots[j].hash != hash)
+				continue;
+
+			int ret = scanDir(partData, dirClusterNo, index->slots[j].entryNo - 1, &scan);
+			if (ret != FS_FILE_NOT_FOUND)
+				return ret;
+		}
+		return FS_FILE_NOT_FOUND;
+	}
+
+	VfatDirIndex *index = &dirIndexes[nextDirIndex];
+	nextDirIndex = (nextDirIndex + 1) % VFAT_DIR_INDEXES;
+	farzero((uint32_t)index, sizeof(VfatDirIndex));
+
+	// Directories too large for an index are scanned for every lookup.
+	scan.index = index;
+	int ret = scanDir(partData, dirClusterNo, 0, &scan);
+	if (ret != FS_IO_ERROR && index->entryCount <= VFAT_DIR_INDEX_MAX_ENTRIES) {
+		index->token        = token;
+		index->dirClusterNo = dirClusterNo;
+	}
+
+	return ret;
+}
+
+/**
+ * \brief Look up a name in a directory, through the dentry cache.
+ *
+ * Names that are too long for the cache are looked up every time.
+ *
+ * \param partData
+ * \param dirClusterNo
+ * \param name
+ * \param[out] dentry filled in when the name is found
+ *
+ * \return zero on success, non-zero on failure
+ * \retval FS_SUCCESS
+ * \retval FS_IO_ERROR
+ * \retval FS_FILE_NOT_FOUND
+ */
+static int lookupDentry(VfatPartData *partData, uint32_t dirClusterNo, const char *name, VfatDentry *dentry) {
+	uint32_t token = partData->partition->token;
+
+	if (strlen(name) > VFAT_DENTRY_NAME_LENGTH)
+		return findDirEntry(partData, dirClusterNo, name, dentry);
+	if (!dentryCache && !(dentryCache = heapAlloc(VFAT_DENTRY_CACHE_SIZE * sizeof(VfatDentry))))
+		return findDirEntry(partData, dirClusterNo, name, dentry);
+
+	for (uint32_t i=0; i<VFAT_DENTRY_CACHE_SIZE; i++) {
+		VfatDentry *cached = &dentryCache[i];
+		if (
+			   cached->token        == token
+			&& cached->dirClusterNo == dirClusterNo
+			&& streq(cached->name, name)
+		) {
+			farcpy((uint32_t)dentry, (uint32_t)cached, sizeof(VfatDentry));
+			return dentry->found ? FS_SUCCESS : FS_FILE_NOT_FOUND;
+		}
+	}
+
+	int ret = findDirEntry(partData, dirClusterNo, name, dentry);
+
+	if (ret == FS_SUCCESS || ret == FS_FILE_NOT_FOUND) {
+		dentry->token        = token;
+		dentry->dirClusterNo = dirClusterNo;
+		strncpy(dentry->name, name, VFAT_DENTRY_NAME_LENGTH);
+		farcpy((uint32_t)&dentryCache[nextDentry], (uint32_t)dentry, sizeof(VfatDentry));
+		nextDentry = (nextDentry + 1) % VFAT_DENTRY_CACHE_SIZE;
+	}
+
+	return ret;
+}
+
+/**
+ * \brief Traverse a directory tree and fill the given FileInfo struct with the requested file.
+ *
+ * \param partData
+ * \param fileInfo
+ * \param rootCluster
+ * \param path
+ *
+ * \return zero on success, non-zero on failure
+ * \retval FS_SUCCESS
+ * \retval FS_IO_ERROR
+ * \retval FS_FILE_NOT_FOUND
+ */
+static int getFile(VfatPartData *partData, FileInfo *fileInfo, uint32_t rootCluster, const char *path) {
+	size_t nextPathPartLength = strchr(path, '/') - path;
+	char curPathPart[nextPathPartLength + 1];
+	memset( curPathPart, 0,    sizeof(curPathPart));
+	strncpy(curPathPart, path, sizeof(curPathPart)-1);
+
+	VfatDentry dentry;
+	memset(&dentry, 0, sizeof(VfatDentry));
+
+	int ret = lookupDentry(partData, rootCluster, curPathPart, &dentry);
+	if (ret != FS_SUCCESS)
+		return ret;
+
+	if (streq(curPathPart, path)) {
+		// This is the requested file.
+		strncpy(fileInfo->name, dentry.fileName, sizeof(fileInfo->name));
+
+		fillFileInfo(partData, fileInfo, dentry.clusterNo, dentry.fileSize, dentry.directory);
+
+		if (fileInfo->type == FILE_TYPE_REGULAR)
+			mapExtents(
+				partData, dentry.clusterNo,
+				(dentry.fileSize + partData->partition->disk->blockSize - 1)
+				/ partData->partition->disk->blockSize
+			);
+
+		return FS_SUCCESS;
+
+	} else {
+		// We need to go deeper!
+		/// @todo Prevent possible stack overflow in looping / very deep directories.
+		///       For now we will call this a user error ;-)
+		return getFile(partData, fileInfo, dentry.clusterNo, path + strlen(curPathPart) + 1);
+	}
 }
 
 int vfatGetFile(Partition *part, FileInfo *fileInfo, const char *path) {
@@ -386,29 +1121,59 @@ int vfatGetFile(Partition *part, FileInfo *fileInfo, const char *path) {
 }
 
 int vfatReadFileBlock(FileInfo *fileInfo, uint8_t *buffer) {
+	int ret = vfatReadFileBlocks(fileInfo, (uint32_t)buffer, 1);
+	return ret < 0 ? ret : FS_SUCCESS;
+}
+
+int vfatReadFileBlocks(FileInfo *fileInfo, uint32_t dest, uint32_t blockCount) {
 	VfatPartData *partData;
 	if (!(partData = vfatInit(fileInfo->partition)))
 		return FS_INTERNAL_ERROR;
 
+	const VfatExtentMap *map = findExtentMap(partData, fileInfo->fsAddressStart);
+	if (map) {
+		int ret = readExtentBlocks(partData, map, fileInfo, dest, blockCount);
+		if (ret == VFAT_READ_ERROR)
+			return FS_IO_ERROR;
+		else if (ret)
+			return ret;
+	}
+
 	if (seekCluster(partData, fileInfo->fsAddressCurrent >> 32))
 		return FS_INTERNAL_ERROR;
 
 	partData->currentClusterBlockNo = (uint32_t)fileInfo->fsAddressCurrent;
 
-	if (readClusterBlock(partData, buffer)) {
+	int ret = readClusterBlocks(partData, dest, blockCount);
+	if (ret < 0) {
 		return FS_IO_ERROR;
 	} else {
 		fileInfo->fsAddressCurrent = (uint64_t)partData->currentClusterNo << 32 | partData->currentClusterBlockNo;
-		return FS_SUCCESS;
+		return ret;
 	}
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-
 int vfatReadDir(FileInfo *fileInfo, FileInfo files[], size_t offset, size_t count) {
-	panic("VFAT readDir() unimplemented.");
-	return 0;
-}
+	VfatPartData *partData;
+	if (!(partData = vfatInit(fileInfo->partition)))
+		return FS_INTERNAL_ERROR;
+
+	VfatScan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.files = files;
+	scan.skip  = offset;
+	scan.count = count;
 
-#pragma GCC diagnostic pop
+	if (!count)
+		return 0;
+
+	// ".." entries refer to the root directory as cluster 0.
+	int ret = scanDir(
+		partData,
+		fileInfo->fsAddressStart ? fileInfo->fsAddressStart : partData->rootDirCluster,
+		0,
+		&scan
+	);
+
+	return ret == FS_SUCCESS ? (int)(scan.files - files) : ret;
+}
@@ -5,7 +5,8 @@
  * \copyright Copyright (c) 2015, Chris Smeele. All rights reserved.
  * \license   MIT. See LICENSE for the full license text.
  *
- * @todo Implement LFN support (vfat.h is now actually fat32.h).
+ * Long file names are matched case-insensitively, on their ASCII characters.
+ * Other characters are listed as '?'.
  */
 #ifndef _FS_VFAT_H
 #define _FS_VFAT_H
@@ -13,6 +14,15 @@
 #include "common.h"
 #include "fs/fs.h"
 
+#ifndef CONFIG_VFAT_FAT_MIRROR_SIZE
+/// Heap bytes for a copy of the current partition's FAT, zero disables it.
+/// FAT entries beyond the mirror are read one block at a time.
+#define CONFIG_VFAT_FAT_MIRROR_SIZE (2 * 1024 * 1024)
+#endif /* CONFIG_VFAT_FAT_MIRROR_SIZE */
+
+/// The FAT mirror is filled in chunks of this many bytes, as they are needed.
+#define VFAT_FAT_MIRROR_CHUNK_SIZE 0x8000
+
 /*
  * For VFAT, the address fields of the FileInfo struct are filled in as follows:
  *
@@ -27,6 +37,8 @@ int vfatGetFile(Partition *part, FileInfo *fileInfo, const char *path);
 
 int vfatReadFileBlock(FileInfo *fileInfo, uint8_t *buffer);
 
+int vfatReadFileBlocks(FileInfo *fileInfo, uint32_t dest, uint32_t blockCount);
+
 int vfatReadDir(FileInfo *fileInfo, FileInfo files[], size_t offset, size_t count);
 
 #endif /* _FS_VFAT_H */
@@ -0,0 +1,60 @@
+/**
+ * \file
+ * \brief     Loader heap in extended memory.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "heap.h"
+#include "memmap.h"
+#include "far.h"
+
+static uint32_t heapNext = 0;
+static uint32_t heapEnd  = 0;
+
+int initHeap() {
+	uint64_t heapStart = 0;
+
+	// The memory map itself lives in the heap, so read the BIOS map directly.
+	MemMapRegion region;
+	uint32_t contVal = 0;
+
+	do {
+		if (readBiosMemMapRegion(&contVal, &region))
+			return -1;
+
+		if (region.type != MEMORY_REGION_TYPE_FREE || region.start < 0x100000)
+			continue;
+
+		// Take the end of the region, but stay within 32-bit pointer range.
+		uint64_t end   = MIN(region.start + region.length, 0xfffff000) & ~0xfffULL;
+		uint64_t start = end - CONFIG_HEAP_SIZE;
+
+		if (end > region.start + CONFIG_HEAP_SIZE && start > heapStart)
+			heapStart = start;
+	} while (contVal);
+
+	if (!heapStart)
+		return -1;
+
+	reserveMem(heapStart, CONFIG_HEAP_SIZE);
+
+	heapNext = heapStart;
+	heapEnd  = heapStart + CONFIG_HEAP_SIZE;
+
+	return 0;
+}
+
+void *heapAlloc(uint32_t size) {
+	size = (size + 15) & ~15;
+
+	if (!heapNext || size > heapEnd - heapNext)
+		return NULL;
+
+	uint32_t mem = heapNext;
+	heapNext += size;
+
+	farzero(mem, size);
+
+	return (void*)mem;
+}
@@ -0,0 +1,45 @@
+/**
+ * \file
+ * \brief     Loader heap in extended memory.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#ifndef _HEAP_H
+#define _HEAP_H
+
+#include "common.h"
+
+#ifndef CONFIG_HEAP_SIZE
+#define CONFIG_HEAP_SIZE (8 * 1024 * 1024)
+#endif /* CONFIG_HEAP_SIZE */
+
+/**
+ * \brief Set up the loader heap.
+ *
+ * Takes CONFIG_HEAP_SIZE bytes from the end of the highest free memory region
+ * below 4G and reserves them in the memory map. Must be called after
+ * enableUnrealMode(), and before makeMemMap() and anything else that
+ * allocates.
+ *
+ * \return zero on success, non-zero if no suitable region exists
+ */
+int initHeap();
+
+/**
+ * \brief Allocate zeroed memory from the loader heap.
+ *
+ * Heap memory lives above 1M and can only be reached through 32-bit
+ * pointers in unreal mode. As all segment registers have a 4G limit, and
+ * block copies go through memcpy() and memset(), it can be used like any
+ * other memory, except that it cannot be passed to BIOS calls.
+ *
+ * Allocations are never freed.
+ *
+ * \param size
+ *
+ * \return a pointer to the allocated memory, or NULL if the heap is exhausted
+ */
+void *heapAlloc(uint32_t size);
+
+#endif /* _HEAP_H */
@@ -25,11 +25,20 @@ void outw(uint16_t port, uint16_t value) {
 	);
 }
 
+void outl(uint16_t port, uint32_t value) {
+	asm volatile (
+		"outl %0, %1"
+		:
+		: "a" (value),
+		  "d" (port)
+	);
+}
+
 uint8_t inb(uint16_t port) {
 	uint8_t value;
 
 	asm volatile (
-		"outb %0, %1"
+		"inb %1, %0"
 		: "=a" (value)
 		: "d" (port)
 	);
@@ -49,6 +58,18 @@ uint16_t inw(uint16_t port) {
 	return value;
 }
 
+uint32_t inl(uint16_t port) {
+	uint32_t value;
+
+	asm volatile (
+		"inl %1, %0"
+		: "=a" (value)
+		: "d" (port)
+	);
+
+	return value;
+}
+
 void iowait() {
 	outb(0x80, 0);
 }
@@ -26,6 +26,14 @@ void outb(uint16_t port, uint8_t value);
  */
 void outw(uint16_t port, uint16_t value);
 
+/**
+ * \brief Write a dword to an I/O port.
+ *
+ * \param port
+ * \param value
+ */
+void outl(uint16_t port, uint32_t value);
+
 /**
  * \brief Read a byte from an I/O port.
  *
@@ -44,6 +52,15 @@ uint8_t inb(uint16_t port);
  */
 uint16_t inw(uint16_t port);
 
+/**
+ * \brief Read a dword from an I/O port.
+ *
+ * \param port
+ *
+ * \return
+ */
+uint32_t inl(uint16_t port);
+
 /**
  * \brief Wait for an I/O port operation to complete.
  */
@@ -7,62 +7,115 @@
  */
 #include "memmap.h"
 #include "console.h"
+#include "heap.h"
+#include "far.h"
 
-MemMap memMap;
+MemMap memMap = { .regions = NULL, .regionCount = 0 };
+
+static struct {
+	uint64_t start;
+	uint64_t length;
+} reservedRegions[MEMMAP_MAX_RESERVED];
+static uint32_t reservedRegionCount = 0;
+
+void reserveMem(uint64_t start, uint64_t length) {
+	assert(reservedRegionCount < MEMMAP_MAX_RESERVED);
+
+	reservedRegions[reservedRegionCount].start  = start;
+	reservedRegions[reservedRegionCount].length = length;
+	reservedRegionCount++;
+}
 
 bool isMemAvailable(uint64_t start, uint64_t length) {
 	assert(start + length > start);
 
-	for (uint32_t i=0; i<memMap.regionCount; i++) {
-		MemMapRegion region = memMap.regions[i];
+	for (uint32_t i=0; i<reservedRegionCount; i++) {
 		if (
-			   region.start <= start
-			&& region.start + region.length >= start + length
-			&& region.type == MEMORY_REGION_TYPE_FREE
-		) {
-			// Only return true if a single free mem-map entry exist that covers
-			// the entire queried region.
-			return true;
-			// This assumes no overlapping entries exist.
-		}
+			   start          < reservedRegions[i].start + reservedRegions[i].length
+			&& start + length > reservedRegions[i].start
+		)
+			return false;
 	}
-	return false;
+
+	// Find the last region that starts at or before the queried region.
+	uint32_t low  = 0;
+	uint32_t high = memMap.regionCount;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (memMap.regions[mid].start <= start)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (!low)
+		return false;
+
+	// Only return true if a single free mem-map entry covers the entire
+	// queried region. This assumes no overlapping entries exist.
+	MemMapRegion *region = &memMap.regions[low - 1];
+	return region->start + region->length >= start + length
+	    && region->type == MEMORY_REGION_TYPE_FREE;
+}
+
+int readBiosMemMapRegion(uint32_t *cont, MemMapRegion *region) {
+	do {
+		uint32_t success = 0x0000e820;
+		asm volatile (
+			"int $0x15\n"
+			"jnc .no_e820_error\n"
+			"xor %%eax, %%eax\n"
+			".no_e820_error:\n"
+			: "+b" (*cont),
+			  "+a" (success)
+			: "c" (20), // Buffer size: start, length and type, no ACPI 3.0 attributes.
+			  "d" (0x534d4150), // "SMAP".
+			  "D" (&region->start)
+			: "cc", "memory"
+		);
+
+		if (!success)
+			return 1;
+
+		// Skip zero-length entries.
+	} while (!region->length && *cont);
+
+	region->_size = 20;
+
+	return 0;
 }
 
 int makeMemMap() {
-	memset(&memMap, 0, sizeof(MemMap));
+	MemMapRegion region;
 	uint32_t contVal = 0;
+	uint32_t count   = 0;
 
-	for (uint32_t i=0; i<MEMMAP_MAX_REGIONS; i++) {
-		do {
-			uint32_t success = 0x0000e820;
-			asm volatile (
-				"int $0x15\n"
-				"jnc .no_e820_error\n"
-				"xor %%eax, %%eax\n"
-				".no_e820_error:\n"
-				: "+b" (contVal),
-				  "+a" (success)
-				: "c" (0x00000020), // Buffer size.
-				  "d" (0x534d4150), // "SMAP".
-				  "D" (&memMap.regions[i].start)
-				: "cc", "memory"
-			);
-
-			if (!success)
-				return 1;
-
-			// Skip zero-length entries.
-		} while (!memMap.regions[i].length);
-
-		memMap.regions[i]._size = 20;
-		memMap.regionCount++;
-
-		if (contVal == 0)
-			// Indicates end of list.
-			return 0;
-	}
+	// Count the entries first, so that the map can be allocated at its full size.
+	do {
+		if (readBiosMemMapRegion(&contVal, &region))
+			return 1;
+		if (region.length)
+			count++;
+	} while (contVal);
+
+	memMap.regions     = heapAlloc(count * sizeof(MemMapRegion));
+	memMap.regionCount = 0;
+	if (!memMap.regions)
+		return 1;
+
+	do {
+		if (readBiosMemMapRegion(&contVal, &region))
+			return 1;
+		if (!region.length)
+			continue;
+		if (memMap.regionCount == count)
+			break; // The BIOS returned more entries this time.
+
+		// Insertion sort by start address, E820 maps are short and mostly sorted.
+		uint32_t i = memMap.regionCount++;
+		for (; i && memMap.regions[i-1].start > region.start; i--)
+			farcpy((uint32_t)&memMap.regions[i], (uint32_t)&memMap.regions[i-1], sizeof(MemMapRegion));
+		farcpy((uint32_t)&memMap.regions[i], (uint32_t)&region, sizeof(MemMapRegion));
+	} while (contVal);
 
-	printf("warning: Memory map truncated.\n");
 	return 0;
 }
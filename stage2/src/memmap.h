@@ -10,7 +10,12 @@
 
 #include "common.h"
 
-#define MEMMAP_MAX_REGIONS 12
+/**
+ * \brief Amount of regions reserveMem() can hold.
+ *
+ * The heap and the three disk buffers take four, the rest is headroom.
+ */
+#define MEMMAP_MAX_RESERVED 8
 
 #define MEMORY_REGION_TYPE_FREE             1
 #define MEMORY_REGION_TYPE_RESERVED         2
@@ -26,7 +31,7 @@ typedef struct {
 } __attribute__((packed)) MemMapRegion;
 
 typedef struct {
-	MemMapRegion regions[MEMMAP_MAX_REGIONS];
+	MemMapRegion *regions; ///< In the loader heap, sorted by start address.
 	uint32_t regionCount;
 } MemMap;
 
@@ -35,6 +40,8 @@ extern MemMap memMap;
 /**
  * \brief Checks if a memory region is available according to the BIOS.
  *
+ * Uses a binary search on the sorted memory map.
+ *
  * \param start
  * \param length
  *
@@ -42,10 +49,38 @@ extern MemMap memMap;
  */
 bool isMemAvailable(uint64_t start, uint64_t length);
 
+/**
+ * \brief Marks a memory region as in use by the loader.
+ *
+ * Reserved regions are not passed on to the kernel as such, but
+ * isMemAvailable() will refuse any region that overlaps them.
+ *
+ * \param start
+ * \param length
+ */
+void reserveMem(uint64_t start, uint64_t length);
+
+/**
+ * \brief Read one entry of the BIOS memory map (int 15h, eax=0xe820).
+ *
+ * Zero-length entries are skipped.
+ *
+ * \param cont continuation value, zero for the first entry. Set to zero
+ *             after the last entry
+ * \param region receives the entry, must be in the first 64K
+ *
+ * \return zero on success, non-zero if the BIOS call is unsupported
+ */
+int readBiosMemMapRegion(uint32_t *cont, MemMapRegion *region);
+
 /**
  * \brief Makes a memory map using BIOS calls.
  *
- * \return zero on success, non-zero if the int 15h 0xe820 BIOS call is unsupported.
+ * The map is allocated from the loader heap, so initHeap() must be called
+ * first.
+ *
+ * \return zero on success, non-zero if the int 15h 0xe820 BIOS call is
+ *         unsupported or the heap is exhausted
  */
 int makeMemMap();
 
@@ -10,14 +10,67 @@
 #include "disk/disk.h"
 #include "vbe.h"
 #include "config.h"
+#include "heap.h"
 
 struct multiboot_info multibootInfo;
 
 static const char *BOOTLOADER_NAME = "stoomboot-1.3";
 
+static multiboot_module_t ioStatsModule;
+
 static VbeInfoBlock     vbeBootInfo;
 static VbeModeInfoBlock vbeBootModeInfo;
 
+/**
+ * \brief Build the drives table, for all BIOS disks with drive parameters.
+ *
+ * Each entry is a variable-length structure with a zero-terminated list of
+ * I/O ports, as described by the Multiboot specification.
+ *
+ * \param[out] length the size of the table in bytes
+ *
+ * \return the table, in the loader heap, or NULL if there are no drives
+ */
+static uint8_t *generateDrivesTable(uint32_t *length) {
+	uint32_t size = 0;
+	for (uint32_t i=0; i<diskCount; i++) {
+		if (disks[i].blockSize && !disks[i].virtual)
+			size += 12 + (!!disks[i].ioPorts[0] + !!disks[i].ioPorts[1]) * 2;
+	}
+	if (!size)
+		return NULL;
+
+	uint8_t *table = heapAlloc(size);
+	if (!table)
+		return NULL;
+
+	uint8_t *entry = table;
+	for (uint32_t i=0; i<diskCount; i++) {
+		Disk *disk = &disks[i];
+		if (!disk->blockSize || disk->virtual)
+			continue;
+
+		uint16_t *ports = (uint16_t*)(entry + 10);
+		for (int j=0; j<2; j++) {
+			if (disk->ioPorts[j])
+				*ports++ = disk->ioPorts[j];
+		}
+		*ports++ = 0;
+
+		*(uint32_t*)entry       = (uint8_t*)ports - entry;
+		entry[4]                = disk->biosId;
+		entry[5]                = 1; // LBA mode.
+		*(uint16_t*)(entry + 6) = disk->cylinders;
+		entry[8]                = disk->heads;
+		entry[9]                = disk->sectorsPerTrack;
+
+		entry = (uint8_t*)ports;
+	}
+
+	*length = size;
+	return table;
+}
+
 void generateMultibootInfo(Partition *bootPartition) {
 
 	memset(&multibootInfo, 0, sizeof(multibootInfo));
@@ -36,9 +89,26 @@ void generateMultibootInfo(Partition *bootPartition) {
 	ConfigOption *cmdLine = getConfigOption("cmdline");
 	multibootInfo.cmdline = (uint32_t)cmdLine->value.valStr;
 
-	// Modules are not supported.
-	multibootInfo.mods_count = 0;
-	multibootInfo.mods_addr  = 0;
+	// Modules are not supported, except for our own disk I/O statistics.
+	memset(&ioStatsModule, 0, sizeof(ioStatsModule));
+	if (!ioStatsExport(&ioStatsModule.mod_start, &ioStatsModule.mod_end)) {
+		ioStatsModule.cmdline = (uint32_t)IO_STATS_MODULE_NAME;
+
+		multibootInfo.mods_count = 1;
+		multibootInfo.mods_addr  = (uint32_t)&ioStatsModule;
+		multibootInfo.flags     |= MULTIBOOT_INFO_MODS;
+	} else {
+		multibootInfo.mods_count = 0;
+		multibootInfo.mods_addr  = 0;
+	}
+
+	uint32_t drivesLength = 0;
+	uint8_t *drives = generateDrivesTable(&drivesLength);
+	if (drives) {
+		multibootInfo.drives_length = drivesLength;
+		multibootInfo.drives_addr   = (uint32_t)drives;
+		multibootInfo.flags        |= MULTIBOOT_INFO_DRIVE_INFO;
+	}
 
 	// Not supported.
 	//memset(&multibootInfo.u.elf_sec, 0, sizeof(multibootInfo.u.elf_sec));
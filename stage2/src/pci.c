@@ -0,0 +1,69 @@
+/**
+ * \file
+ * \brief     PCI configuration space access.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#include "pci.h"
+
+#if CONFIG_PCI
+
+#include "ioport.h"
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA    0xcfc
+
+uint32_t pciRead(uint32_t addr, uint8_t reg) {
+	outl(PCI_CONFIG_ADDRESS, 0x80000000 | addr | (reg & 0xfc));
+	return inl(PCI_CONFIG_DATA);
+}
+
+void pciWrite(uint32_t addr, uint8_t reg, uint32_t value) {
+	outl(PCI_CONFIG_ADDRESS, 0x80000000 | addr | (reg & 0xfc));
+	outl(PCI_CONFIG_DATA, value);
+}
+
+bool pciNextFunction(uint32_t *addr) {
+	uint32_t next = *addr == PCI_ADDRESS_NONE ? 0 : *addr + PCI_ADDRESS(0, 0, 1);
+
+	for (; next < PCI_ADDRESS(256, 0, 0); next += PCI_ADDRESS(0, 0, 1)) {
+		if (
+			   PCI_ADDRESS_FUNCTION(next)
+			&& !(pciRead(next & ~PCI_ADDRESS(0, 0, 7), PCI_REG_HEADER) & 0x800000)
+		) {
+			// Not a multi-function device, skip to the next device.
+			next |= PCI_ADDRESS(0, 0, 7);
+			continue;
+		}
+		if ((pciRead(next, PCI_REG_VENDOR_ID) & 0xffff) != 0xffff) {
+			*addr = next;
+			return true;
+		} else if (!PCI_ADDRESS_FUNCTION(next)) {
+			// No device here at all.
+			next |= PCI_ADDRESS(0, 0, 7);
+		}
+	}
+
+	return false;
+}
+
+uint32_t pciGetBar(uint32_t addr, uint8_t bar) {
+	uint32_t value = pciRead(addr, PCI_REG_BAR0 + bar * 4);
+
+	if (value & 1)
+		return value & 0xfffc; // I/O space.
+
+	if ((value & 0x6) == 0x4 && bar < 5 && pciRead(addr, PCI_REG_BAR0 + (bar + 1) * 4))
+		return 0; // 64-bit BAR above 4G, out of reach.
+
+	return value & 0xfffffff0;
+}
+
+void pciEnable(uint32_t addr, uint16_t bits) {
+	uint32_t command = pciRead(addr, PCI_REG_COMMAND);
+	// Write the status half back as zero, its bits are write-1-to-clear.
+	pciWrite(addr, PCI_REG_COMMAND, (command & 0xffff) | bits);
+}
+
+#endif /* CONFIG_PCI */
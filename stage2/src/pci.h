@@ -0,0 +1,88 @@
+/**
+ * \file
+ * \brief     PCI configuration space access.
+ * \author    Chris Smeele
+ * \copyright Copyright (c) 2015-2018, Chris Smeele. All rights reserved.
+ * \license   MIT. See LICENSE for the full license text.
+ */
+#ifndef _PCI_H
+#define _PCI_H
+
+#include "common.h"
+
+#ifndef CONFIG_PCI
+#define CONFIG_PCI 0 ///< Enabled by the native disk drivers that need it.
+#endif /* CONFIG_PCI */
+
+/**
+ * \brief Encode a PCI function address, as used by the other PCI functions.
+ */
+#define PCI_ADDRESS(bus, device, function) \
+	((uint32_t)(bus) << 16 | (uint32_t)(device) << 11 | (uint32_t)(function) << 8)
+
+#define PCI_ADDRESS_BUS(addr)      (((addr) >> 16) & 0xff)
+#define PCI_ADDRESS_DEVICE(addr)   (((addr) >> 11) & 0x1f)
+#define PCI_ADDRESS_FUNCTION(addr) (((addr) >>  8) & 0x07)
+
+/// Start value for pciNextFunction().
+#define PCI_ADDRESS_NONE 0xffffffff
+
+#define PCI_REG_VENDOR_ID  0x00 ///< Vendor ID (low word), device ID (high word).
+#define PCI_REG_COMMAND    0x04 ///< Command (low word), status (high word).
+#define PCI_REG_CLASS      0x08 ///< Revision, prog-if, subclass, class.
+#define PCI_REG_HEADER     0x0c ///< Header type in byte 2.
+#define PCI_REG_BAR0       0x10
+#define PCI_REG_CAPABILITY 0x34
+
+#define PCI_COMMAND_IO         0x0001
+#define PCI_COMMAND_MEMORY     0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+
+/**
+ * \brief Read a dword from a function's configuration space.
+ *
+ * \param addr a PCI_ADDRESS()
+ * \param reg a dword-aligned register offset
+ *
+ * \return
+ */
+uint32_t pciRead(uint32_t addr, uint8_t reg);
+
+/**
+ * \brief Write a dword to a function's configuration space.
+ *
+ * \param addr a PCI_ADDRESS()
+ * \param reg a dword-aligned register offset
+ * \param value
+ */
+void pciWrite(uint32_t addr, uint8_t reg, uint32_t value);
+
+/**
+ * \brief Find the next present PCI function.
+ *
+ * \param addr the previous function, or PCI_ADDRESS_NONE to start at the
+ *             first function. Will be set to the found function.
+ *
+ * \return false when there are no more functions
+ */
+bool pciNextFunction(uint32_t *addr);
+
+/**
+ * \brief Get a base address register as a physical address.
+ *
+ * \param addr
+ * \param bar BAR number, 0-5
+ *
+ * \return an I/O port or memory address, or 0 if unset or above 4G
+ */
+uint32_t pciGetBar(uint32_t addr, uint8_t bar);
+
+/**
+ * \brief Enable the given PCI_COMMAND_* bits for a function.
+ *
+ * \param addr
+ * \param bits
+ */
+void pciEnable(uint32_t addr, uint16_t bits);
+
+#endif /* _PCI_H */
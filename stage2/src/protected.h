@@ -12,7 +12,9 @@
 
 /**
  * \brief Enable protected mode and jump to a 32-bit entrypoint.
+ *
+ * Implemented in protected.asm, which takes the entrypoint on the stack.
  */
-void enterProtectedMode(uint32_t entrypoint) __attribute__((noreturn));
+void enterProtectedMode(uint32_t entrypoint) __attribute__((noreturn, regparm(0)));
 
 #endif /* _PROTECTED_H */
@@ -15,7 +15,7 @@ int parseRcFile(FileInfo *file) {
 
 	Partition *part = file->partition;
 
-	uint8_t buffer[part->disk->blockSize];
+	uint8_t *buffer = diskBlockBuffer(DISK_BLOCK_BUFFER_RCFILE);
 	char  cmdLine[SHELL_INPUT_BUFFER_SIZE] = { };
 	char *argList[SHELL_MAX_ARG_COUNT]     = { };
 
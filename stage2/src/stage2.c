@@ -9,6 +9,7 @@
 #include "unreal.h"
 #include "console.h"
 #include "memmap.h"
+#include "heap.h"
 #include "rcfile.h"
 #include "config.h"
 #include "shell.h"
@@ -19,6 +20,7 @@ extern uint32_t _BSS_END;
 
 Partition *loaderPart = NULL;
 
+__attribute__((regparm(0)))
 void stage2Main(uint32_t bootDiskNo, uint64_t loaderFsId) {
 
 	// Nobody cleared this area for us.
@@ -29,10 +31,13 @@ void stage2Main(uint32_t bootDiskNo, uint64_t loaderFsId) {
 
 	enableUnrealMode();
 
+	if (initHeap())
+		panic("error: Could not place the loader heap, no int 15h 0xe820 memory map or extended memory.");
+
 	if (makeMemMap())
 		panic("error: int 15h 0xe820 for memory mapping is not supported by your BIOS.");
 
-	if (disksDiscover() <= 0)
+	if (disksDiscover(bootDiskNo) <= 0)
 		// We did not detect any usable disks, abort.
 		panic("No usable disk drives detected.");
 
@@ -20,9 +20,11 @@ extern Partition *loaderPart;
 /**
  * \brief Stage 2 C entrypoint.
  *
+ * Called from start.asm, which passes the arguments on the stack.
+ *
  * \param bootDiskNo the BIOS boot disk number (usually 80h)
  * \param loaderFsId the bootloader's filesystem UUID
  */
-void stage2Main(uint32_t bootDiskNo, uint64_t loaderFsId) __attribute__((noreturn));
+void stage2Main(uint32_t bootDiskNo, uint64_t loaderFsId) __attribute__((noreturn, regparm(0)));
 
 #endif /* _STAGE2_H */
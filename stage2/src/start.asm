@@ -11,10 +11,19 @@ extern stage2Main
 global start
 global _start
 
+;; Where stage1 loads us, keep in sync with stage1.
+STAGE2_LOAD_ADDR equ 0x20000
+;; Where we're linked, keep in sync with stage2.ld.
+STAGE2_LINK_ADDR equ 0x0800
+;; Top of the stack, which grows down towards the end of the image.
+STACK_TOP        equ 0xfff0
+
+extern _STAGE2_END
+
 SECTION .data
 
 u16_boot_device: dw 0
-u16_fs_id_ptr:   dw 0
+u64_fs_id:       dq 0
 
 s_loading: db "stage2", 0x0d, 0x0a, 0
 
@@ -24,27 +33,54 @@ _start:
 	db 0xfa, 0xf4     ; cli, hlt
 	db "STAGE2", 2, 0 ; magic!
 
-jmp start
+	; We are loaded at a 64K boundary, as some BIOSes cannot read across
+	; one, and linked in the first 64K segment. Move ourselves into place,
+	; using position-independent code only.
+	cli
+	xor cx, cx
+	mov ds, cx
+	mov ss, cx
+	mov sp, STAGE2_LINK_ADDR ; A temporary stack right below our destination.
+
+	; Save the boot device and the FS id, which lives in stage1 and is about to
+	; be overwritten.
+	mov si, dx
+	push dword [si + 4]
+	push dword [si]
+	push ax
+
+	mov cx, STAGE2_LOAD_ADDR >> 4
+	mov ds, cx
+	mov cx, STAGE2_LINK_ADDR >> 4
+	mov es, cx
+	xor si, si
+	xor di, di
+	cld
+
+	; The image ends below 64K, so it does not overlap our load address.
+	mov cx, _STAGE2_END
+	sub cx, STAGE2_LINK_ADDR
+	rep movsb
+	jmp 0x0000:start
 
 SECTION .text
 
 start:
-	mov [u16_boot_device], ax
-	mov [u16_fs_id_ptr], dx
-
-	cli
-	; Set up the stack, again.
-	; Both clang and GCC seem to have problems when the stack is in a different
-	; segment than the rest of the program.
-	xor eax, eax
-	mov ss, eax
-	mov esp, 0x7dff ; Right below the start of stage2, overwriting stage1.
-	; Reset segment registers, just in case.
+	; Reset segment registers.
 	xor eax, eax
 	mov ds, eax
 	mov es, eax
 	mov fs, eax
 	mov gs, eax
+
+	pop word  [u16_boot_device]
+	pop dword [u64_fs_id]
+	pop dword [u64_fs_id + 4]
+
+	; Set up the stack, again.
+	; Both clang and GCC seem to have problems when the stack is in a different
+	; segment than the rest of the program.
+	mov esp, STACK_TOP
 	sti
 
 	mov esi, s_loading
@@ -53,14 +89,10 @@ start:
 	mov ebp, esp
 
 	; Push the FS id parameter.
-	mov si, [u16_fs_id_ptr]
-	mov eax, [si + 4]
-	push eax
-	lodsd
-	push eax
+	push dword [u64_fs_id + 4]
+	push dword [u64_fs_id]
 
 	; Push the boot device parameter.
-	mov esi, [u16_fs_id_ptr]
 	xor eax, eax
 	mov ax, [u16_boot_device]
 	push eax
@@ -30,6 +30,18 @@ gdt:
 		at GdtEntry.flags,       db 1100b << 4 | 0xf ; Page granularity (4K), 32-bits mode.
 		at GdtEntry.baseHigh,    db 0x00
 	iend
+.stackSelector:
+	; GCC may address any memory through ebp, which uses the stack segment.
+	; Like the data segment, but 16-bit so that implicit stack operations keep
+	; using sp.
+	istruc GdtEntry
+		at GdtEntry.limitLow,    dw 0xffff
+		at GdtEntry.baseLow,     dw 0x0000
+		at GdtEntry.baseMiddle,  db 0x00
+		at GdtEntry.accessFlags, db 10010010b        ; Present, ring 0, rw.
+		at GdtEntry.flags,       db 1000b << 4 | 0xf ; Page granularity (4K), 16-bits mode.
+		at GdtEntry.baseHigh,    db 0x00
+	iend
 	.end:
 
 gdtPtr:
@@ -50,18 +62,34 @@ enableUnrealMode:
 	cli
 
 	push ds
+	push es
+	push fs
+	push gs
+	push ss
 
 	lgdt [gdtPtr]
 	mov eax, cr0
 	or al, 1
 	mov cr0, eax ; Enable protected mode.
 
+	; Load segment selectors. Compiled code and the string instructions in
+	; common.c use all of them with 32-bit offsets.
 	mov bx, 1*8
-	mov ds, bx ; Load data segment selector.
+	mov ds, bx
+	mov es, bx
+	mov fs, bx
+	mov gs, bx
+	mov bx, 2*8
+	mov ss, bx
 
 	and al, 0xfe
 	mov cr0, eax ; Disable protected mode.
 
+	; Reloading segment registers in real mode keeps the new limits.
+	pop ss
+	pop gs
+	pop fs
+	pop es
 	pop ds
 
 	sti
@@ -140,7 +168,7 @@ enableA20:
 	jnz .haveA20
 
 	mov eax, s_a20Error ; Give up.
-	push eax
+	; C functions take their first three arguments in eax, edx and ecx.
 	extern puts
 	call long puts
 
@@ -13,7 +13,8 @@
 /**
  * \brief Enable unreal mode to allow 32-bit data address offsets.
  *
- * Also enables the A20 address line.
+ * All data segment registers, including ss, get a 4G limit. Also enables the
+ * A20 address line.
  */
 void enableUnrealMode();
 
@@ -81,7 +81,8 @@ if (defined $o_stage2) {
 	$o_stage2_blocks = int (@stage2 / 512 + (@stage2 % 512 ? 1 : 0));
 }
 
-die "$0: stage2 too large (max 64K)\n" if length($o_stage2_blocks) > 64*1024;
+# stage1 reads stage2 with a single int13h call into one 64K page.
+die "$0: stage2 too large (max 127 sectors)\n" if $o_stage2_blocks > 127;
 
 if ($o_mbr) {
 	die "$0: no mbr stage1 image specified\n" if not defined $o_stage1_mbr;